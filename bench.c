@@ -0,0 +1,364 @@
+#include "inttypes.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "time.h"
+#include "sys/resource.h"
+#include "sys/time.h"
+#include "sys/wait.h"
+
+#include "workqueue.h"
+#include "primesieve.h"
+#include "mandelbrot.h"
+#include "log.h"
+
+// Benchmarks for the sieve and the work queue, written as JSON to stdout.
+//
+// Every measurement runs in a child process, so its peak RSS can be reported on its
+// own, and anything the code under test logs does not end up in the JSON.
+
+#define QUEUE_UNITS 1000000 ///< Units per work queue microbenchmark.
+#define MANDELBROT_SIZE 2048 ///< Width and height of the rendered frame.
+#define MANDELBROT_ITER 1000
+
+static const uint64_t ranges[]     = { 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL };
+static const double   unit_times[] = { 0.001, 0.01, 0.1 };
+#define range_count     (sizeof(ranges)/sizeof(ranges[0]))
+#define unit_time_count (sizeof(unit_times)/sizeof(unit_times[0]))
+
+typedef struct {
+  double   seconds;
+  uint64_t count;   ///< Primes found, or units processed.
+  uint64_t skipped; ///< Mandelbrot pixels filled in without iterating them.
+  long     max_rss; ///< Kilobytes, filled in by the parent.
+  int      failed;
+} measurement_t;
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "Usage: %s [-n max_range] [-t max_threads] [-q]\n"
+          "  -n  Largest range to sieve (default 1000000000, at most 10000000000)\n"
+          "  -t  Largest number of threads (default: the number of available CPUs)\n"
+          "  -q  Only run the work queue microbenchmark\n",
+          name);
+}
+
+static double now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1000000000.0;
+}
+
+// Run bench(args) in a child process and collect its measurement and peak RSS.
+static measurement_t run_isolated(void (*bench)(const void* args, measurement_t* result), const void* args)
+{
+  measurement_t result;
+  memset(&result, 0, sizeof(result));
+  result.failed = 1;
+
+  int fds[2];
+  if(pipe(fds)) return result;
+
+  pid_t child = fork();
+  if(child == 0)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(fds[0]);
+
+    measurement_t measured;
+    memset(&measured, 0, sizeof(measured));
+    bench(args, &measured);
+    if(write(fds[1], &measured, sizeof(measured)) != sizeof(measured)) _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  if(child < 0)
+  {
+    close(fds[0]);
+    return result;
+  }
+
+  int status;
+  struct rusage usage;
+  if(read(fds[0], &result, sizeof(result)) != sizeof(result)) result.failed = 1;
+  close(fds[0]);
+  wait4(child, &status, 0, &usage);
+  if(! WIFEXITED(status) || WEXITSTATUS(status) != 0) result.failed = 1;
+  result.max_rss = usage.ru_maxrss;
+
+  return result;
+}
+
+typedef struct {
+  uint64_t range;
+  size_t   threads;
+  double   unit_time;
+} sieve_args_t;
+
+static void bench_sieve(const void* arg, measurement_t* result)
+{
+  const sieve_args_t* args = arg;
+
+  primesieve_t sieve = create_primesieve_with_storage(args->range, PRIMESIEVE_STORE_NONE);
+  work_queue_t queue = create_work_queue(0, sieve,
+                                         primesieve_do_work,
+                                         primesieve_request_work,
+                                         primesieve_report_results);
+  queue_set_target_unit_time(queue, args->unit_time);
+
+  double start = now();
+  queue_set_worker_count(queue, args->threads);
+  queue_wait_until_finished(queue);
+  result->seconds = now() - start;
+
+  result->count = primesieve_count(sieve);
+  destroy_work_queue(queue);
+  destroy_primesieve(sieve);
+}
+
+typedef struct {
+  size_t              threads;
+  mandelbrot_kernel_t kernel;
+} mandelbrot_args_t;
+
+static void bench_mandelbrot(const void* arg, measurement_t* result)
+{
+  const mandelbrot_args_t* args = arg;
+  mandelbrot_view_t view = { .center_re = fixed_from_double(-0.75), .span = 3.0,
+                             .width = MANDELBROT_SIZE, .height = MANDELBROT_SIZE, .max_iter = MANDELBROT_ITER };
+
+  mandelbrot_t mandelbrot = create_mandelbrot(&view);
+  if(! mandelbrot || mandelbrot_set_kernel(mandelbrot, args->kernel))
+  {
+    result->failed = 1;
+    return;
+  }
+  work_queue_t queue = create_work_queue(0, mandelbrot,
+                                         mandelbrot_do_work,
+                                         mandelbrot_request_work,
+                                         mandelbrot_report_results);
+
+  double start = now();
+  queue_set_worker_count(queue, args->threads);
+  queue_wait_until_finished(queue);
+  result->seconds = now() - start;
+
+  result->count   = mandelbrot_total_iterations(mandelbrot);
+  result->skipped = mandelbrot_skipped_pixels(mandelbrot);
+  destroy_work_queue(queue);
+  destroy_mandelbrot(mandelbrot);
+}
+
+typedef struct {
+  size_t            threads;
+  queue_scheduler_t scheduler;
+  size_t            batch_size;
+} queue_args_t;
+
+typedef struct {
+  uint64_t dispensed;
+  uint64_t reported;
+} queue_counter_t;
+
+static void* empty_request(work_queue_t queue, size_t worker_id)
+{
+  queue_counter_t* counter = queue_get_private_data(queue);
+  if(counter->dispensed == QUEUE_UNITS) return NULL;
+  counter->dispensed++;
+  return counter; // Any non-NULL pointer will do.
+}
+
+static void empty_report(work_queue_t queue, size_t worker_id, void* results)
+{
+  queue_counter_t* counter = queue_get_private_data(queue);
+  counter->reported++;
+}
+
+static void* empty_work(void* work_desc)
+{
+  return work_desc;
+}
+
+static void bench_queue(const void* arg, measurement_t* result)
+{
+  const queue_args_t* args = arg;
+  queue_counter_t counter = { 0, 0 };
+
+  work_queue_t queue = create_work_queue_with_scheduler(0, &counter,
+                                                        empty_work,
+                                                        empty_request,
+                                                        empty_report,
+                                                        args->scheduler);
+  queue_set_batch_size(queue, args->batch_size, 0);
+
+  double start = now();
+  queue_set_worker_count(queue, args->threads);
+  queue_wait_until_finished(queue);
+  result->seconds = now() - start;
+
+  destroy_work_queue(queue);
+  result->count = counter.reported;
+  result->failed = counter.reported != QUEUE_UNITS;
+}
+
+static void print_separator(int* first)
+{
+  printf(*first ? "\n" : ",\n");
+  *first = 0;
+}
+
+#define JSON_VALUE_SIZE 32
+
+// Format a value derived from a run's time, or null when there is no time to derive it
+// from: inf and nan are not valid JSON.
+static const char* json_value(char* buffer, const char* format, double value, int valid)
+{
+  if(! valid) return "null";
+  snprintf(buffer, JSON_VALUE_SIZE, format, value);
+  return buffer;
+}
+
+int main(int argc, char** argv)
+{
+  uint64_t max_range = 1000000000ULL;
+  size_t cpus = queue_default_worker_count();
+  size_t max_threads = cpus;
+  int queue_only = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "n:t:qh")) != -1)
+  {
+    switch(opt)
+    {
+    case 'n':
+      max_range = strtoull(optarg, NULL, 0);
+      break;
+    case 't':
+      max_threads = strtoul(optarg, NULL, 0);
+      if(max_threads == 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'q':
+      queue_only = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt != 'h';
+    }
+  }
+
+  // Thread counts: powers of two, and max_threads itself.
+  size_t thread_counts[64], thread_count = 0;
+  for(size_t threads = 1; threads < max_threads; threads *= 2)
+    thread_counts[thread_count++] = threads;
+  thread_counts[thread_count++] = max_threads;
+
+  printf("{\n  \"cpus\": %zu,\n  \"sieve\": [", cpus);
+  int first = 1;
+  for(size_t r = 0; r < range_count && ranges[r] <= max_range && ! queue_only; r++)
+  {
+    for(size_t u = 0; u < unit_time_count; u++)
+    {
+      double baseline = 0;
+      for(size_t t = 0; t < thread_count; t++)
+      {
+        sieve_args_t args = { ranges[r], thread_counts[t], unit_times[u] };
+        fprintf(stderr, "Sieving up to %" PRIu64 " with %zu threads, %g s per unit\n",
+                args.range, args.threads, args.unit_time);
+
+        measurement_t result = run_isolated(bench_sieve, &args);
+        int valid = ! result.failed && result.seconds > 0;
+        if(t == 0) baseline = valid ? result.seconds : 0;
+
+        char numbers[JSON_VALUE_SIZE], primes[JSON_VALUE_SIZE], efficiency[JSON_VALUE_SIZE];
+        print_separator(&first);
+        printf("    { \"range\": %" PRIu64 ", \"threads\": %zu, \"unit_time\": %g, \"failed\": %s,"
+               " \"seconds\": %.6f, \"primes\": %" PRIu64 ", \"numbers_per_second\": %s,"
+               " \"primes_per_second\": %s, \"parallel_efficiency\": %s, \"max_rss_kb\": %ld }",
+               args.range, args.threads, args.unit_time, result.failed ? "true" : "false",
+               result.seconds, result.count,
+               json_value(numbers, "%.0f", args.range / result.seconds, valid),
+               json_value(primes, "%.0f", result.count / result.seconds, valid),
+               json_value(efficiency, "%.3f", baseline / (args.threads * result.seconds), valid && baseline > 0),
+               result.max_rss);
+        fflush(stdout);
+      }
+    }
+  }
+
+  printf("\n  ],\n  \"mandelbrot\": [");
+  first = 1;
+  for(mandelbrot_kernel_t kernel = MANDELBROT_KERNEL_SCALAR; kernel <= MANDELBROT_KERNEL_AVX512 && ! queue_only; kernel++)
+  {
+    double baseline = 0;
+    for(size_t t = 0; t < thread_count; t++)
+    {
+      mandelbrot_args_t args = { thread_counts[t], kernel };
+      fprintf(stderr, "Rendering %dx%d pixels with %zu threads, %s kernel\n",
+              MANDELBROT_SIZE, MANDELBROT_SIZE, args.threads, mandelbrot_kernel_name(kernel));
+
+      measurement_t result = run_isolated(bench_mandelbrot, &args);
+      if(result.failed) break; // Not supported by this CPU.
+      int valid = result.seconds > 0;
+      if(t == 0) baseline = valid ? result.seconds : 0;
+
+      char iterations[JSON_VALUE_SIZE], pixels[JSON_VALUE_SIZE], efficiency[JSON_VALUE_SIZE];
+      print_separator(&first);
+      printf("    { \"kernel\": \"%s\", \"threads\": %zu, \"size\": %d, \"max_iter\": %d,"
+             " \"seconds\": %.6f, \"iterations\": %" PRIu64 ", \"iterations_per_second\": %s,"
+             " \"pixels_per_second\": %s, \"skipped_pixels\": %" PRIu64 ", \"parallel_efficiency\": %s,"
+             " \"max_rss_kb\": %ld }",
+             mandelbrot_kernel_name(kernel), args.threads, MANDELBROT_SIZE, MANDELBROT_ITER,
+             result.seconds, result.count,
+             json_value(iterations, "%.0f", result.count / result.seconds, valid),
+             json_value(pixels, "%.0f", (double)MANDELBROT_SIZE * MANDELBROT_SIZE / result.seconds, valid),
+             result.skipped,
+             json_value(efficiency, "%.3f", baseline / (args.threads * result.seconds), valid && baseline > 0),
+             result.max_rss);
+      fflush(stdout);
+    }
+  }
+
+  printf("\n  ],\n  \"queue\": [");
+  first = 1;
+  const queue_scheduler_t schedulers[] = { QUEUE_SCHEDULER_GLOBAL, QUEUE_SCHEDULER_STEALING };
+  const size_t batch_sizes[] = { 1, 16 };
+  for(size_t s = 0; s < 2; s++)
+  {
+    for(size_t b = 0; b < 2; b++)
+    {
+      for(size_t t = 0; t < thread_count; t++)
+      {
+        queue_args_t args = { thread_counts[t], schedulers[s], batch_sizes[b] };
+        fprintf(stderr, "Running %d empty units with %zu threads, %s scheduler, batches of %zu\n",
+                QUEUE_UNITS, args.threads, s ? "stealing" : "global", args.batch_size);
+
+        measurement_t result = run_isolated(bench_queue, &args);
+        int valid = ! result.failed && result.seconds > 0;
+
+        char units[JSON_VALUE_SIZE], unit_time[JSON_VALUE_SIZE];
+        print_separator(&first);
+        printf("    { \"scheduler\": \"%s\", \"batch_size\": %zu, \"threads\": %zu, \"failed\": %s,"
+               " \"seconds\": %.6f, \"units_per_second\": %s, \"ns_per_unit\": %s, \"max_rss_kb\": %ld }",
+               s ? "stealing" : "global", args.batch_size, args.threads, result.failed ? "true" : "false",
+               result.seconds,
+               json_value(units, "%.0f", result.count / result.seconds, valid),
+               json_value(unit_time, "%.1f", result.seconds * 1e9 / QUEUE_UNITS, valid),
+               result.max_rss);
+        fflush(stdout);
+      }
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  return 0;
+}
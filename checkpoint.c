@@ -0,0 +1,361 @@
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "time.h"
+#include "sys/stat.h"
+
+#include "checkpoint.h"
+#include "primestore.h"
+#include "log.h"
+
+#define INIT_PRIMES 4096
+#define LOAD_BATCH  4096 ///< Primes passed to a checkpoint_load_fp at once.
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+} header_t;
+
+typedef struct {
+  uint64_t count;  ///< Primes in this record.
+  uint64_t bytes;  ///< Size of the encoded gaps that follow.
+  checkpoint_state_t state;
+} record_t;
+
+typedef struct {
+  uint64_t checksum; ///< Of the record header and the gaps.
+  uint64_t magic;
+} trailer_t;
+
+// A list of primes waiting to be written, with the state that goes with them.
+typedef struct {
+  uint64_t* primes;
+  size_t    count;
+  size_t    capacity;
+  checkpoint_state_t state;
+} batch_t;
+
+struct checkpoint
+{
+  int       fd;
+  double    interval;
+  struct timespec last_update;
+
+  batch_t   pending;    ///< Filled by checkpoint_append, only touched by the producer.
+  batch_t   writing;    ///< Handed to the background thread.
+  uint64_t  last;       ///< Last prime written, the gaps of the next record start from it.
+  uint8_t*  buffer;
+  size_t    buffer_size;
+
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int       busy;       ///< writing holds a record that has not been written yet.
+  int       closing;
+  int       failed;
+};
+
+static int write_all(int fd, const void* data, size_t size)
+{
+  while(size)
+  {
+    ssize_t written = write(fd, data, size);
+    if(written < 0)
+    {
+      if(errno == EINTR) continue;
+      vlog("Failed to write checkpoint: %s", strerror(errno));
+      return 1;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void* data, size_t size)
+{
+  while(size)
+  {
+    ssize_t count = read(fd, data, size);
+    if(count < 0 && errno == EINTR) continue;
+    if(count <= 0) return 1;
+    data += count;
+    size -= count;
+  }
+  return 0;
+}
+
+// FNV-1a, enough to tell a complete record from one that was cut short.
+static uint64_t checksum(uint64_t hash, const void* data, size_t size)
+{
+  const uint8_t* bytes = data;
+  for(size_t i = 0; i < size; i++)
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+static void write_record(checkpoint_t checkpoint, batch_t* batch)
+{
+  // A gap never takes more than 10 bytes.
+  if(checkpoint->buffer_size < 10 * batch->count)
+  {
+    checkpoint->buffer_size = 10 * batch->count;
+    checkpoint->buffer = realloc(checkpoint->buffer, checkpoint->buffer_size);
+  }
+
+  record_t record = { batch->count, 0, batch->state };
+  for(size_t i = 0; i < batch->count; i++)
+  {
+    record.bytes += primestore_encode_gap(checkpoint->buffer + record.bytes, batch->primes[i] - checkpoint->last);
+    checkpoint->last = batch->primes[i];
+  }
+
+  trailer_t trailer;
+  trailer.checksum = checksum(checksum(0xcbf29ce484222325ULL, &record, sizeof(record)),
+                              checkpoint->buffer, record.bytes);
+  trailer.magic = CHECKPOINT_MAGIC;
+
+  if(! checkpoint->failed)
+    checkpoint->failed = write_all(checkpoint->fd, &record, sizeof(record))
+                      || write_all(checkpoint->fd, checkpoint->buffer, record.bytes)
+                      || write_all(checkpoint->fd, &trailer, sizeof(trailer));
+  if(! checkpoint->failed && fdatasync(checkpoint->fd))
+  {
+    vlog("Failed to sync checkpoint: %s", strerror(errno));
+    checkpoint->failed = 1;
+  }
+
+  dlog("Checkpoint %p: %" PRIu64 " primes up to %" PRIu64 " written.",
+       checkpoint, batch->state.total, batch->state.max_checked);
+  batch->count = 0;
+}
+
+static void* checkpoint_thread(void* arg)
+{
+  checkpoint_t checkpoint = arg;
+
+  pthread_mutex_lock(&checkpoint->lock);
+  while(1)
+  {
+    while(! checkpoint->busy && ! checkpoint->closing)
+      pthread_cond_wait(&checkpoint->cond, &checkpoint->lock);
+    if(! checkpoint->busy) break;
+
+    pthread_mutex_unlock(&checkpoint->lock);
+    write_record(checkpoint, &checkpoint->writing);
+    pthread_mutex_lock(&checkpoint->lock);
+
+    checkpoint->busy = 0;
+    pthread_cond_broadcast(&checkpoint->cond);
+  }
+  pthread_mutex_unlock(&checkpoint->lock);
+
+  return NULL;
+}
+
+static checkpoint_t start_checkpoint(int fd, double interval, uint64_t last)
+{
+  checkpoint_t checkpoint = calloc(1, sizeof(struct checkpoint));
+
+  checkpoint->fd       = fd;
+  checkpoint->interval = interval;
+  checkpoint->last     = last;
+  checkpoint->pending.capacity = INIT_PRIMES;
+  checkpoint->pending.primes   = malloc(INIT_PRIMES * sizeof(uint64_t));
+  checkpoint->writing.capacity = INIT_PRIMES;
+  checkpoint->writing.primes   = malloc(INIT_PRIMES * sizeof(uint64_t));
+  clock_gettime(CLOCK_MONOTONIC, &checkpoint->last_update);
+
+  pthread_mutex_init(&checkpoint->lock, NULL);
+  pthread_cond_init(&checkpoint->cond, NULL);
+  pthread_create(&checkpoint->thread, NULL, checkpoint_thread, checkpoint);
+
+  return checkpoint;
+}
+
+checkpoint_t create_checkpoint(const char* path, double interval)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+  {
+    vlog("Failed to create checkpoint %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  header_t header = { CHECKPOINT_MAGIC, CHECKPOINT_VERSION, 0 };
+  if(write_all(fd, &header, sizeof(header)))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  return start_checkpoint(fd, interval, 0);
+}
+
+checkpoint_t resume_checkpoint(const char* path, double interval, checkpoint_state_t* state,
+                               checkpoint_load_fp load_func, void* priv_data)
+{
+  int fd = open(path, O_RDWR);
+  if(fd < 0)
+  {
+    vlog("Failed to open checkpoint %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  header_t header;
+  if(read_all(fd, &header, sizeof(header))
+     || header.magic != CHECKPOINT_MAGIC
+     || header.version != CHECKPOINT_VERSION)
+  {
+    vlog("%s is not a checkpoint file.", path);
+    close(fd);
+    return NULL;
+  }
+
+  struct stat info;
+  if(fstat(fd, &info))
+  {
+    vlog("Failed to read the size of checkpoint %s: %s", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  off_t    valid_size = sizeof(header);
+  size_t   records = 0;
+  uint64_t last = 0;
+  uint8_t* gaps = NULL;
+  uint64_t primes[LOAD_BATCH];
+  record_t record;
+  trailer_t trailer;
+
+  while(read_all(fd, &record, sizeof(record)) == 0)
+  {
+    // A damaged size could make us allocate more than the file holds.
+    if(record.bytes > (uint64_t)(info.st_size - valid_size) || record.bytes > 10 * record.count)
+    {
+      vlog("Checkpoint %s ends in an incomplete record, it will be dropped.", path);
+      break;
+    }
+
+    gaps = realloc(gaps, record.bytes + 1);
+    if(read_all(fd, gaps, record.bytes) || read_all(fd, &trailer, sizeof(trailer))
+       || trailer.magic != CHECKPOINT_MAGIC
+       || trailer.checksum != checksum(checksum(0xcbf29ce484222325ULL, &record, sizeof(record)),
+                                       gaps, record.bytes))
+    {
+      vlog("Checkpoint %s ends in an incomplete record, it will be dropped.", path);
+      break;
+    }
+
+    const uint8_t* pos = gaps;
+    for(uint64_t done = 0; done < record.count; )
+    {
+      size_t count = 0;
+      while(count < LOAD_BATCH && done < record.count)
+      {
+        last += primestore_decode_gap(&pos);
+        primes[count++] = last;
+        done++;
+      }
+      load_func(priv_data, primes, count);
+    }
+
+    *state = record.state;
+    valid_size += sizeof(record) + record.bytes + sizeof(trailer);
+    records++;
+  }
+  free(gaps);
+
+  if(records == 0)
+  {
+    vlog("Checkpoint %s holds no complete record.", path);
+    close(fd);
+    return NULL;
+  }
+
+  if(ftruncate(fd, valid_size) || lseek(fd, valid_size, SEEK_SET) < 0)
+  {
+    vlog("Failed to resume checkpoint %s: %s", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  vlog("Resumed checkpoint %s: %" PRIu64 " primes up to %" PRIu64 ".", path, state->total, state->max_checked);
+  return start_checkpoint(fd, interval, last);
+}
+
+void checkpoint_append(checkpoint_t checkpoint, const uint64_t* primes, size_t count)
+{
+  batch_t* batch = &checkpoint->pending;
+
+  if(batch->capacity < batch->count + count)
+  {
+    while(batch->capacity < batch->count + count)
+      batch->capacity *= 2;
+    batch->primes = realloc(batch->primes, batch->capacity * sizeof(uint64_t));
+  }
+  memcpy(batch->primes + batch->count, primes, count * sizeof(uint64_t));
+  batch->count += count;
+}
+
+void checkpoint_update(checkpoint_t checkpoint, const checkpoint_state_t* state)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(difftimespec(&now, &checkpoint->last_update) < checkpoint->interval) return;
+
+  // Never wait for the disk: if the previous record is still being written, try again later.
+  if(pthread_mutex_trylock(&checkpoint->lock)) return;
+  if(! checkpoint->busy)
+  {
+    batch_t written = checkpoint->writing;
+    checkpoint->writing = checkpoint->pending;
+    checkpoint->writing.state = *state;
+    checkpoint->pending = written;
+
+    checkpoint->busy = 1;
+    checkpoint->last_update = now;
+    pthread_cond_broadcast(&checkpoint->cond);
+  }
+  pthread_mutex_unlock(&checkpoint->lock);
+}
+
+int close_checkpoint(checkpoint_t checkpoint, const checkpoint_state_t* state)
+{
+  pthread_mutex_lock(&checkpoint->lock);
+  while(checkpoint->busy)
+    pthread_cond_wait(&checkpoint->cond, &checkpoint->lock);
+
+  batch_t written = checkpoint->writing;
+  checkpoint->writing = checkpoint->pending;
+  checkpoint->writing.state = *state;
+  checkpoint->pending = written;
+
+  checkpoint->busy    = 1;
+  checkpoint->closing = 1;
+  pthread_cond_broadcast(&checkpoint->cond);
+  pthread_mutex_unlock(&checkpoint->lock);
+
+  pthread_join(checkpoint->thread, NULL);
+
+  int failed = checkpoint->failed;
+  if(close(checkpoint->fd))
+  {
+    vlog("Failed to close checkpoint: %s", strerror(errno));
+    failed = 1;
+  }
+
+  pthread_cond_destroy(&checkpoint->cond);
+  pthread_mutex_destroy(&checkpoint->lock);
+  free(checkpoint->pending.primes);
+  free(checkpoint->writing.primes);
+  free(checkpoint->buffer);
+  free(checkpoint);
+
+  return failed;
+}
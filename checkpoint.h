@@ -0,0 +1,98 @@
+#ifndef _MANDELPRIME_CHECKPOINT_H_
+#define _MANDELPRIME_CHECKPOINT_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+/**
+ * This header offers checkpoint files, so long sieve runs can be resumed.
+ *
+ * A checkpoint file is a header (CHECKPOINT_MAGIC and the format version) followed by
+ * records. Every record holds the primes found since the previous record, as varint
+ * encoded gaps (@see primestore_encode_gap), and the state of the sieve at that point.
+ * Records end in a checksum, so a record that was cut short by a crash is detected
+ * and ignored when resuming.
+ *
+ * Records are written by a background thread. The sieve hands over the primes found
+ * since the last record and its state, and keeps going while they are written and
+ * synced to disk. If the previous record is still being written when the next one is
+ * due, the primes are kept until it is done, so the sieve never waits for the disk.
+ **/
+
+#define CHECKPOINT_MAGIC    0x314b434548434d4dULL // "MMCHECK1"
+#define CHECKPOINT_VERSION  1
+#define CHECKPOINT_INTERVAL 60.0 ///< Default seconds between records.
+
+/**
+ * Pointer type referring to a checkpoint file that is being written.
+ **/
+typedef struct checkpoint* checkpoint_t;
+
+/**
+ * State of a sieve, as stored in every record.
+ **/
+typedef struct {
+  uint64_t max_checked;  ///< Largest number checked for primality.
+  uint64_t total;        ///< Number of primes up to max_checked.
+  uint64_t largest;      ///< Largest prime up to max_checked.
+  uint64_t stored_limit; ///< All primes up to this bound are stored in the file.
+} checkpoint_state_t;
+
+/**
+ * Function pointer that receives the primes stored in a checkpoint file, in order.
+ **/
+typedef void (*checkpoint_load_fp)(void* priv_data, const uint64_t* primes, size_t count);
+
+/**
+ * Create a new, empty checkpoint file, replacing any existing file.
+ *
+ * @param path     Path of the file to create.
+ * @param interval Minimum number of seconds between records.
+ * @return A checkpoint writer, or NULL if the file could not be created.
+ **/
+checkpoint_t create_checkpoint(const char* path, double interval);
+
+/**
+ * Read an existing checkpoint file and continue writing records to it.
+ *
+ * All primes from the complete records are passed to load_func. Anything after the
+ * last complete record is cut off the file.
+ *
+ * @param path      Path of the file to resume.
+ * @param interval  Minimum number of seconds between records.
+ * @param state     Receives the state from the last complete record.
+ * @param load_func Function that receives the stored primes (@see checkpoint_load_fp).
+ * @param priv_data Passed to load_func.
+ * @return A checkpoint writer, or NULL if the file could not be read or holds no complete record.
+ **/
+checkpoint_t resume_checkpoint(const char* path, double interval, checkpoint_state_t* state,
+                               checkpoint_load_fp load_func, void* priv_data);
+
+/**
+ * Add primes to the next record. Not thread safe, use a single producer.
+ *
+ * @param checkpoint The checkpoint to add the primes to.
+ * @param primes     Ascending list of primes, all larger than the ones added before.
+ * @param count      Number of primes in the list.
+ **/
+void checkpoint_append(checkpoint_t checkpoint, const uint64_t* primes, size_t count);
+
+/**
+ * Hand the primes added so far to the background thread as a new record, if the
+ * interval has passed and the previous record has been written.
+ *
+ * @param checkpoint The checkpoint to update.
+ * @param state      State of the sieve, after all primes added so far.
+ **/
+void checkpoint_update(checkpoint_t checkpoint, const checkpoint_state_t* state);
+
+/**
+ * Write a final record, wait until everything is on disk and close the file.
+ *
+ * @param checkpoint The checkpoint to close.
+ * @param state      State of the sieve, after all primes added so far.
+ * @return 0 if every record was written successfully, non-zero otherwise.
+ **/
+int close_checkpoint(checkpoint_t checkpoint, const checkpoint_state_t* state);
+
+#endif // _MANDELPRIME_CHECKPOINT_H_
@@ -0,0 +1,290 @@
+#include "stdio.h"
+#include "string.h"
+#include "math.h"
+#include "ctype.h"
+
+#include "fixedpoint.h"
+
+// Digits we keep while parsing, more than FIXED_LIMBS limbs can tell apart.
+#define PARSE_DIGITS 1024
+
+// Bits of precision kept on top of the requested resolution, for the rounding errors
+// that build up along an orbit.
+#define SPARE_BITS 64
+
+static int is_zero(const fixed_t* value, size_t limbs)
+{
+  for(size_t i = 0; i < limbs; i++)
+    if(value->limb[i]) return 0;
+  return 1;
+}
+
+// Compare |a| to |b|, returns -1, 0 or 1.
+static int compare_magnitude(const fixed_t* a, const fixed_t* b, size_t limbs)
+{
+  for(size_t i = 0; i < limbs; i++)
+    if(a->limb[i] != b->limb[i])
+      return a->limb[i] < b->limb[i] ? -1 : 1;
+  return 0;
+}
+
+// |result| = |a| + |b|, from the least significant limb up.
+static void add_magnitude(fixed_t* result, const fixed_t* a, const fixed_t* b, size_t limbs)
+{
+  uint64_t carry = 0;
+  for(size_t i = limbs; i-- > 0;)
+  {
+    uint64_t sum = a->limb[i] + carry;
+    carry = sum < carry;
+    result->limb[i] = sum + b->limb[i];
+    carry += result->limb[i] < sum;
+  }
+}
+
+// |result| = |a| - |b|, for |a| >= |b|.
+static void sub_magnitude(fixed_t* result, const fixed_t* a, const fixed_t* b, size_t limbs)
+{
+  uint64_t borrow = 0;
+  for(size_t i = limbs; i-- > 0;)
+  {
+    uint64_t ai = a->limb[i], bi = b->limb[i];
+    result->limb[i] = ai - bi - borrow;
+    borrow = ai < bi || (ai == bi && borrow);
+  }
+}
+
+// value = value / 10, returns the remainder.
+static unsigned div10(fixed_t* value, size_t limbs)
+{
+  uint64_t remainder = 0;
+  for(size_t i = 0; i < limbs; i++)
+  {
+    unsigned __int128 current = ((unsigned __int128)remainder << 64) | value->limb[i];
+    value->limb[i] = (uint64_t)(current / 10);
+    remainder = (uint64_t)(current % 10);
+  }
+  return (unsigned)remainder;
+}
+
+// fraction = fraction * 10, returns the digit that moved into the integer part.
+static unsigned mul10_fraction(fixed_t* value, size_t limbs)
+{
+  uint64_t carry = 0;
+  for(size_t i = limbs; i-- > 1;)
+  {
+    unsigned __int128 current = (unsigned __int128)value->limb[i] * 10 + carry;
+    value->limb[i] = (uint64_t)current;
+    carry = (uint64_t)(current >> 64);
+  }
+  return (unsigned)carry;
+}
+
+fixed_t fixed_from_double(double value)
+{
+  fixed_t result;
+  memset(&result, 0, sizeof(result));
+  result.negative = value < 0;
+
+  double magnitude = fabs(value);
+  double integer = floor(magnitude);
+  result.limb[0] = (uint64_t)integer;
+  magnitude -= integer;
+
+  // Scaling by 2^64 is exact, so every limb takes the next 64 bits of the mantissa.
+  for(size_t i = 1; i < FIXED_LIMBS && magnitude != 0; i++)
+  {
+    magnitude = ldexp(magnitude, 64);
+    integer = floor(magnitude);
+    result.limb[i] = (uint64_t)integer;
+    magnitude -= integer;
+  }
+
+  if(result.limb[0] == 0 && is_zero(&result, FIXED_LIMBS)) result.negative = 0;
+  return result;
+}
+
+double fixed_to_double(const fixed_t* value)
+{
+  double result = 0;
+  for(size_t i = FIXED_LIMBS; i-- > 0;)
+    result = ldexp(result, -64) + (double)value->limb[i];
+  return value->negative ? -result : result;
+}
+
+void fixed_add(fixed_t* result, const fixed_t* a, const fixed_t* b, size_t limbs)
+{
+  if(a->negative == b->negative)
+  {
+    int negative = a->negative;
+    add_magnitude(result, a, b, limbs);
+    result->negative = negative;
+  }
+  else if(compare_magnitude(a, b, limbs) >= 0)
+  {
+    int negative = a->negative;
+    sub_magnitude(result, a, b, limbs);
+    result->negative = negative;
+  }
+  else
+  {
+    int negative = b->negative;
+    sub_magnitude(result, b, a, limbs);
+    result->negative = negative;
+  }
+  if(result->negative && is_zero(result, limbs)) result->negative = 0;
+}
+
+void fixed_sub(fixed_t* result, const fixed_t* a, const fixed_t* b, size_t limbs)
+{
+  fixed_t negated = *b;
+  negated.negative = ! b->negative && ! is_zero(b, limbs);
+  fixed_add(result, a, &negated, limbs);
+}
+
+void fixed_mul(fixed_t* result, const fixed_t* a, const fixed_t* b, size_t limbs)
+{
+  // Schoolbook multiplication, keeping one guard limb; products that only reach
+  // below it are dropped.
+  uint64_t product[FIXED_LIMBS + 1] = { 0 };
+
+  for(size_t i = 0; i < limbs; i++)
+  {
+    if(a->limb[i] == 0) continue;
+
+    uint64_t carry = 0;
+    for(size_t j = (i ? limbs - i : limbs - 1) + 1; j-- > 0;)
+    {
+      unsigned __int128 current = (unsigned __int128)a->limb[i] * b->limb[j] + product[i + j] + carry;
+      product[i + j] = (uint64_t)current;
+      carry = (uint64_t)(current >> 64);
+    }
+    // Carries past the integer part are overflow, which the caller has to avoid.
+    for(size_t k = i; carry && k-- > 0;)
+    {
+      product[k] += carry;
+      carry = product[k] < carry;
+    }
+  }
+
+  result->negative = a->negative != b->negative;
+  memcpy(result->limb, product, limbs * sizeof(uint64_t));
+  if(result->negative && is_zero(result, limbs)) result->negative = 0;
+}
+
+size_t fixed_limbs_for(double resolution)
+{
+  if(! (resolution > 0) || ! isfinite(resolution)) return FIXED_LIMBS;
+
+  double bits = ceil(-log2(resolution)) + SPARE_BITS;
+  if(bits < 64) bits = 64;
+  double limbs = 1 + ceil(bits / 64);
+  return limbs > FIXED_LIMBS ? FIXED_LIMBS : (size_t)limbs;
+}
+
+int fixed_parse(const char* string, char** end, fixed_t* value)
+{
+  const char* pos = string;
+  unsigned char digits[PARSE_DIGITS];
+  long count = 0, point = -1;
+  int negative = 0, any = 0;
+
+  while(isspace((unsigned char)*pos)) pos++;
+  if(*pos == '-' || *pos == '+') negative = *pos++ == '-';
+
+  for(;; pos++)
+  {
+    if(*pos == '.' && point < 0)
+    {
+      point = count;
+      continue;
+    }
+    if(! isdigit((unsigned char)*pos)) break;
+
+    any = 1;
+    // Leading zeros carry no information, digits past the buffer are below any precision we keep.
+    if(count == 0 && *pos == '0' && point < 0) continue;
+    if(count < PARSE_DIGITS)
+      digits[count++] = *pos - '0';
+    else if(point < 0)
+      goto overflow;
+  }
+  if(! any)
+  {
+    if(end) *end = (char*)string;
+    return 1;
+  }
+  if(point < 0) point = count;
+
+  if(*pos == 'e' || *pos == 'E')
+  {
+    const char* mark = pos++;
+    long sign = 1, exponent = 0;
+    int exponent_digits = 0;
+    if(*pos == '-' || *pos == '+') sign = *pos++ == '-' ? -1 : 1;
+    while(isdigit((unsigned char)*pos))
+    {
+      if(exponent < 100000) exponent = exponent * 10 + (*pos - '0');
+      pos++;
+      exponent_digits++;
+    }
+    if(exponent_digits)
+      point += sign * exponent;
+    else
+      pos = mark;
+  }
+
+  fixed_t result;
+  memset(&result, 0, sizeof(result));
+
+  // Integer part, digit by digit; digits past count are zeros from the exponent.
+  for(long i = 0; i < point; i++)
+  {
+    uint64_t digit = i < count ? digits[i] : 0;
+    if(result.limb[0] > (UINT64_MAX - digit) / 10) goto overflow;
+    result.limb[0] = result.limb[0] * 10 + digit;
+  }
+
+  // Fraction, from the last digit to the first: f = (digit + f) / 10 stays exact
+  // as long as the limbs last.
+  fixed_t fraction;
+  memset(&fraction, 0, sizeof(fraction));
+  for(long i = count; i-- > (point > 0 ? point : 0);)
+  {
+    fraction.limb[0] = digits[i];
+    div10(&fraction, FIXED_LIMBS);
+  }
+  // Zeros between the point and the first digit, enough of them leave nothing.
+  for(long i = point; i < 0 && i > -400; i++)
+    div10(&fraction, FIXED_LIMBS);
+  memcpy(result.limb + 1, fraction.limb + 1, (FIXED_LIMBS - 1) * sizeof(uint64_t));
+
+  result.negative = negative && ! is_zero(&result, FIXED_LIMBS);
+  *value = result;
+  if(end) *end = (char*)pos;
+  return 0;
+
+overflow:
+  if(end) *end = (char*)string;
+  return 1;
+}
+
+void fixed_format(const fixed_t* value, size_t decimals, char* buffer, size_t size)
+{
+  // Round to the last decimal by adding half of it.
+  fixed_t half, rounded = *value;
+  memset(&half, 0, sizeof(half));
+  half.limb[0] = 5;
+  for(size_t i = 0; i <= decimals && ! is_zero(&half, FIXED_LIMBS); i++)
+    div10(&half, FIXED_LIMBS);
+  add_magnitude(&rounded, &rounded, &half, FIXED_LIMBS);
+
+  size_t used = snprintf(buffer, size, "%s%llu", value->negative ? "-" : "",
+                         (unsigned long long)rounded.limb[0]);
+  if(decimals && used + 1 < size)
+  {
+    buffer[used++] = '.';
+    for(size_t i = 0; i < decimals && used + 1 < size; i++)
+      buffer[used++] = '0' + mul10_fraction(&rounded, FIXED_LIMBS);
+    buffer[used] = '\0';
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef _MANDELPRIME_FIXEDPOINT_H_
+#define _MANDELPRIME_FIXEDPOINT_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+/**
+ * This header offers multiprecision fixed point numbers, for coordinates and orbits
+ * that need more precision than a double.
+ *
+ * A number is a sign and FIXED_LIMBS 64 bit limbs, most significant first: limb 0 is
+ * the integer part, the others are the fraction, for 64 * (FIXED_LIMBS - 1) bits
+ * (about 290 decimal digits) after the point. The integer part has to stay below 2^64,
+ * which is plenty for the Mandelbrot set.
+ *
+ * The arithmetic takes the number of limbs to work with, so computations only pay for
+ * the precision they need; limbs past that are left untouched and should be ignored.
+ * Results are truncated, not rounded.
+ **/
+
+#define FIXED_LIMBS 16
+
+typedef struct {
+  int      negative;
+  uint64_t limb[FIXED_LIMBS];
+} fixed_t;
+
+/**
+ * @return value as a fixed point number, exactly.
+ **/
+fixed_t fixed_from_double(double value);
+
+/**
+ * @return value rounded to the nearest double.
+ **/
+double fixed_to_double(const fixed_t* value);
+
+/**
+ * result = a + b, using the first limbs limbs. result may be a or b.
+ **/
+void fixed_add(fixed_t* result, const fixed_t* a, const fixed_t* b, size_t limbs);
+
+/**
+ * result = a - b, using the first limbs limbs. result may be a or b.
+ **/
+void fixed_sub(fixed_t* result, const fixed_t* a, const fixed_t* b, size_t limbs);
+
+/**
+ * result = a * b, using the first limbs limbs. result may be a or b.
+ **/
+void fixed_mul(fixed_t* result, const fixed_t* a, const fixed_t* b, size_t limbs);
+
+/**
+ * Get the number of limbs needed to tell numbers apart that differ by resolution, with
+ * some bits to spare for rounding errors that grow along an orbit.
+ *
+ * @param resolution Smallest difference that matters.
+ * @return The number of limbs, at most FIXED_LIMBS.
+ **/
+size_t fixed_limbs_for(double resolution);
+
+/**
+ * Parse a decimal number, like strtod, into a fixed point number.
+ *
+ * @param string The text to parse, optionally signed, with an optional exponent.
+ * @param end    If not NULL, set to the first character after the number.
+ * @param value  Receives the number.
+ * @return 0 on success, non-zero if string does not start with a number, or its
+ *         integer part does not fit.
+ **/
+int fixed_parse(const char* string, char** end, fixed_t* value);
+
+/**
+ * Write a fixed point number in decimal notation.
+ *
+ * @param value    The number to write.
+ * @param decimals Number of digits after the decimal point.
+ * @param buffer   Receives the text, including the terminating null character.
+ * @param size     Size of buffer; decimals + 24 bytes is always enough.
+ **/
+void fixed_format(const fixed_t* value, size_t decimals, char* buffer, size_t size);
+
+#endif // _MANDELPRIME_FIXEDPOINT_H_
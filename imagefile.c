@@ -0,0 +1,236 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "strings.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "math.h"
+
+#include "imagefile.h"
+#include "log.h"
+
+// These macro's have double evaluation, so be weary.
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+#define WRITE_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Counts are mapped onto at most this many shades, so the palette stays small for any
+// max_value.
+#define PALETTE_SIZE 65536
+
+struct imagefile_writer
+{
+  int       fd;
+  imagefile_format_t format;
+  size_t    width;
+  size_t    height;
+  size_t    rows;           ///< Rows appended so far.
+  uint32_t  max_value;
+
+  uint8_t*  palette;        ///< 3 bytes per shade, for PGM and PPM.
+  size_t    shades;
+
+  uint8_t*  buffer;
+  size_t    buffered;
+  size_t    pixel_size;     ///< Bytes per pixel in the file.
+  int       failed;
+};
+
+static int write_all(int fd, const void* data, size_t size)
+{
+  while(size)
+  {
+    ssize_t written = write(fd, data, size);
+    if(written < 0)
+    {
+      if(errno == EINTR) continue;
+      vlog("Failed to write image file: %s", strerror(errno));
+      return 1;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+static void flush_buffer(imagefile_writer_t writer)
+{
+  if(! writer->failed)
+    writer->failed = write_all(writer->fd, writer->buffer, writer->buffered);
+  writer->buffered = 0;
+}
+
+// Fill the palette: black for max_value, and a gradient over log(1 + count) for the
+// others, which spreads the many low counts out.
+static void build_palette(imagefile_writer_t writer)
+{
+  writer->shades  = (size_t)MIN(writer->max_value, PALETTE_SIZE - 1) + 1;
+  writer->palette = malloc(writer->shades * 3);
+
+  double scale = log1p(writer->max_value);
+  for(size_t shade = 0; shade < writer->shades; shade++)
+  {
+    uint8_t* rgb = writer->palette + shade * 3;
+    double count = (double)shade * writer->max_value / (writer->shades - 1);
+    double t = scale > 0 ? log1p(count) / scale : 0;
+
+    if(shade == writer->shades - 1)
+      rgb[0] = rgb[1] = rgb[2] = 0;
+    else if(writer->format == IMAGEFILE_PGM)
+      rgb[0] = rgb[1] = rgb[2] = (uint8_t)(255 * t);
+    else
+    { // Bernstein polynomials: dark blue, through orange, to a bright yellow.
+      rgb[0] = (uint8_t)(255 * MIN(1.0, 9 * (1 - t) * t * t * t));
+      rgb[1] = (uint8_t)(255 * MIN(1.0, 15 * (1 - t) * (1 - t) * t * t));
+      rgb[2] = (uint8_t)(255 * MIN(1.0, 8.5 * (1 - t) * (1 - t) * (1 - t) * t));
+    }
+  }
+}
+
+// Convert a row of counts into the write buffer.
+static void convert_row(imagefile_writer_t writer, const uint32_t* counts, uint8_t* out)
+{
+  switch(writer->format)
+  {
+  case IMAGEFILE_PGM:
+  case IMAGEFILE_PPM:
+    for(size_t x = 0; x < writer->width; x++)
+    {
+      uint32_t count = MIN(counts[x], writer->max_value);
+      size_t shade = writer->shades - 1 == writer->max_value
+        ? count : (size_t)((uint64_t)count * (writer->shades - 1) / writer->max_value);
+      const uint8_t* rgb = writer->palette + shade * 3;
+      if(writer->format == IMAGEFILE_PGM)
+        *out++ = rgb[0];
+      else
+      {
+        *out++ = rgb[0];
+        *out++ = rgb[1];
+        *out++ = rgb[2];
+      }
+    }
+    break;
+  case IMAGEFILE_RAW16:
+    for(size_t x = 0; x < writer->width; x++)
+    {
+      uint32_t count = MIN(counts[x], UINT16_MAX);
+      *out++ = count & 0xff;
+      *out++ = count >> 8;
+    }
+    break;
+  case IMAGEFILE_RAW32:
+    for(size_t x = 0; x < writer->width; x++)
+    {
+      *out++ = counts[x] & 0xff;
+      *out++ = (counts[x] >> 8) & 0xff;
+      *out++ = (counts[x] >> 16) & 0xff;
+      *out++ = counts[x] >> 24;
+    }
+    break;
+  }
+}
+
+int imagefile_format_from_path(const char* path, imagefile_format_t* format)
+{
+  static const struct {
+    const char*        extension;
+    imagefile_format_t format;
+  } formats[] = {
+    { ".pgm", IMAGEFILE_PGM }, { ".ppm", IMAGEFILE_PPM },
+    { ".raw16", IMAGEFILE_RAW16 }, { ".raw32", IMAGEFILE_RAW32 },
+  };
+
+  const char* extension = strrchr(path, '.');
+  if(! extension) return 1;
+  for(size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    if(strcasecmp(extension, formats[i].extension) == 0)
+    {
+      *format = formats[i].format;
+      return 0;
+    }
+  return 1;
+}
+
+imagefile_writer_t create_imagefile(const char* path, imagefile_format_t format,
+                                    size_t width, size_t height, uint32_t max_value)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+  {
+    vlog("Failed to create image file %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  imagefile_writer_t writer = calloc(1, sizeof(struct imagefile_writer));
+  writer->fd        = fd;
+  writer->format    = format;
+  writer->width     = width;
+  writer->height    = height;
+  writer->max_value = max_value;
+
+  switch(format)
+  {
+  case IMAGEFILE_PGM:   writer->pixel_size = 1; break;
+  case IMAGEFILE_PPM:   writer->pixel_size = 3; break;
+  case IMAGEFILE_RAW16: writer->pixel_size = 2; break;
+  case IMAGEFILE_RAW32: writer->pixel_size = 4; break;
+  }
+  if(format == IMAGEFILE_PGM || format == IMAGEFILE_PPM)
+    build_palette(writer);
+
+  // The buffer takes at least one row, however wide.
+  writer->buffer = malloc(MAX(WRITE_BUFFER_SIZE, width * writer->pixel_size));
+  if(format == IMAGEFILE_PGM || format == IMAGEFILE_PPM)
+    writer->buffered = sprintf((char*)writer->buffer, "P%c\n%zu %zu\n255\n",
+                               format == IMAGEFILE_PGM ? '5' : '6', width, height);
+
+  return writer;
+}
+
+int imagefile_append(imagefile_writer_t writer, const uint32_t* counts, size_t rows)
+{
+  size_t row_size = writer->width * writer->pixel_size;
+  size_t capacity = MAX(WRITE_BUFFER_SIZE, row_size);
+
+  if(writer->rows + rows > writer->height)
+  {
+    vlog("Image file has %zu rows, cannot append %zu rows after row %zu.", writer->height, rows, writer->rows);
+    writer->failed = 1;
+    return 1;
+  }
+
+  for(size_t y = 0; y < rows; y++)
+  {
+    if(writer->buffered + row_size > capacity)
+      flush_buffer(writer);
+    convert_row(writer, counts + y * writer->width, writer->buffer + writer->buffered);
+    writer->buffered += row_size;
+  }
+  writer->rows += rows;
+
+  return writer->failed;
+}
+
+int imagefile_close(imagefile_writer_t writer)
+{
+  flush_buffer(writer);
+
+  int failed = writer->failed;
+  if(writer->rows != writer->height)
+  {
+    vlog("Image file is incomplete, %zu of %zu rows were written.", writer->rows, writer->height);
+    failed = 1;
+  }
+  if(close(writer->fd))
+  {
+    vlog("Failed to close image file: %s", strerror(errno));
+    failed = 1;
+  }
+
+  free(writer->palette);
+  free(writer->buffer);
+  free(writer);
+  return failed;
+}
@@ -0,0 +1,74 @@
+#ifndef _MANDELPRIME_IMAGEFILE_H_
+#define _MANDELPRIME_IMAGEFILE_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+/**
+ * This header offers a streaming writer for images of iteration counts, row by row
+ * from the top, so an image never has to be in memory as a whole.
+ *
+ * Formats:
+ *  - PGM: 8 bit grey (binary P5), black for counts of max_value, otherwise brighter
+ *    the higher the count, on a logarithmic scale.
+ *  - PPM: 8 bit RGB (binary P6), the same scale through a colour gradient.
+ *  - RAW16: the counts as little endian 16 bit integers, clamped to 65535, no header.
+ *  - RAW32: the counts as little endian 32 bit integers, no header.
+ *
+ * Rows are converted into a large buffer, which is written out whenever it fills up,
+ * so the file is written sequentially, in large writes.
+ **/
+
+typedef enum {
+  IMAGEFILE_PGM,
+  IMAGEFILE_PPM,
+  IMAGEFILE_RAW16,
+  IMAGEFILE_RAW32,
+} imagefile_format_t;
+
+/**
+ * Pointer type referring to an image file that is being written.
+ **/
+typedef struct imagefile_writer* imagefile_writer_t;
+
+/**
+ * Pick a format from the extension of a path: .pgm, .ppm, .raw16 or .raw32.
+ *
+ * @param path   The path to look at.
+ * @param format Receives the format.
+ * @return 0 on success, non-zero if the extension is not one of the above.
+ **/
+int imagefile_format_from_path(const char* path, imagefile_format_t* format);
+
+/**
+ * Create a new image file, replacing any existing file at path.
+ *
+ * @param path      Path of the file.
+ * @param format    Format to write (@see imagefile_format_t).
+ * @param width     Pixels per row.
+ * @param height    Number of rows.
+ * @param max_value Count of pixels inside the set, which PGM and PPM draw black.
+ * @return A writer, or NULL if the file could not be created.
+ **/
+imagefile_writer_t create_imagefile(const char* path, imagefile_format_t format,
+                                    size_t width, size_t height, uint32_t max_value);
+
+/**
+ * Append rows to an image file.
+ *
+ * @param writer The file to append to.
+ * @param counts rows * width iteration counts, row by row.
+ * @param rows   Number of rows, at most the number of rows that is still missing.
+ * @return 0 on success, non-zero if writing failed.
+ **/
+int imagefile_append(imagefile_writer_t writer, const uint32_t* counts, size_t rows);
+
+/**
+ * Write what is still buffered and close an image file.
+ *
+ * @param writer The file to close. The writer is freed, even on failure.
+ * @return 0 on success, non-zero if writing failed or rows are missing.
+ **/
+int imagefile_close(imagefile_writer_t writer);
+
+#endif // _MANDELPRIME_IMAGEFILE_H_
@@ -1,6 +1,81 @@
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "stddef.h"
 #include "time.h"
 #include "stdarg.h"
+#include "pthread.h"
+
+#include "log.h"
+
+// Messages are not formatted by the thread that logs them. Every thread gets its own
+// single producer, single consumer ring of entries, holding the timestamp, the format
+// string and the raw arguments. A background thread takes the entries from all rings
+// in timestamp order, formats them and writes them to stdout in batches. When a ring
+// is full, the message is dropped and counted instead of blocking the caller.
+
+#define LOG_RING_SIZE    128  ///< Entries per thread, a power of two.
+#define LOG_MAX_ARGS     12   ///< Arguments stored per message, the rest is dropped.
+#define LOG_STRING_SPACE 256  ///< Bytes per entry for copies of %s arguments.
+#define LOG_SPEC_SIZE    32   ///< Longest conversion specification that is supported.
+#define LOG_BUFFER_SIZE  (64 * 1024)
+#define LOG_WAIT_MS      10   ///< How long the background thread sleeps when idle.
+
+typedef enum {
+  ARG_INT,
+  ARG_LONG,
+  ARG_LLONG,
+  ARG_SIZE,
+  ARG_INTMAX,
+  ARG_PTRDIFF,
+  ARG_DOUBLE,
+  ARG_LDOUBLE,
+  ARG_POINTER,
+  ARG_STRING,
+} arg_type_t;
+
+typedef union {
+  long long   i;
+  long        l;
+  size_t      z;
+  intmax_t    j;
+  ptrdiff_t   t;
+  double      d;
+  long double ld;
+  void*       p;
+  size_t      string; ///< Offset in entry_t.strings
+} arg_t;
+
+typedef struct {
+  struct timespec time;
+  const char*     fmtstr;
+  uint8_t         arg_count;
+  uint8_t         types[LOG_MAX_ARGS];
+  arg_t           args[LOG_MAX_ARGS];
+  char            strings[LOG_STRING_SPACE];
+} entry_t;
+
+typedef struct ring {
+  size_t   head;     ///< Next entry to write, only changed by the producer.
+  size_t   tail;     ///< Next entry to read, only changed by the consumer.
+  size_t   dropped;  ///< Messages dropped because the ring was full.
+  int      orphaned; ///< The producer has exited, another thread may adopt the ring.
+  struct ring* next;
+  entry_t  entries[LOG_RING_SIZE];
+} ring_t;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t consume_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wake_cond     = PTHREAD_COND_INITIALIZER;
+static ring_t*         rings;
+static pthread_t       log_thread;
+static pthread_key_t   ring_key;
+static int             started, stopping, stopped;
+static __thread ring_t* thread_ring;
+static char            buffer[LOG_BUFFER_SIZE];
+static size_t          buffer_used;
 
 double difftimespec(struct timespec* end, struct timespec* start)
 {
@@ -15,16 +90,484 @@ double difftimespec(struct timespec* end, struct timespec* start)
 	return temp.tv_sec + temp.tv_nsec / 1000000000.0;
 }
 
+// Parse the conversion specification that starts at fmtstr (just after the '%').
+// Sets *type to the argument it takes, and *star to the number of '*' widths and
+// precisions that take an int before it. Returns the length of the specification,
+// or 0 if it takes no argument ("%%") or is not supported.
+static size_t parse_spec(const char* fmtstr, arg_type_t* type, int* star)
+{
+  const char* pos = fmtstr;
+  int length = 0; // 'h' and 'hh' promote to int, so they need no type of their own.
+
+  *star = 0;
+  while(*pos && strchr("-+ #0'", *pos)) pos++;
+  if(*pos == '*') { (*star)++; pos++; }
+  while(*pos >= '0' && *pos <= '9') pos++;
+  if(*pos == '.')
+  {
+    pos++;
+    if(*pos == '*') { (*star)++; pos++; }
+    while(*pos >= '0' && *pos <= '9') pos++;
+  }
+  while(*pos && strchr("hlLqjzt", *pos))
+  {
+    if(*pos != 'h') length = (length == 'l' && *pos == 'l') ? 'q' : *pos;
+    pos++;
+  }
+
+  switch(*pos)
+  {
+  case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+    switch(length)
+    {
+    case 'l': *type = ARG_LONG;    break;
+    case 'q': case 'L': *type = ARG_LLONG; break;
+    case 'z': *type = ARG_SIZE;    break;
+    case 'j': *type = ARG_INTMAX;  break;
+    case 't': *type = ARG_PTRDIFF; break;
+    default:  *type = ARG_INT;     break;
+    }
+    break;
+  case 'c':
+    *type = ARG_INT;
+    break;
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+    *type = length == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+    break;
+  case 'p':
+    *type = ARG_POINTER;
+    break;
+  case 's':
+    *type = ARG_STRING;
+    break;
+  default: // "%%", or something we can't store safely, like "%n" or "%ls".
+    return 0;
+  }
+  if(length == 'l' && (*pos == 'c' || *pos == 's')) return 0;
+
+  return pos + 1 - fmtstr;
+}
+
+// Store the arguments of a message, as described by its format string.
+static void record(entry_t* entry, const char* fmtstr, va_list args)
+{
+  size_t strings_used = 0;
+
+  entry->fmtstr = fmtstr;
+  entry->arg_count = 0;
+  for(const char* pos = strchr(fmtstr, '%'); pos; pos = strchr(pos, '%'))
+  {
+    arg_type_t type;
+    int star;
+    size_t length = parse_spec(++pos, &type, &star);
+    if(length == 0)
+    {
+      // Without its type, nothing after an unsupported argument can be read.
+      if(*pos != '%') break;
+      pos++;
+      continue;
+    }
+    pos += length;
+
+    if(entry->arg_count + star + 1 > LOG_MAX_ARGS) break;
+    while(star--)
+    {
+      entry->types[entry->arg_count] = ARG_INT;
+      entry->args[entry->arg_count++].i = va_arg(args, int);
+    }
+
+    arg_t* arg = &entry->args[entry->arg_count];
+    entry->types[entry->arg_count++] = type;
+    switch(type)
+    {
+    case ARG_INT:     arg->i  = va_arg(args, int);         break;
+    case ARG_LONG:    arg->l  = va_arg(args, long);        break;
+    case ARG_LLONG:   arg->i  = va_arg(args, long long);   break;
+    case ARG_SIZE:    arg->z  = va_arg(args, size_t);      break;
+    case ARG_INTMAX:  arg->j  = va_arg(args, intmax_t);    break;
+    case ARG_PTRDIFF: arg->t  = va_arg(args, ptrdiff_t);   break;
+    case ARG_DOUBLE:  arg->d  = va_arg(args, double);      break;
+    case ARG_LDOUBLE: arg->ld = va_arg(args, long double); break;
+    case ARG_POINTER: arg->p  = va_arg(args, void*);       break;
+    case ARG_STRING:
+    {
+      // The string may be gone by the time the message is formatted, so copy it.
+      const char* string = va_arg(args, const char*);
+      if(! string) string = "(null)";
+      size_t size = strlen(string);
+      if(size >= LOG_STRING_SPACE - strings_used)
+        size = strings_used < LOG_STRING_SPACE ? LOG_STRING_SPACE - strings_used - 1 : 0;
+      arg->string = strings_used;
+      if(strings_used < LOG_STRING_SPACE)
+      {
+        memcpy(entry->strings + strings_used, string, size);
+        entry->strings[strings_used + size] = 0;
+        strings_used += size + 1;
+      }
+      else
+      {
+        arg->string = LOG_STRING_SPACE - 1; // Points at the terminator of the last copy.
+      }
+      break;
+    }
+    }
+  }
+}
+
+// Format an entry into out, which has room for size bytes. Returns the length of the
+// message, which may be larger than size if it did not fit.
+static size_t format(const entry_t* entry, char* out, size_t size)
+{
+  size_t used = snprintf(out, size, "[%lld.%09ld] ", (long long) entry->time.tv_sec, entry->time.tv_nsec);
+  const char* pos = entry->fmtstr;
+  size_t arg = 0;
+
+#define EMIT(call) do { size_t n = (call); used += n; } while(0)
+#define ROOM (used < size ? size - used : 0)
+#define OUT  (out + (used < size ? used : size))
+  while(*pos)
+  {
+    const char* percent = strchr(pos, '%');
+    size_t literal = percent ? (size_t)(percent - pos) : strlen(pos);
+    if(literal)
+    {
+      if(literal < ROOM) memcpy(OUT, pos, literal);
+      else if(ROOM) memcpy(OUT, pos, ROOM - 1);
+      used += literal;
+      pos += literal;
+      continue;
+    }
+
+    arg_type_t type;
+    int star;
+    size_t length = parse_spec(pos + 1, &type, &star);
+    if(length == 0 || length >= LOG_SPEC_SIZE || arg + star + 1 > entry->arg_count)
+    {
+      // Print the specification as it was written, so nothing is silently lost.
+      size_t skip = (pos[1] == '%') ? 2 : 1;
+      if(ROOM > 1) *OUT = '%';
+      used++;
+      pos += skip;
+      continue;
+    }
+
+    char spec[LOG_SPEC_SIZE + 1];
+    memcpy(spec, pos, length + 1);
+    spec[length + 1] = 0;
+    pos += length + 1;
+
+    int widths[2] = { 0, 0 };
+    for(int i = 0; i < star; i++)
+      widths[i] = entry->args[arg++].i;
+
+    const arg_t* value = &entry->args[arg++];
+#define PRINT(x) \
+    switch(star) \
+    { \
+    case 0: EMIT(snprintf(OUT, ROOM, spec, x)); break; \
+    case 1: EMIT(snprintf(OUT, ROOM, spec, widths[0], x)); break; \
+    default: EMIT(snprintf(OUT, ROOM, spec, widths[0], widths[1], x)); break; \
+    }
+    switch(type)
+    {
+    case ARG_INT:     PRINT((int) value->i); break;
+    case ARG_LONG:    PRINT(value->l);       break;
+    case ARG_LLONG:   PRINT(value->i);       break;
+    case ARG_SIZE:    PRINT(value->z);       break;
+    case ARG_INTMAX:  PRINT(value->j);       break;
+    case ARG_PTRDIFF: PRINT(value->t);       break;
+    case ARG_DOUBLE:  PRINT(value->d);       break;
+    case ARG_LDOUBLE: PRINT(value->ld);      break;
+    case ARG_POINTER: PRINT(value->p);       break;
+    case ARG_STRING:  PRINT(entry->strings + value->string); break;
+    }
+#undef PRINT
+  }
+  if(ROOM) *OUT = '\n';
+  used++;
+#undef EMIT
+#undef ROOM
+#undef OUT
+
+  return used;
+}
+
+static void flush_buffer(void)
+{
+  fwrite(buffer, 1, buffer_used, stdout);
+  buffer_used = 0;
+}
+
+static void write_entry(const entry_t* entry)
+{
+  size_t length = format(entry, buffer + buffer_used, LOG_BUFFER_SIZE - buffer_used);
+  if(length < LOG_BUFFER_SIZE - buffer_used)
+  {
+    buffer_used += length;
+    return;
+  }
+
+  // Didn't fit, try again in an empty buffer, and truncate it if it still doesn't fit.
+  flush_buffer();
+  length = format(entry, buffer, LOG_BUFFER_SIZE);
+  if(length >= LOG_BUFFER_SIZE)
+  {
+    length = LOG_BUFFER_SIZE;
+    buffer[length - 1] = '\n';
+  }
+  buffer_used = length;
+}
+
+static int earlier(const struct timespec* a, const struct timespec* b)
+{
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Write out everything that has been logged so far. Must hold consume_lock.
+static void drain(void)
+{
+  pthread_mutex_lock(&registry_lock);
+  ring_t* all = rings; // New rings are added to the front, so this list stays valid.
+  pthread_mutex_unlock(&registry_lock);
+
+  // Report drops first, they happened before anything that is still in the rings.
+  for(ring_t* ring = all; ring; ring = ring->next)
+  {
+    size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if(dropped)
+      buffer_used += snprintf(buffer + buffer_used, LOG_BUFFER_SIZE - buffer_used,
+                              "[log] %zu messages dropped, the log could not keep up.\n", dropped);
+    if(LOG_BUFFER_SIZE - buffer_used < 128) flush_buffer();
+  }
+
+  // Merge the rings in timestamp order.
+  while(1)
+  {
+    ring_t* first = NULL;
+    const entry_t* first_entry = NULL;
+    for(ring_t* ring = all; ring; ring = ring->next)
+    {
+      size_t tail = ring->tail;
+      if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) continue;
+
+      const entry_t* entry = &ring->entries[tail % LOG_RING_SIZE];
+      if(! first || earlier(&entry->time, &first_entry->time))
+      {
+        first = ring;
+        first_entry = entry;
+      }
+    }
+    if(! first) break;
+
+    write_entry(first_entry);
+    __atomic_store_n(&first->tail, first->tail + 1, __ATOMIC_RELEASE);
+  }
+
+  flush_buffer();
+  fflush(stdout);
+}
+
+static void* log_thread_main(void* arg)
+{
+  pthread_mutex_lock(&wake_lock);
+  while(1)
+  {
+    int stop = stopping;
+    pthread_mutex_unlock(&wake_lock);
+
+    pthread_mutex_lock(&consume_lock);
+    drain();
+    pthread_mutex_unlock(&consume_lock);
+
+    pthread_mutex_lock(&wake_lock);
+    if(stop) break;
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += LOG_WAIT_MS * 1000000L;
+    if(until.tv_nsec >= 1000000000L)
+    {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    if(! stopping) pthread_cond_timedwait(&wake_cond, &wake_lock, &until);
+  }
+  pthread_mutex_unlock(&wake_lock);
+
+  return NULL;
+}
+
+// Stop the background thread at exit, after it has written everything.
+static void stop_log_thread(void)
+{
+  pthread_mutex_lock(&registry_lock);
+  int running = started && ! stopped;
+  __atomic_store_n(&stopped, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&registry_lock);
+  if(! running)
+  {
+    log_flush(); // A forked child may have logged without starting the thread again.
+    return;
+  }
+
+  pthread_mutex_lock(&wake_lock);
+  stopping = 1;
+  pthread_cond_signal(&wake_cond);
+  pthread_mutex_unlock(&wake_lock);
+  pthread_join(log_thread, NULL);
+}
+
+static void release_ring(void* ring)
+{
+  __atomic_store_n(&((ring_t*) ring)->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+// Write out what has been logged so far, so the child doesn't write it again.
+static void prepare_fork(void)
+{
+  pthread_mutex_lock(&consume_lock);
+  drain();
+  pthread_mutex_lock(&registry_lock);
+}
+
+static void parent_fork(void)
+{
+  pthread_mutex_unlock(&registry_lock);
+  pthread_mutex_unlock(&consume_lock);
+}
+
+// Only the forking thread exists in the child: the log thread has to be started
+// again, and the rings of the other threads can be reused.
+static void child_fork(void)
+{
+  pthread_mutex_init(&registry_lock, NULL);
+  pthread_mutex_init(&consume_lock, NULL);
+  pthread_mutex_init(&wake_lock, NULL);
+  pthread_cond_init(&wake_cond, NULL);
+  for(ring_t* ring = rings; ring; ring = ring->next)
+  {
+    if(ring == thread_ring) continue;
+    ring->tail = ring->head; // Logged by the parent after it drained.
+    ring->orphaned = 1;
+  }
+  started = 0;
+}
+
+// Find a ring for the calling thread, and start the log thread if needed.
+// Returns NULL if messages have to be written directly.
+static ring_t* get_ring(void)
+{
+  if(__atomic_load_n(&stopped, __ATOMIC_ACQUIRE)) return NULL;
+  if(thread_ring && __atomic_load_n(&started, __ATOMIC_ACQUIRE)) return thread_ring;
+
+  pthread_mutex_lock(&registry_lock);
+  if(stopped)
+  {
+    pthread_mutex_unlock(&registry_lock);
+    return NULL;
+  }
+
+  if(! started)
+  {
+    static int initialized;
+    if(! initialized)
+    {
+      pthread_key_create(&ring_key, release_ring);
+      pthread_atfork(prepare_fork, parent_fork, child_fork);
+      atexit(stop_log_thread);
+      initialized = 1;
+    }
+    if(pthread_create(&log_thread, NULL, log_thread_main, NULL))
+    {
+      pthread_mutex_unlock(&registry_lock);
+      return NULL;
+    }
+    __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+  }
+  if(thread_ring)
+  {
+    // After a fork, the thread was started again.
+    pthread_mutex_unlock(&registry_lock);
+    return thread_ring;
+  }
+
+  // Adopt the empty ring of a thread that has exited, or add a new one.
+  ring_t* ring;
+  for(ring = rings; ring; ring = ring->next)
+    if(__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE)
+       && __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head) break;
+  if(ring)
+  {
+    ring->orphaned = 0;
+  }
+  else
+  {
+    ring = calloc(1, sizeof(ring_t));
+    if(! ring)
+    {
+      pthread_mutex_unlock(&registry_lock);
+      return NULL;
+    }
+    ring->next = rings;
+    rings = ring;
+  }
+  pthread_mutex_unlock(&registry_lock);
+
+  pthread_setspecific(ring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+void log_flush(void)
+{
+  pthread_mutex_lock(&consume_lock);
+  drain();
+  pthread_mutex_unlock(&consume_lock);
+}
+
 void _vlog(char* fmtstr, ...)
 {
   struct timespec time;
   clock_gettime(CLOCK_MONOTONIC, &time);
-  printf("[%lld.%09ld] ", (long long) time.tv_sec, time.tv_nsec);
 
   va_list args;
   va_start(args, fmtstr);
-  vprintf(fmtstr, args);
+
+  ring_t* ring = get_ring();
+  if(! ring)
+  {
+    // Logging during or after exit, write it out directly.
+    entry_t entry;
+    entry.time = time;
+    record(&entry, fmtstr, args);
+    va_end(args);
+
+    char line[1024];
+    size_t length = format(&entry, line, sizeof(line));
+    if(length >= sizeof(line))
+    {
+      length = sizeof(line);
+      line[length - 1] = '\n';
+    }
+    fwrite(line, 1, length, stdout);
+    return;
+  }
+
+  size_t head = ring->head;
+  if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+  {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    va_end(args);
+    return;
+  }
+
+  entry_t* entry = &ring->entries[head % LOG_RING_SIZE];
+  entry->time = time;
+  record(entry, fmtstr, args);
   va_end(args);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 
-  puts("");
+  // Wake up the log thread early when the ring fills up.
+  if(head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == LOG_RING_SIZE / 2)
+    pthread_cond_signal(&wake_cond);
 }
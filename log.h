@@ -7,8 +7,22 @@
 
 #include "time.h"
 
+/**
+ * Log messages are written to stdout by a background thread, so logging never waits
+ * for I/O or for other threads. The arguments are stored when the message is logged
+ * (strings are copied), and formatted later. Messages are dropped, and the number of
+ * dropped messages is logged instead, if a thread logs faster than they can be written.
+ *
+ * Everything that was logged is written out when the program exits.
+ **/
+
 double difftimespec(struct timespec* end, struct timespec* start);
-void _vlog(char* fmtstr, ...);
+void _vlog(char* fmtstr, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Wait until every message logged so far has been written to stdout.
+ **/
+void log_flush(void);
 
 #define dlog(args...) if(VERBOSE) { _vlog(args); }
 #define vlog(args...) _vlog(args)
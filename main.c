@@ -1,23 +1,542 @@
 #include "pthread.h"
 #include "inttypes.h"
 #include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
 
 #include "workqueue.h"
 #include "mandelbrot.h"
 #include "primesieve.h"
+#include "primefile.h"
+#include "checkpoint.h"
+#include "primecount.h"
+#include "primetest.h"
 #include "log.h"
 
+// Prime counts up to this bound are cross-checked against the sieve.
+#define PRIMECOUNT_CHECK_LIMIT 1000000000ULL
+
+static queue_scheduler_t scheduler = QUEUE_SCHEDULER_GLOBAL;
+static size_t batch_size = 1;
+static size_t prefetch   = 0;
+static double unit_time  = 0;    ///< Target seconds per work unit, 0 for the queue's default.
+static double stats_interval = 0; ///< Seconds between worker statistics, 0 for none.
+static queue_affinity_t affinity = QUEUE_AFFINITY_NONE;
+static int*   affinity_cpus  = NULL; ///< For QUEUE_AFFINITY_LIST.
+static size_t affinity_count = 0;
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "Usage: %s [-n max_number] [-t threads] [-s array|compact|none] [-o file] [-r file] [-p] [-w start:stop] [-S] [-b batch[:prefetch]] [-u ms] [-c file[:seconds]] [-i seconds] [-a compact|scatter|cpus] [-M width[xheight][:iterations]] [-V re:im:span] [-K kernel] [-P] [-E] [-A frames[:zoom[:dx:dy[:iterations]]]] [-C megabytes] [-I]\n"
+          "  -n  Sieve all primes up to max_number (default 100000000)\n"
+          "  -t  Number of worker threads (default: one per available CPU)\n"
+          "  -s  Keep primes as a plain array, gap encoded or only count them (default array)\n"
+          "  -o  Write all primes to a prime file, or with -M the image: .pgm, .ppm, .raw16 or .raw32\n"
+          "  -r  Read a prime file instead of sieving, and count the primes up to max_number\n"
+          "  -p  Count the primes up to max_number without sieving (Lucy_Hedgehog)\n"
+          "  -w  Find the primes in [start, stop] with Miller-Rabin tests instead of sieving\n"
+          "  -S  Use the work stealing scheduler\n"
+          "  -b  Units each worker claims at once, and how many more it claims ahead (default 1:0)\n"
+          "  -u  Target time per sieve unit in milliseconds (default 10)\n"
+          "  -c  Save the sieve to a checkpoint file every so often (default 60 seconds), or resume from it if it exists\n"
+          "  -i  Log worker statistics every so many seconds, and when the work is done\n"
+          "  -a  Pin workers to CPUs: fill cores and nodes one by one, spread them out, or a list like 0,2,4-7\n"
+          "  -M  Render the Mandelbrot set instead of sieving (default height: 2/3 of the width, 1000 iterations)\n"
+          "  -V  Part of the plane to render: center and width (default -0.75:0:3)\n"
+          "  -K  Mandelbrot kernel: auto, scalar, sse2, avx2 or avx512 (default auto)\n"
+          "  -P  Render with perturbation, also when the view is not a deep zoom\n"
+          "  -E  Compute every Mandelbrot pixel, instead of filling in tiles with a uniform border\n"
+          "  -A  Render frames, each zoomed by a factor, moved by dx, dy pixels and with more iterations than the one before (default zoom 2, out)\n"
+          "  -C  Megabytes of tiles the frames of -A share (default 1024, 0 for none)\n"
+          "  -I  Only color the Mandelbrot pixels that escape after a prime number of iterations\n",
+          name);
+}
+
+// Creates a paused queue with the scheduling options from the command line.
+// Start it with queue_set_worker_count.
+static work_queue_t create_queue(void* priv_data,
+                                 do_work_fp work_func,
+                                 request_work_fp request_func,
+                                 report_results_fp report_func)
+{
+  work_queue_t queue = create_work_queue_with_scheduler(0,
+                                                        priv_data,
+                                                        work_func,
+                                                        request_func,
+                                                        report_func,
+                                                        scheduler);
+  queue_set_batch_size(queue, batch_size, prefetch);
+  if(unit_time > 0)
+    queue_set_target_unit_time(queue, unit_time);
+  if(stats_interval > 0)
+    queue_set_stats_interval(queue, stats_interval);
+  if(affinity != QUEUE_AFFINITY_NONE && queue_set_affinity(queue, affinity, affinity_cpus, affinity_count))
+    vlog("Failed to pin the workers, they will run unpinned.");
+  return queue;
+}
+
+// Waits until a queue created by create_queue has finished, and logs its statistics if asked to.
+static void wait_for_queue(work_queue_t queue)
+{
+  queue_wait_until_finished(queue);
+  if(stats_interval > 0)
+    queue_print_stats(queue);
+}
+
+// Parses a CPU list like "0,2,4-7" into affinity_cpus.
+static int parse_cpu_list(const char* list)
+{
+  const char* pos = list;
+  while(*pos)
+  {
+    char* end;
+    long first = strtol(pos, &end, 10);
+    long last = first;
+    if(end == pos || first < 0) return 1;
+    if(*end == '-')
+    {
+      pos = end + 1;
+      last = strtol(pos, &end, 10);
+      if(end == pos || last < first) return 1;
+    }
+    if(*end != ',' && *end != '\0') return 1;
+    pos = *end ? end + 1 : end;
+
+    affinity_cpus = realloc(affinity_cpus, (affinity_count + last - first + 1) * sizeof(int));
+    for(long cpu = first; cpu <= last; cpu++)
+      affinity_cpus[affinity_count++] = cpu;
+  }
+  return affinity_count == 0;
+}
+
+/**
+ * Frames of a Mandelbrot animation, every frame relative to the one before.
+ **/
+typedef struct {
+  size_t   frames;
+  double   zoom;       ///< Width of a frame relative to the one before.
+  double   dx, dy;     ///< Pixels the center moves, to the right and down.
+  uint32_t iterations; ///< Added to max_iter.
+  size_t   cache_size; ///< Bytes of tiles the frames share.
+} animation_t;
+
+static int render_mandelbrot(const mandelbrot_view_t* view, mandelbrot_kernel_t kernel,
+                             mandelbrot_mode_t mode, int subdivide, tilecache_t cache,
+                             const primesieve_bitmap_t* primes, const char* output, size_t threads)
+{
+  imagefile_format_t format;
+  if(output && imagefile_format_from_path(output, &format))
+  {
+    vlog("Cannot tell the image format of %s, use .pgm, .ppm, .raw16 or .raw32.", output);
+    return 1;
+  }
+
+  mandelbrot_t mandelbrot = create_mandelbrot(view);
+  if(output && mandelbrot_set_output(mandelbrot, output, format))
+  {
+    destroy_mandelbrot(mandelbrot);
+    return 1;
+  }
+  mandelbrot_set_mode(mandelbrot, mode);
+  mandelbrot_set_subdivision(mandelbrot, subdivide);
+  mandelbrot_set_cache(mandelbrot, cache);
+  if(mandelbrot_set_primes(mandelbrot, primes))
+  {
+    destroy_mandelbrot(mandelbrot);
+    return 1;
+  }
+  if(mandelbrot_set_kernel(mandelbrot, kernel))
+  {
+    vlog("This CPU does not support the %s kernel.", mandelbrot_kernel_name(kernel));
+    destroy_mandelbrot(mandelbrot);
+    return 1;
+  }
+
+  vlog("Starting Mandelbrot render");
+  work_queue_t queue = create_queue(mandelbrot,
+                                    mandelbrot_do_work,
+                                    mandelbrot_request_work,
+                                    mandelbrot_report_results);
+  queue_set_worker_count(queue, threads);
+  wait_for_queue(queue);
+  destroy_work_queue(queue);
+  vlog("Mandelbrot render finished");
+  mandelbrot_print(mandelbrot);
+
+  int failed = ! mandelbrot_complete(mandelbrot);
+  destroy_mandelbrot(mandelbrot);
+  return failed;
+}
+
+// Renders the frames of an animation, which share their tiles through a cache. With an
+// output file, frame i goes to the file with -i before its extension, like zoom-0003.ppm.
+static int render_animation(const mandelbrot_view_t* first, const animation_t* animation,
+                            mandelbrot_kernel_t kernel, mandelbrot_mode_t mode, int subdivide,
+                            const primesieve_bitmap_t* primes, const char* output, size_t threads)
+{
+  mandelbrot_view_t view = *first;
+  tilecache_t cache = animation->cache_size ? create_tilecache(animation->cache_size) : NULL;
+  char* path = output ? malloc(strlen(output) + 32) : NULL;
+  int failed = 0;
+
+  for(size_t frame = 0; frame < animation->frames && ! failed; frame++)
+  {
+    if(output)
+    {
+      const char* extension = strrchr(output, '.');
+      int length = extension ? extension - output : strlen(output);
+      sprintf(path, "%.*s-%04zu%s", length, output, frame, extension ? extension : "");
+    }
+    vlog("Frame %zu of %zu", frame + 1, animation->frames);
+    failed = render_mandelbrot(&view, kernel, mode, subdivide, cache, primes, path, threads);
+
+    double step = view.span / view.width;
+    fixed_t dx = fixed_from_double(animation->dx * step), dy = fixed_from_double(animation->dy * step);
+    fixed_add(&view.center_re, &view.center_re, &dx, FIXED_LIMBS);
+    fixed_sub(&view.center_im, &view.center_im, &dy, FIXED_LIMBS);
+    view.span     *= animation->zoom;
+    view.max_iter += animation->iterations;
+  }
+
+  if(cache)
+  {
+    tilecache_print(cache);
+    destroy_tilecache(cache);
+  }
+  free(path);
+  return failed;
+}
+
+// Sieves the primes up to limit into a bitmap, for prime coloring. The bitmap belongs to
+// the sieve that is returned.
+static primesieve_t sieve_bitmap(uint64_t limit, size_t threads)
+{
+  primesieve_t sieve = create_primesieve_with_storage(limit, PRIMESIEVE_STORE_NONE);
+  primesieve_set_bitmap(sieve, limit);
+
+  work_queue_t queue = create_queue(sieve,
+                                    primesieve_do_work,
+                                    primesieve_request_work,
+                                    primesieve_report_results);
+  queue_set_worker_count(queue, threads);
+  wait_for_queue(queue);
+  destroy_work_queue(queue);
+  primesieve_print(sieve);
+  return sieve;
+}
+
+static int read_primes(const char* path, uint64_t max_number)
+{
+  primefile_t file = open_primefile(path);
+  if(! file) return 1;
+
+  size_t count = primefile_count(file);
+  vlog("Prime file %s has checked all primes up to %" PRIu64, path, primefile_max_checked(file));
+  vlog(" => %zu primes", count);
+  vlog(" => Largest prime: %" PRIu64, primefile_nth_prime(file, count));
+  vlog(" => %zu primes up to %" PRIu64, primefile_pi(file, max_number), max_number);
+
+  close_primefile(file);
+  return 0;
+}
+
+static int test_window(const char* window, size_t threads)
+{
+  char* end;
+  uint64_t start = strtoull(window, &end, 0);
+  if(*end != ':')
+  {
+    vlog("Invalid window %s, expected start:stop", window);
+    return 1;
+  }
+  uint64_t stop = strtoull(end + 1, NULL, 0);
+
+  vlog("Starting prime test");
+  primetest_t test = create_primetest(start, stop);
+  work_queue_t queue = create_queue(test,
+                                    primetest_do_work,
+                                    primetest_request_work,
+                                    primetest_report_results);
+  // With work stealing, split the whole window up front, before the workers start.
+  if(scheduler == QUEUE_SCHEDULER_STEALING)
+    primetest_submit_work(test, queue);
+  queue_set_worker_count(queue, threads);
+  wait_for_queue(queue);
+  destroy_work_queue(queue);
+  vlog("Prime test finished");
+  primetest_print(test);
+
+  destroy_primetest(test);
+  return 0;
+}
+
+static int count_primes(uint64_t max_number, size_t threads)
+{
+  vlog("Starting prime count");
+  primecount_t counter = create_primecount(max_number);
+  work_queue_t queue = create_queue(counter,
+                                    primecount_do_work,
+                                    primecount_request_work,
+                                    primecount_report_results);
+  queue_set_worker_count(queue, threads);
+  wait_for_queue(queue);
+  destroy_work_queue(queue);
+  vlog("Prime count finished");
+  primecount_print(counter);
+
+  uint64_t count = primecount_result(counter);
+  destroy_primecount(counter);
+  if(max_number > PRIMECOUNT_CHECK_LIMIT) return 0;
+
+  // Cross-check against a counting sieve.
+  primesieve_t sieve = create_primesieve_with_storage(max_number, PRIMESIEVE_STORE_NONE);
+  queue = create_queue(sieve,
+                       primesieve_do_work,
+                       primesieve_request_work,
+                       primesieve_report_results);
+  queue_set_worker_count(queue, threads);
+  wait_for_queue(queue);
+  destroy_work_queue(queue);
+
+  uint64_t expected = primesieve_pi(sieve, max_number);
+  destroy_primesieve(sieve);
+  if(count != expected)
+  {
+    vlog("!!! ERROR! Prime count %" PRIu64 " does not match the sieve's %" PRIu64 "!!", count, expected);
+    return 1;
+  }
+  vlog("Prime count matches the sieve.");
+  return 0;
+}
+
 int main(int argc, char** argv)
 {
+  uint64_t max_number = 100000000; // Or use UINT64_MAX
+  size_t threads = queue_default_worker_count();
+  primesieve_storage_t storage = PRIMESIEVE_STORE_ARRAY;
+  const char* output = NULL;
+  const char* input  = NULL;
+  int prime_count = 0;
+  const char* window = NULL;
+  const char* checkpoint = NULL;
+  double checkpoint_interval = CHECKPOINT_INTERVAL;
+  mandelbrot_view_t view = { .span = 3.0, .max_iter = 1000 };
+  mandelbrot_kernel_t kernel = MANDELBROT_KERNEL_AUTO;
+  mandelbrot_mode_t mode = MANDELBROT_MODE_AUTO;
+  int subdivide = 1;
+  int prime_coloring = 0;
+  animation_t animation = { .frames = 0, .zoom = 2, .cache_size = 1024 * 1024 * 1024ULL };
+
+  view.center_re = fixed_from_double(-0.75);
+  view.center_im = fixed_from_double(0);
+
+  int opt;
+  while((opt = getopt(argc, argv, "n:t:s:o:r:pw:Sb:u:c:i:a:M:V:K:PEA:C:Ih")) != -1)
+  {
+    switch(opt)
+    {
+    case 'n':
+      max_number = strtoull(optarg, NULL, 0);
+      break;
+    case 't':
+      threads = strtoul(optarg, NULL, 0);
+      if(threads == 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      if(strcmp(optarg, "array") == 0)
+        storage = PRIMESIEVE_STORE_ARRAY;
+      else if(strcmp(optarg, "compact") == 0)
+        storage = PRIMESIEVE_STORE_COMPACT;
+      else if(strcmp(optarg, "none") == 0)
+        storage = PRIMESIEVE_STORE_NONE;
+      else
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'r':
+      input = optarg;
+      break;
+    case 'p':
+      prime_count = 1;
+      break;
+    case 'w':
+      window = optarg;
+      break;
+    case 'S':
+      scheduler = QUEUE_SCHEDULER_STEALING;
+      break;
+    case 'b':
+    {
+      char* end;
+      batch_size = strtoul(optarg, &end, 0);
+      prefetch = *end == ':' ? strtoul(end + 1, NULL, 0) : 0;
+      if(batch_size == 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    }
+    case 'c':
+    {
+      char* end = strchr(optarg, ':');
+      if(end)
+      {
+        *end = '\0';
+        checkpoint_interval = strtod(end + 1, NULL);
+      }
+      checkpoint = optarg;
+      break;
+    }
+    case 'i':
+      stats_interval = strtod(optarg, NULL);
+      break;
+    case 'a':
+      if(strcmp(optarg, "compact") == 0)
+        affinity = QUEUE_AFFINITY_COMPACT;
+      else if(strcmp(optarg, "scatter") == 0)
+        affinity = QUEUE_AFFINITY_SCATTER;
+      else if(parse_cpu_list(optarg) == 0)
+        affinity = QUEUE_AFFINITY_LIST;
+      else
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'u':
+      unit_time = strtod(optarg, NULL) / 1000;
+      if(unit_time <= 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'M':
+    {
+      char* end;
+      view.width  = strtoul(optarg, &end, 0);
+      view.height = *end == 'x' ? strtoul(end + 1, &end, 0) : view.width * 2 / 3;
+      if(*end == ':') view.max_iter = strtoul(end + 1, &end, 0);
+      if(view.width == 0 || view.height == 0 || view.max_iter == 0 || *end)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    }
+    case 'V':
+    {
+      // The center may have far more digits than fit in a double, for deep zooms.
+      char* end;
+      if(fixed_parse(optarg, &end, &view.center_re) || *end != ':'
+         || fixed_parse(end + 1, &end, &view.center_im) || *end != ':'
+         || (view.span = strtod(end + 1, &end)) <= 0 || *end)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    }
+    case 'P':
+      mode = MANDELBROT_MODE_PERTURBATION;
+      break;
+    case 'E':
+      subdivide = 0;
+      break;
+    case 'A':
+    {
+      char* end;
+      animation.frames = strtoul(optarg, &end, 0);
+      if(*end == ':') animation.zoom = strtod(end + 1, &end);
+      if(*end == ':') animation.dx = strtod(end + 1, &end);
+      if(*end == ':') animation.dy = strtod(end + 1, &end);
+      if(*end == ':') animation.iterations = strtoul(end + 1, &end, 0);
+      if(animation.frames == 0 || animation.zoom <= 0 || *end)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    }
+    case 'C':
+      animation.cache_size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+      break;
+    case 'I':
+      prime_coloring = 1;
+      break;
+    case 'K':
+      for(kernel = MANDELBROT_KERNEL_AUTO; kernel <= MANDELBROT_KERNEL_AVX512; kernel++)
+        if(strcmp(optarg, mandelbrot_kernel_name(kernel)) == 0) break;
+      if(kernel > MANDELBROT_KERNEL_AVX512)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return opt != 'h';
+    }
+  }
+
+  if(view.width)
+  {
+    // The last frame has the most iterations.
+    uint64_t max_iter = view.max_iter + (uint64_t)animation.iterations * (animation.frames ? animation.frames - 1 : 0);
+    primesieve_t sieve = prime_coloring ? sieve_bitmap(max_iter, threads) : NULL;
+    const primesieve_bitmap_t* primes = sieve ? primesieve_bitmap(sieve) : NULL;
+    int failed;
+
+    if(animation.frames)
+      failed = render_animation(&view, &animation, kernel, mode, subdivide, primes, output, threads);
+    else
+      failed = render_mandelbrot(&view, kernel, mode, subdivide, NULL, primes, output, threads);
+    if(sieve) destroy_primesieve(sieve);
+    return failed;
+  }
+  if(input) return read_primes(input, max_number);
+  if(prime_count) return count_primes(max_number, threads);
+  if(window) return test_window(window, threads);
+
   vlog("Starting prime sieve");
-  primesieve_t sieve = create_primesieve(100000000); // Or use UINT64_MAX
-  work_queue_t queue = create_work_queue(6,
-                                        sieve,
-                                        primesieve_do_work,
-                                        primesieve_request_work,
-                                        primesieve_report_results);
+  primesieve_t sieve;
+  if(checkpoint && access(checkpoint, F_OK) == 0)
+  {
+    sieve = create_primesieve_from_checkpoint(checkpoint, max_number, storage, checkpoint_interval);
+    if(! sieve) return 1;
+  } else {
+    sieve = create_primesieve_with_storage(max_number, storage);
+    if(checkpoint && primesieve_set_checkpoint(sieve, checkpoint, checkpoint_interval))
+    {
+      destroy_primesieve(sieve);
+      return 1;
+    }
+  }
+  if(output && primesieve_set_output(sieve, output))
+  {
+    destroy_primesieve(sieve);
+    return 1;
+  }
+  work_queue_t queue = create_queue(sieve,
+                                    primesieve_do_work,
+                                    primesieve_request_work,
+                                    primesieve_report_results);
+  queue_set_worker_count(queue, threads);
 
-  queue_wait_until_finished(queue);
+  wait_for_queue(queue);
   vlog("Prime sieve finished");
   primesieve_print(sieve);
 
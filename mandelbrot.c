@@ -1 +1,1548 @@
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "math.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#include "mandelbrot.h"
+#include "imagefile.h"
+#include "tilecache.h"
+#include "refcount.h"
+#include "log.h"
+
+// These macro's have double evaluation, so be weary.
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+/**
+ * Compute the iteration counts of count pixels on a row, or down a column.
+ *
+ * Pixel i is in column x + i of row y, or in column x of row y + i when vertical is set.
+ * Column x has real part left + (x + origin_x) * step, row y has imaginary part
+ * top - (y + origin_y) * step. Every kernel computes the coordinates and iterations with
+ * the same operations, in the same order, and without fused multiply-adds, so they agree
+ * to the last bit.
+ *
+ * When last_re and last_im are not NULL, they receive the last point of every orbit, for
+ * the pixels that reach max_iter.
+ *
+ * An orbit that lands exactly on one of its earlier points repeats forever, so it is
+ * inside the set. The kernels look for this with Brent's method: they remember the point
+ * at every power of two iterations, and compare each following point to it. Doubles make
+ * this exact, the counts are the same as iterating up to max_iter.
+ **/
+typedef void (*escape_fp)(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                          int vertical, uint32_t* iterations, double* last_re, double* last_im);
+
+/**
+ * Reference orbit for perturbation: Z_0 = 0, Z_n+1 = Z_n^2 + C, rounded to doubles.
+ *
+ * It ends at Z_length, the first point that escaped, or Z_max_iter.
+ **/
+typedef struct {
+  double* re;
+  double* im;
+  size_t  length;
+} orbit_t;
+
+/**
+ * Compute the iteration counts of count pixels on a row, or down a column, relative to
+ * the reference orbit.
+ *
+ * Pixel (x, y) is at ((x - center_x) * step, (center_y - y) * step) from the reference
+ * point. Rebasing makes the state of an orbit more than its last point, so these kernels
+ * do not look for periodic orbits.
+ **/
+typedef void (*perturb_fp)(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                           int vertical, uint32_t* iterations);
+
+/**
+ * Continue count orbits from where they stopped, up to max_iter: orbit i is at point
+ * (last_re[i], last_im[i]) after iterations[i] iterations, for c = (cr[i], ci[i]). Both
+ * are updated, like the escape kernels do, with the same operations.
+ **/
+typedef void (*continue_fp)(const struct mandelbrot* mandelbrot, size_t count, const double* cr,
+                            const double* ci, double* last_re, double* last_im, uint32_t* iterations);
+
+/**
+ * Where an orbit that had not escaped at max_iter stopped, so it can go on when max_iter
+ * is raised.
+ **/
+typedef struct {
+  double   zr, zi;
+  uint32_t n;      ///< max_iter, or 0 for a pixel that was filled in, which starts over.
+  uint32_t index;  ///< Pixel in the tile, row by row.
+} saved_orbit_t;
+
+/**
+ * A whole tile of the lattice, as kept in the tile cache, allocated with refcount_allocate.
+ *
+ * Pixels at max_iter have a saved orbit, unless they are in the main cardioid or bulb.
+ **/
+typedef struct {
+  uint32_t      max_iter;
+  size_t        saved;
+  uint32_t      counts[MANDELBROT_TILE_SIZE * MANDELBROT_TILE_SIZE];
+  saved_orbit_t orbits[];
+} cached_tile_t;
+
+/**
+ * Where the counts of a tile come from, with a tile cache.
+ **/
+typedef enum {
+  TILE_RENDER,     ///< Iterate every pixel.
+  TILE_COPY,       ///< The cached tile, with the same or, without subdivision, a higher max_iter.
+  TILE_CONTINUE,   ///< The cached tile, with the saved orbits continued to a higher max_iter.
+  TILE_DOWNSAMPLE, ///< Every other pixel of the four cached tiles with half the step.
+} tile_source_t;
+
+typedef struct {
+  size_t       x, y;          ///< Top left pixel of the tile, on the grid.
+  size_t       width, height;
+  uint32_t*    image;         ///< Counts of the tile, from its top left pixel, rows are stride apart.
+  size_t       stride;
+  double*      last_re;       ///< Last points of the orbits, like image, with a tile cache.
+  double*      last_im;
+
+  tile_source_t   source;
+  tilecache_key_t key;
+  cached_tile_t*  cached[4];  ///< References to the cached tiles it is made from.
+  cached_tile_t*  result;     ///< The tile for the cache, filled in by the worker.
+
+  uint64_t     total;         ///< Iterations of all pixels in the tile, filled in by the worker.
+  uint64_t     inside;        ///< Pixels that did not escape.
+  uint64_t     skipped;       ///< Pixels that were filled in without iterating them.
+  uint64_t     prime;         ///< Pixels that escaped after a prime number of iterations.
+  int          write;         ///< Write the band of row y to the output file, instead of rendering.
+  int          failed;        ///< Writing the band failed.
+  mandelbrot_t mandelbrot;
+} tile_t;
+
+struct mandelbrot
+{
+  mandelbrot_view_t view;
+  double    left;             ///< Real part of the pixels in column -origin_x.
+  double    top;              ///< Imaginary part of the pixels in row -origin_y.
+  double    step;             ///< Size of a pixel in the complex plane.
+  double    origin_x;         ///< Added to columns of the grid, 0 without a tile cache.
+  double    origin_y;         ///< Added to rows of the grid, 0 without a tile cache.
+  size_t    offset_x;         ///< Column of the grid where the image starts, 0 without a tile cache.
+  size_t    offset_y;         ///< Row of the grid where the image starts, 0 without a tile cache.
+  double    center_x;         ///< Column of the reference point, for perturbation.
+  double    center_y;         ///< Row of the reference point, for perturbation.
+
+  mandelbrot_kernel_t kernel;
+  escape_fp escape;
+  perturb_fp perturb;
+  continue_fp resume;
+  mandelbrot_mode_t mode;     ///< Never MANDELBROT_MODE_AUTO.
+  orbit_t   orbit;            ///< Computed on the first request, for MANDELBROT_MODE_PERTURBATION.
+  int       subdivide;        ///< Fill rectangles with a uniform border, see mandelbrot_set_subdivision.
+  tilecache_t cache;          ///< Only used in MANDELBROT_MODE_DIRECT, NULL for none.
+  const primesieve_bitmap_t* primes; ///< For prime coloring, up to at least max_iter, or NULL.
+  int64_t   first_column;     ///< Lattice tile of the top left tile of the grid, with a tile cache.
+  int64_t   first_row;
+
+  uint32_t* iterations;       ///< Ring of window bands of tile rows, band b in slot b % window.
+  size_t    window;           ///< Bands the ring holds: all of them, unless there is an output file.
+  size_t*   band_tiles;       ///< Finished tiles per slot of the ring, with an output file.
+  size_t    head_band;        ///< Oldest band that has not been written yet.
+  int       writing;          ///< A worker is writing head_band.
+  imagefile_writer_t output;  ///< File the rows are streamed to, in order, or NULL.
+  int       failed;           ///< The image could not be allocated, or written.
+
+  size_t    tiles_x, tiles_y;
+  size_t    next_tile;        ///< Tiles are handed out in row-major order.
+  size_t    tiles_done;
+
+  uint64_t  total;
+  uint64_t  inside;
+  uint64_t  skipped;
+  uint64_t  prime;
+  size_t    tiles_from[TILE_DOWNSAMPLE + 1]; ///< Finished tiles, by source.
+};
+
+// Real part of column x, and imaginary part of row y, as the kernels compute them.
+static inline double column_re(const struct mandelbrot* mandelbrot, size_t x)
+{
+  return mandelbrot->left + ((double)x + mandelbrot->origin_x) * mandelbrot->step;
+}
+
+static inline double row_im(const struct mandelbrot* mandelbrot, size_t y)
+{
+  return mandelbrot->top - ((double)y + mandelbrot->origin_y) * mandelbrot->step;
+}
+
+// Iterate an orbit on from its n-th point z, until it escapes, comes back exactly to a
+// point it passed before, or reaches max_iter. Returns the iteration count, and leaves
+// the last point in z.
+static inline uint32_t iterate_orbit(double cr, double ci, double* z_re, double* z_im,
+                                     uint32_t n, uint32_t max_iter)
+{
+  double zr = *z_re, zi = *z_im, zr2 = zr * zr, zi2 = zi * zi;
+  double saved_r = zr, saved_i = zi;
+  uint32_t steps = 0, check = 1;
+
+  while(n < max_iter && zr2 + zi2 <= 4.0)
+  {
+    zi  = 2.0 * zr * zi + ci;
+    zr  = zr2 - zi2 + cr;
+    zr2 = zr * zr;
+    zi2 = zi * zi;
+    n++;
+    steps++;
+
+    if(zr == saved_r && zi == saved_i)
+    {
+      n = max_iter;
+      break;
+    }
+    if(steps == check)
+    {
+      saved_r = zr;
+      saved_i = zi;
+      check <<= 1;
+    }
+  }
+
+  *z_re = zr;
+  *z_im = zi;
+  return n;
+}
+
+static void escape_scalar(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                          int vertical, uint32_t* iterations, double* last_re, double* last_im)
+{
+  for(size_t i = 0; i < count; i++)
+  {
+    double zr = 0, zi = 0;
+    iterations[i] = iterate_orbit(column_re(mandelbrot, vertical ? x : x + i),
+                                  row_im(mandelbrot, vertical ? y + i : y),
+                                  &zr, &zi, 0, mandelbrot->view.max_iter);
+    if(last_re)
+    {
+      last_re[i] = zr;
+      last_im[i] = zi;
+    }
+  }
+}
+
+static void continue_scalar(const struct mandelbrot* mandelbrot, size_t count, const double* cr,
+                            const double* ci, double* last_re, double* last_im, uint32_t* iterations)
+{
+  for(size_t i = 0; i < count; i++)
+    iterations[i] = iterate_orbit(cr[i], ci[i], &last_re[i], &last_im[i], iterations[i], mandelbrot->view.max_iter);
+}
+
+// One step of a pixel's difference dz to the reference orbit: dz = (2 Z + dz) dz + dc.
+// Every perturbation kernel does these operations, in this order.
+static void perturb_scalar(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                           int vertical, uint32_t* iterations)
+{
+  const orbit_t* orbit = &mandelbrot->orbit;
+  uint32_t max_iter = mandelbrot->view.max_iter;
+
+  for(size_t i = 0; i < count; i++)
+  {
+    double dcr = ((double)(vertical ? x : x + i) - mandelbrot->center_x) * mandelbrot->step;
+    double dci = (mandelbrot->center_y - (double)(vertical ? y + i : y)) * mandelbrot->step;
+    double dzr = 0, dzi = 0;
+    size_t m = 0;
+    uint32_t n = 0;
+
+    while(n < max_iter)
+    {
+      double tr = 2.0 * orbit->re[m] + dzr;
+      double ti = 2.0 * orbit->im[m] + dzi;
+      double nr = tr * dzr - ti * dzi + dcr;
+      dzi = tr * dzi + ti * dzr + dci;
+      dzr = nr;
+      m++;
+      n++;
+
+      double zr = orbit->re[m] + dzr, zi = orbit->im[m] + dzi;
+      double magnitude = zr * zr + zi * zi;
+      if(magnitude > 4.0) break;
+      // Rebase when the orbit comes closer to 0 than to the reference, or the reference ends.
+      if(magnitude < dzr * dzr + dzi * dzi || m == orbit->length)
+      {
+        dzr = zr;
+        dzi = zi;
+        m = 0;
+      }
+    }
+    iterations[i] = n;
+  }
+}
+
+#if HAVE_X86_KERNELS
+// Every vector kernel runs two independent vectors side by side, to hide the latency of
+// the multiplications, and stops as soon as every lane of both has escaped, or turned out
+// to be periodic. Lanes that have escaped keep iterating, but their counts are masked out;
+// periodic lanes are set to max_iter at the end.
+//
+// The pixel coordinates are base + lane, with the lane numbers added to the column or to
+// the row: both are integers, so this is exact and matches the scalar kernel.
+
+__attribute__((target("sse2"), optimize("fp-contract=off")))
+static void escape_sse2(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                        int vertical, uint32_t* iterations, double* last_re, double* last_im)
+{
+  const __m128d four = _mm_set1_pd(4.0), one = _mm_set1_pd(1.0), two = _mm_set1_pd(2.0);
+  const __m128d vleft = _mm_set1_pd(mandelbrot->left), vtop = _mm_set1_pd(mandelbrot->top);
+  const __m128d vstep = _mm_set1_pd(mandelbrot->step), vmax = _mm_set1_pd(mandelbrot->view.max_iter);
+  const __m128d lane = _mm_set_pd(1, 0), xlane = vertical ? _mm_setzero_pd() : lane, ylane = vertical ? lane : _mm_setzero_pd();
+  const size_t dx = ! vertical, dy = vertical;
+  const double origin_x = mandelbrot->origin_x, origin_y = mandelbrot->origin_y;
+  uint32_t max_iter = mandelbrot->view.max_iter;
+
+  for(size_t i = 0; i < count; i += 4)
+  {
+    __m128d cr0 = _mm_add_pd(vleft, _mm_mul_pd(_mm_add_pd(_mm_set1_pd((double)(x + i * dx) + origin_x), xlane), vstep));
+    __m128d cr1 = _mm_add_pd(vleft, _mm_mul_pd(_mm_add_pd(_mm_set1_pd((double)(x + (i + 2) * dx) + origin_x), xlane), vstep));
+    __m128d ci0 = _mm_sub_pd(vtop, _mm_mul_pd(_mm_add_pd(_mm_set1_pd((double)(y + i * dy) + origin_y), ylane), vstep));
+    __m128d ci1 = _mm_sub_pd(vtop, _mm_mul_pd(_mm_add_pd(_mm_set1_pd((double)(y + (i + 2) * dy) + origin_y), ylane), vstep));
+    __m128d zr0 = _mm_setzero_pd(), zi0 = zr0, n0 = zr0, sr0 = zr0, si0 = zr0, periodic0 = zr0;
+    __m128d zr1 = zr0, zi1 = zr0, n1 = zr0, sr1 = zr0, si1 = zr0, periodic1 = zr0;
+    uint32_t check = 1;
+
+    for(uint32_t k = 0; k < max_iter; k++)
+    {
+      __m128d zr20 = _mm_mul_pd(zr0, zr0), zi20 = _mm_mul_pd(zi0, zi0);
+      __m128d zr21 = _mm_mul_pd(zr1, zr1), zi21 = _mm_mul_pd(zi1, zi1);
+      __m128d in0 = _mm_cmple_pd(_mm_add_pd(zr20, zi20), four);
+      __m128d in1 = _mm_cmple_pd(_mm_add_pd(zr21, zi21), four);
+      if(_mm_movemask_pd(_mm_or_pd(_mm_andnot_pd(periodic0, in0), _mm_andnot_pd(periodic1, in1))) == 0) break;
+
+      n0  = _mm_add_pd(n0, _mm_and_pd(in0, one));
+      n1  = _mm_add_pd(n1, _mm_and_pd(in1, one));
+      zi0 = _mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, zr0), zi0), ci0);
+      zi1 = _mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, zr1), zi1), ci1);
+      zr0 = _mm_add_pd(_mm_sub_pd(zr20, zi20), cr0);
+      zr1 = _mm_add_pd(_mm_sub_pd(zr21, zi21), cr1);
+
+      periodic0 = _mm_or_pd(periodic0, _mm_and_pd(in0, _mm_and_pd(_mm_cmpeq_pd(zr0, sr0), _mm_cmpeq_pd(zi0, si0))));
+      periodic1 = _mm_or_pd(periodic1, _mm_and_pd(in1, _mm_and_pd(_mm_cmpeq_pd(zr1, sr1), _mm_cmpeq_pd(zi1, si1))));
+      if(k + 1 == check)
+      {
+        sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1;
+        check <<= 1;
+      }
+    }
+    n0 = _mm_or_pd(_mm_and_pd(periodic0, vmax), _mm_andnot_pd(periodic0, n0));
+    n1 = _mm_or_pd(_mm_and_pd(periodic1, vmax), _mm_andnot_pd(periodic1, n1));
+
+    uint32_t lanes[4];
+    _mm_storel_epi64((__m128i*)lanes, _mm_cvtpd_epi32(n0));
+    _mm_storel_epi64((__m128i*)(lanes + 2), _mm_cvtpd_epi32(n1));
+    memcpy(iterations + i, lanes, MIN(4, count - i) * sizeof(uint32_t));
+    if(last_re)
+    {
+      double re[4], im[4];
+      _mm_storeu_pd(re, zr0), _mm_storeu_pd(re + 2, zr1);
+      _mm_storeu_pd(im, zi0), _mm_storeu_pd(im + 2, zi1);
+      memcpy(last_re + i, re, MIN(4, count - i) * sizeof(double));
+      memcpy(last_im + i, im, MIN(4, count - i) * sizeof(double));
+    }
+  }
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void escape_avx2(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                        int vertical, uint32_t* iterations, double* last_re, double* last_im)
+{
+  const __m256d four = _mm256_set1_pd(4.0), one = _mm256_set1_pd(1.0), two = _mm256_set1_pd(2.0);
+  const __m256d vleft = _mm256_set1_pd(mandelbrot->left), vtop = _mm256_set1_pd(mandelbrot->top);
+  const __m256d vstep = _mm256_set1_pd(mandelbrot->step), vmax = _mm256_set1_pd(mandelbrot->view.max_iter);
+  const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+  const __m256d xlane = vertical ? _mm256_setzero_pd() : lane, ylane = vertical ? lane : _mm256_setzero_pd();
+  const size_t dx = ! vertical, dy = vertical;
+  const double origin_x = mandelbrot->origin_x, origin_y = mandelbrot->origin_y;
+  uint32_t max_iter = mandelbrot->view.max_iter;
+
+  for(size_t i = 0; i < count; i += 8)
+  {
+    __m256d cr0 = _mm256_add_pd(vleft, _mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd((double)(x + i * dx) + origin_x), xlane), vstep));
+    __m256d cr1 = _mm256_add_pd(vleft, _mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd((double)(x + (i + 4) * dx) + origin_x), xlane), vstep));
+    __m256d ci0 = _mm256_sub_pd(vtop, _mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd((double)(y + i * dy) + origin_y), ylane), vstep));
+    __m256d ci1 = _mm256_sub_pd(vtop, _mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd((double)(y + (i + 4) * dy) + origin_y), ylane), vstep));
+    __m256d zr0 = _mm256_setzero_pd(), zi0 = zr0, n0 = zr0, sr0 = zr0, si0 = zr0, periodic0 = zr0;
+    __m256d zr1 = zr0, zi1 = zr0, n1 = zr0, sr1 = zr0, si1 = zr0, periodic1 = zr0;
+    uint32_t check = 1;
+
+    for(uint32_t k = 0; k < max_iter; k++)
+    {
+      __m256d zr20 = _mm256_mul_pd(zr0, zr0), zi20 = _mm256_mul_pd(zi0, zi0);
+      __m256d zr21 = _mm256_mul_pd(zr1, zr1), zi21 = _mm256_mul_pd(zi1, zi1);
+      __m256d in0 = _mm256_cmp_pd(_mm256_add_pd(zr20, zi20), four, _CMP_LE_OQ);
+      __m256d in1 = _mm256_cmp_pd(_mm256_add_pd(zr21, zi21), four, _CMP_LE_OQ);
+      if(_mm256_movemask_pd(_mm256_or_pd(_mm256_andnot_pd(periodic0, in0), _mm256_andnot_pd(periodic1, in1))) == 0) break;
+
+      n0  = _mm256_add_pd(n0, _mm256_and_pd(in0, one));
+      n1  = _mm256_add_pd(n1, _mm256_and_pd(in1, one));
+      zi0 = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, zr0), zi0), ci0);
+      zi1 = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, zr1), zi1), ci1);
+      zr0 = _mm256_add_pd(_mm256_sub_pd(zr20, zi20), cr0);
+      zr1 = _mm256_add_pd(_mm256_sub_pd(zr21, zi21), cr1);
+
+      periodic0 = _mm256_or_pd(periodic0, _mm256_and_pd(in0, _mm256_and_pd(_mm256_cmp_pd(zr0, sr0, _CMP_EQ_OQ),
+                                                                          _mm256_cmp_pd(zi0, si0, _CMP_EQ_OQ))));
+      periodic1 = _mm256_or_pd(periodic1, _mm256_and_pd(in1, _mm256_and_pd(_mm256_cmp_pd(zr1, sr1, _CMP_EQ_OQ),
+                                                                          _mm256_cmp_pd(zi1, si1, _CMP_EQ_OQ))));
+      if(k + 1 == check)
+      {
+        sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1;
+        check <<= 1;
+      }
+    }
+    n0 = _mm256_blendv_pd(n0, vmax, periodic0);
+    n1 = _mm256_blendv_pd(n1, vmax, periodic1);
+
+    uint32_t lanes[8];
+    _mm_storeu_si128((__m128i*)lanes, _mm256_cvtpd_epi32(n0));
+    _mm_storeu_si128((__m128i*)(lanes + 4), _mm256_cvtpd_epi32(n1));
+    memcpy(iterations + i, lanes, MIN(8, count - i) * sizeof(uint32_t));
+    if(last_re)
+    {
+      double re[8], im[8];
+      _mm256_storeu_pd(re, zr0), _mm256_storeu_pd(re + 4, zr1);
+      _mm256_storeu_pd(im, zi0), _mm256_storeu_pd(im + 4, zi1);
+      memcpy(last_re + i, re, MIN(8, count - i) * sizeof(double));
+      memcpy(last_im + i, im, MIN(8, count - i) * sizeof(double));
+    }
+  }
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void escape_avx512(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                          int vertical, uint32_t* iterations, double* last_re, double* last_im)
+{
+  const __m512d four = _mm512_set1_pd(4.0), one = _mm512_set1_pd(1.0), two = _mm512_set1_pd(2.0);
+  const __m512d vleft = _mm512_set1_pd(mandelbrot->left), vtop = _mm512_set1_pd(mandelbrot->top);
+  const __m512d vstep = _mm512_set1_pd(mandelbrot->step), vmax = _mm512_set1_pd(mandelbrot->view.max_iter);
+  const __m512d lane = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+  const __m512d xlane = vertical ? _mm512_setzero_pd() : lane, ylane = vertical ? lane : _mm512_setzero_pd();
+  const size_t dx = ! vertical, dy = vertical;
+  const double origin_x = mandelbrot->origin_x, origin_y = mandelbrot->origin_y;
+  uint32_t max_iter = mandelbrot->view.max_iter;
+
+  for(size_t i = 0; i < count; i += 16)
+  {
+    __m512d cr0 = _mm512_add_pd(vleft, _mm512_mul_pd(_mm512_add_pd(_mm512_set1_pd((double)(x + i * dx) + origin_x), xlane), vstep));
+    __m512d cr1 = _mm512_add_pd(vleft, _mm512_mul_pd(_mm512_add_pd(_mm512_set1_pd((double)(x + (i + 8) * dx) + origin_x), xlane), vstep));
+    __m512d ci0 = _mm512_sub_pd(vtop, _mm512_mul_pd(_mm512_add_pd(_mm512_set1_pd((double)(y + i * dy) + origin_y), ylane), vstep));
+    __m512d ci1 = _mm512_sub_pd(vtop, _mm512_mul_pd(_mm512_add_pd(_mm512_set1_pd((double)(y + (i + 8) * dy) + origin_y), ylane), vstep));
+    __m512d zr0 = _mm512_setzero_pd(), zi0 = zr0, n0 = zr0, sr0 = zr0, si0 = zr0;
+    __m512d zr1 = zr0, zi1 = zr0, n1 = zr0, sr1 = zr0, si1 = zr0;
+    __mmask8 periodic0 = 0, periodic1 = 0;
+    uint32_t check = 1;
+
+    for(uint32_t k = 0; k < max_iter; k++)
+    {
+      __m512d zr20 = _mm512_mul_pd(zr0, zr0), zi20 = _mm512_mul_pd(zi0, zi0);
+      __m512d zr21 = _mm512_mul_pd(zr1, zr1), zi21 = _mm512_mul_pd(zi1, zi1);
+      __mmask8 in0 = _mm512_cmp_pd_mask(_mm512_add_pd(zr20, zi20), four, _CMP_LE_OQ);
+      __mmask8 in1 = _mm512_cmp_pd_mask(_mm512_add_pd(zr21, zi21), four, _CMP_LE_OQ);
+      if(((in0 & ~periodic0) | (in1 & ~periodic1)) == 0) break;
+
+      n0  = _mm512_mask_add_pd(n0, in0, n0, one);
+      n1  = _mm512_mask_add_pd(n1, in1, n1, one);
+      zi0 = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, zr0), zi0), ci0);
+      zi1 = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, zr1), zi1), ci1);
+      zr0 = _mm512_add_pd(_mm512_sub_pd(zr20, zi20), cr0);
+      zr1 = _mm512_add_pd(_mm512_sub_pd(zr21, zi21), cr1);
+
+      periodic0 |= _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(in0, zr0, sr0, _CMP_EQ_OQ), zi0, si0, _CMP_EQ_OQ);
+      periodic1 |= _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(in1, zr1, sr1, _CMP_EQ_OQ), zi1, si1, _CMP_EQ_OQ);
+      if(k + 1 == check)
+      {
+        sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1;
+        check <<= 1;
+      }
+    }
+    n0 = _mm512_mask_mov_pd(n0, periodic0, vmax);
+    n1 = _mm512_mask_mov_pd(n1, periodic1, vmax);
+
+    uint32_t lanes[16];
+    _mm256_storeu_si256((__m256i*)lanes, _mm512_cvtpd_epi32(n0));
+    _mm256_storeu_si256((__m256i*)(lanes + 8), _mm512_cvtpd_epi32(n1));
+    memcpy(iterations + i, lanes, MIN(16, count - i) * sizeof(uint32_t));
+    if(last_re)
+    {
+      double re[16], im[16];
+      _mm512_storeu_pd(re, zr0), _mm512_storeu_pd(re + 8, zr1);
+      _mm512_storeu_pd(im, zi0), _mm512_storeu_pd(im + 8, zi1);
+      memcpy(last_re + i, re, MIN(16, count - i) * sizeof(double));
+      memcpy(last_im + i, im, MIN(16, count - i) * sizeof(double));
+    }
+  }
+}
+
+// The perturbation kernels load the reference orbit with gathers, every lane at its own
+// index. Lanes that have escaped keep iterating, and rebasing, but stop counting.
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void perturb_avx2(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                         int vertical, uint32_t* iterations)
+{
+  const orbit_t* orbit = &mandelbrot->orbit;
+  const __m256d four = _mm256_set1_pd(4.0), one = _mm256_set1_pd(1.0), two = _mm256_set1_pd(2.0);
+  const __m256d vcenter_x = _mm256_set1_pd(mandelbrot->center_x), vcenter_y = _mm256_set1_pd(mandelbrot->center_y);
+  const __m256d vstep = _mm256_set1_pd(mandelbrot->step);
+  const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+  const __m256d xlane = vertical ? _mm256_setzero_pd() : lane, ylane = vertical ? lane : _mm256_setzero_pd();
+  const __m256i length = _mm256_set1_epi64x(orbit->length), next = _mm256_set1_epi64x(1);
+  const size_t dx = ! vertical, dy = vertical;
+  uint32_t max_iter = mandelbrot->view.max_iter;
+
+  for(size_t i = 0; i < count; i += 4)
+  {
+    __m256d dcr = _mm256_mul_pd(_mm256_sub_pd(_mm256_add_pd(_mm256_set1_pd(x + i * dx), xlane), vcenter_x), vstep);
+    __m256d dci = _mm256_mul_pd(_mm256_sub_pd(vcenter_y, _mm256_add_pd(_mm256_set1_pd(y + i * dy), ylane)), vstep);
+    __m256d dzr = _mm256_setzero_pd(), dzi = dzr, n = dzr;
+    __m256d Zr = dzr, Zi = dzr; // Z_0 = 0
+    __m256d active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    __m256i m = _mm256_setzero_si256();
+
+    for(uint32_t k = 0; k < max_iter && _mm256_movemask_pd(active); k++)
+    {
+      __m256d tr = _mm256_add_pd(_mm256_mul_pd(two, Zr), dzr);
+      __m256d ti = _mm256_add_pd(_mm256_mul_pd(two, Zi), dzi);
+      __m256d nr = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(tr, dzr), _mm256_mul_pd(ti, dzi)), dcr);
+      dzi = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tr, dzi), _mm256_mul_pd(ti, dzr)), dci);
+      dzr = nr;
+      m = _mm256_add_epi64(m, next);
+      n = _mm256_add_pd(n, _mm256_and_pd(active, one));
+
+      Zr = _mm256_i64gather_pd(orbit->re, m, 8);
+      Zi = _mm256_i64gather_pd(orbit->im, m, 8);
+      __m256d zr = _mm256_add_pd(Zr, dzr), zi = _mm256_add_pd(Zi, dzi);
+      __m256d magnitude = _mm256_add_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi));
+      active = _mm256_andnot_pd(_mm256_cmp_pd(magnitude, four, _CMP_GT_OQ), active);
+
+      __m256d delta = _mm256_add_pd(_mm256_mul_pd(dzr, dzr), _mm256_mul_pd(dzi, dzi));
+      __m256d rebase = _mm256_or_pd(_mm256_cmp_pd(magnitude, delta, _CMP_LT_OQ),
+                                    _mm256_castsi256_pd(_mm256_cmpeq_epi64(m, length)));
+      dzr = _mm256_blendv_pd(dzr, zr, rebase);
+      dzi = _mm256_blendv_pd(dzi, zi, rebase);
+      Zr  = _mm256_andnot_pd(rebase, Zr);
+      Zi  = _mm256_andnot_pd(rebase, Zi);
+      m   = _mm256_andnot_si256(_mm256_castpd_si256(rebase), m);
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, _mm256_cvtpd_epi32(n));
+    memcpy(iterations + i, lanes, MIN(4, count - i) * sizeof(uint32_t));
+  }
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void perturb_avx512(const struct mandelbrot* mandelbrot, size_t x, size_t y, size_t count,
+                           int vertical, uint32_t* iterations)
+{
+  const orbit_t* orbit = &mandelbrot->orbit;
+  const __m512d four = _mm512_set1_pd(4.0), one = _mm512_set1_pd(1.0), two = _mm512_set1_pd(2.0);
+  const __m512d vcenter_x = _mm512_set1_pd(mandelbrot->center_x), vcenter_y = _mm512_set1_pd(mandelbrot->center_y);
+  const __m512d vstep = _mm512_set1_pd(mandelbrot->step);
+  const __m512d lane = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+  const __m512d xlane = vertical ? _mm512_setzero_pd() : lane, ylane = vertical ? lane : _mm512_setzero_pd();
+  const __m512i length = _mm512_set1_epi64(orbit->length), next = _mm512_set1_epi64(1);
+  const size_t dx = ! vertical, dy = vertical;
+  uint32_t max_iter = mandelbrot->view.max_iter;
+
+  for(size_t i = 0; i < count; i += 8)
+  {
+    __m512d dcr = _mm512_mul_pd(_mm512_sub_pd(_mm512_add_pd(_mm512_set1_pd(x + i * dx), xlane), vcenter_x), vstep);
+    __m512d dci = _mm512_mul_pd(_mm512_sub_pd(vcenter_y, _mm512_add_pd(_mm512_set1_pd(y + i * dy), ylane)), vstep);
+    __m512d dzr = _mm512_setzero_pd(), dzi = dzr, n = dzr;
+    __m512d Zr = dzr, Zi = dzr; // Z_0 = 0
+    __mmask8 active = 0xff;
+    __m512i m = _mm512_setzero_si512();
+
+    for(uint32_t k = 0; k < max_iter && active; k++)
+    {
+      __m512d tr = _mm512_add_pd(_mm512_mul_pd(two, Zr), dzr);
+      __m512d ti = _mm512_add_pd(_mm512_mul_pd(two, Zi), dzi);
+      __m512d nr = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(tr, dzr), _mm512_mul_pd(ti, dzi)), dcr);
+      dzi = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(tr, dzi), _mm512_mul_pd(ti, dzr)), dci);
+      dzr = nr;
+      m = _mm512_add_epi64(m, next);
+      n = _mm512_mask_add_pd(n, active, n, one);
+
+      Zr = _mm512_i64gather_pd(m, orbit->re, 8);
+      Zi = _mm512_i64gather_pd(m, orbit->im, 8);
+      __m512d zr = _mm512_add_pd(Zr, dzr), zi = _mm512_add_pd(Zi, dzi);
+      __m512d magnitude = _mm512_add_pd(_mm512_mul_pd(zr, zr), _mm512_mul_pd(zi, zi));
+      active &= ~_mm512_cmp_pd_mask(magnitude, four, _CMP_GT_OQ);
+
+      __m512d delta = _mm512_add_pd(_mm512_mul_pd(dzr, dzr), _mm512_mul_pd(dzi, dzi));
+      __mmask8 rebase = _mm512_cmp_pd_mask(magnitude, delta, _CMP_LT_OQ) | _mm512_cmpeq_epi64_mask(m, length);
+      dzr = _mm512_mask_blend_pd(rebase, dzr, zr);
+      dzi = _mm512_mask_blend_pd(rebase, dzi, zi);
+      Zr  = _mm512_maskz_mov_pd(~rebase, Zr);
+      Zi  = _mm512_maskz_mov_pd(~rebase, Zi);
+      m   = _mm512_maskz_mov_epi64(~rebase, m);
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, _mm512_cvtpd_epi32(n));
+    memcpy(iterations + i, lanes, MIN(8, count - i) * sizeof(uint32_t));
+  }
+}
+// The continue kernels run one vector at a time, as their lanes start at different points
+// of their orbits. A lane stops moving once it has escaped or reached max_iter, so its last
+// point is where it stopped.
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void continue_avx2(const struct mandelbrot* mandelbrot, size_t count, const double* cr,
+                          const double* ci, double* last_re, double* last_im, uint32_t* iterations)
+{
+  const __m256d four = _mm256_set1_pd(4.0), one = _mm256_set1_pd(1.0), two = _mm256_set1_pd(2.0);
+  const __m256d vmax = _mm256_set1_pd(mandelbrot->view.max_iter);
+
+  for(size_t i = 0; i < count; i += 4)
+  {
+    // Unused lanes start at max_iter, so they never move.
+    double lanes[5][4];
+    for(size_t j = 0; j < 4; j++)
+    {
+      int used = i + j < count;
+      lanes[0][j] = used ? cr[i + j] : 0;
+      lanes[1][j] = used ? ci[i + j] : 0;
+      lanes[2][j] = used ? last_re[i + j] : 0;
+      lanes[3][j] = used ? last_im[i + j] : 0;
+      lanes[4][j] = used ? iterations[i + j] : mandelbrot->view.max_iter;
+    }
+    __m256d vcr = _mm256_loadu_pd(lanes[0]), vci = _mm256_loadu_pd(lanes[1]);
+    __m256d zr = _mm256_loadu_pd(lanes[2]), zi = _mm256_loadu_pd(lanes[3]), n = _mm256_loadu_pd(lanes[4]);
+    __m256d sr = zr, si = zi, periodic = _mm256_setzero_pd();
+    uint32_t check = 1;
+
+    for(uint32_t k = 0; ; k++)
+    {
+      __m256d zr2 = _mm256_mul_pd(zr, zr), zi2 = _mm256_mul_pd(zi, zi);
+      __m256d in = _mm256_and_pd(_mm256_cmp_pd(_mm256_add_pd(zr2, zi2), four, _CMP_LE_OQ),
+                                 _mm256_cmp_pd(n, vmax, _CMP_LT_OQ));
+      in = _mm256_andnot_pd(periodic, in);
+      if(_mm256_movemask_pd(in) == 0) break;
+
+      n  = _mm256_add_pd(n, _mm256_and_pd(in, one));
+      zi = _mm256_blendv_pd(zi, _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, zr), zi), vci), in);
+      zr = _mm256_blendv_pd(zr, _mm256_add_pd(_mm256_sub_pd(zr2, zi2), vcr), in);
+
+      periodic = _mm256_or_pd(periodic, _mm256_and_pd(in, _mm256_and_pd(_mm256_cmp_pd(zr, sr, _CMP_EQ_OQ),
+                                                                        _mm256_cmp_pd(zi, si, _CMP_EQ_OQ))));
+      if(k + 1 == check)
+      {
+        sr = zr, si = zi;
+        check <<= 1;
+      }
+    }
+    n = _mm256_blendv_pd(n, vmax, periodic);
+
+    uint32_t counts[4];
+    _mm_storeu_si128((__m128i*)counts, _mm256_cvtpd_epi32(n));
+    _mm256_storeu_pd(lanes[2], zr);
+    _mm256_storeu_pd(lanes[3], zi);
+    for(size_t j = 0; j < 4 && i + j < count; j++)
+    {
+      iterations[i + j] = counts[j];
+      last_re[i + j] = lanes[2][j];
+      last_im[i + j] = lanes[3][j];
+    }
+  }
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void continue_avx512(const struct mandelbrot* mandelbrot, size_t count, const double* cr,
+                            const double* ci, double* last_re, double* last_im, uint32_t* iterations)
+{
+  const __m512d four = _mm512_set1_pd(4.0), one = _mm512_set1_pd(1.0), two = _mm512_set1_pd(2.0);
+  const __m512d vmax = _mm512_set1_pd(mandelbrot->view.max_iter);
+
+  for(size_t i = 0; i < count; i += 8)
+  {
+    // Unused lanes are masked out of the loads, and start at max_iter.
+    __mmask8 used = count - i >= 8 ? 0xff : (1 << (count - i)) - 1;
+    __m512d vcr = _mm512_maskz_loadu_pd(used, cr + i), vci = _mm512_maskz_loadu_pd(used, ci + i);
+    __m512d zr = _mm512_maskz_loadu_pd(used, last_re + i), zi = _mm512_maskz_loadu_pd(used, last_im + i);
+    __m512d n = _mm512_mask_cvtepu32_pd(vmax, used,
+                                        _mm512_castsi512_si256(_mm512_maskz_loadu_epi32(used, iterations + i)));
+    __m512d sr = zr, si = zi;
+    __mmask8 periodic = 0;
+    uint32_t check = 1;
+
+    for(uint32_t k = 0; ; k++)
+    {
+      __m512d zr2 = _mm512_mul_pd(zr, zr), zi2 = _mm512_mul_pd(zi, zi);
+      __mmask8 in = _mm512_cmp_pd_mask(_mm512_add_pd(zr2, zi2), four, _CMP_LE_OQ)
+        & _mm512_cmp_pd_mask(n, vmax, _CMP_LT_OQ) & ~periodic;
+      if(in == 0) break;
+
+      n  = _mm512_mask_add_pd(n, in, n, one);
+      zi = _mm512_mask_add_pd(zi, in, _mm512_mul_pd(_mm512_mul_pd(two, zr), zi), vci);
+      zr = _mm512_mask_add_pd(zr, in, _mm512_sub_pd(zr2, zi2), vcr);
+
+      periodic |= _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(in, zr, sr, _CMP_EQ_OQ), zi, si, _CMP_EQ_OQ);
+      if(k + 1 == check)
+      {
+        sr = zr, si = zi;
+        check <<= 1;
+      }
+    }
+    n = _mm512_mask_mov_pd(n, periodic, vmax);
+
+    _mm512_mask_storeu_epi32(iterations + i, used, _mm512_castsi256_si512(_mm512_cvtpd_epu32(n)));
+    _mm512_mask_storeu_pd(last_re + i, used, zr);
+    _mm512_mask_storeu_pd(last_im + i, used, zi);
+  }
+}
+#endif
+
+static int kernel_supported(mandelbrot_kernel_t kernel)
+{
+#if HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  switch(kernel)
+  {
+  case MANDELBROT_KERNEL_SSE2:   return __builtin_cpu_supports("sse2");
+  case MANDELBROT_KERNEL_AVX2:   return __builtin_cpu_supports("avx2");
+  case MANDELBROT_KERNEL_AVX512: return __builtin_cpu_supports("avx512f");
+  default: break;
+  }
+#endif
+  return kernel == MANDELBROT_KERNEL_SCALAR;
+}
+
+static escape_fp kernel_function(mandelbrot_kernel_t kernel)
+{
+  switch(kernel)
+  {
+#if HAVE_X86_KERNELS
+  case MANDELBROT_KERNEL_SSE2:   return escape_sse2;
+  case MANDELBROT_KERNEL_AVX2:   return escape_avx2;
+  case MANDELBROT_KERNEL_AVX512: return escape_avx512;
+#endif
+  default: return escape_scalar;
+  }
+}
+
+static perturb_fp perturb_function(mandelbrot_kernel_t kernel)
+{
+  switch(kernel)
+  {
+#if HAVE_X86_KERNELS
+  case MANDELBROT_KERNEL_AVX2:   return perturb_avx2;
+  case MANDELBROT_KERNEL_AVX512: return perturb_avx512;
+#endif
+  default: return perturb_scalar;
+  }
+}
+
+static continue_fp continue_function(mandelbrot_kernel_t kernel)
+{
+  switch(kernel)
+  {
+#if HAVE_X86_KERNELS
+  case MANDELBROT_KERNEL_AVX2:   return continue_avx2;
+  case MANDELBROT_KERNEL_AVX512: return continue_avx512;
+#endif
+  default: return continue_scalar;
+  }
+}
+
+mandelbrot_kernel_t mandelbrot_best_kernel(void)
+{
+  if(kernel_supported(MANDELBROT_KERNEL_AVX512)) return MANDELBROT_KERNEL_AVX512;
+  if(kernel_supported(MANDELBROT_KERNEL_AVX2))   return MANDELBROT_KERNEL_AVX2;
+  if(kernel_supported(MANDELBROT_KERNEL_SSE2))   return MANDELBROT_KERNEL_SSE2;
+  return MANDELBROT_KERNEL_SCALAR;
+}
+
+const char* mandelbrot_kernel_name(mandelbrot_kernel_t kernel)
+{
+  switch(kernel)
+  {
+  case MANDELBROT_KERNEL_AUTO:   return "auto";
+  case MANDELBROT_KERNEL_SCALAR: return "scalar";
+  case MANDELBROT_KERNEL_SSE2:   return "sse2";
+  case MANDELBROT_KERNEL_AVX2:   return "avx2";
+  case MANDELBROT_KERNEL_AVX512: return "avx512";
+  }
+  return "unknown";
+}
+
+mandelbrot_t create_mandelbrot(const mandelbrot_view_t* view)
+{
+  mandelbrot_t mandelbrot = calloc(1, sizeof(struct mandelbrot));
+
+  mandelbrot->view = *view;
+  mandelbrot->step = view->span / view->width;
+  mandelbrot->left = fixed_to_double(&view->center_re) - mandelbrot->step * (view->width - 1) / 2.0;
+  mandelbrot->top  = fixed_to_double(&view->center_im) + mandelbrot->step * (view->height - 1) / 2.0;
+  mandelbrot->center_x = (view->width - 1) / 2.0;
+  mandelbrot->center_y = (view->height - 1) / 2.0;
+  mandelbrot->subdivide = 1;
+  mandelbrot->tiles_x = (view->width + MANDELBROT_TILE_SIZE - 1) / MANDELBROT_TILE_SIZE;
+  mandelbrot->tiles_y = (view->height + MANDELBROT_TILE_SIZE - 1) / MANDELBROT_TILE_SIZE;
+
+  mandelbrot_set_kernel(mandelbrot, MANDELBROT_KERNEL_AUTO);
+  mandelbrot_set_mode(mandelbrot, MANDELBROT_MODE_AUTO);
+  return mandelbrot;
+}
+
+void destroy_mandelbrot(mandelbrot_t mandelbrot)
+{
+  free(mandelbrot->orbit.re);
+  free(mandelbrot->orbit.im);
+  if(mandelbrot->output && imagefile_close(mandelbrot->output))
+    vlog("!!! WARNING! Failed to finish image file.");
+  free(mandelbrot->band_tiles);
+  free(mandelbrot->iterations);
+  free(mandelbrot);
+}
+
+int mandelbrot_set_output(mandelbrot_t mandelbrot, const char* path, imagefile_format_t format)
+{
+  const mandelbrot_view_t* view = &mandelbrot->view;
+
+  mandelbrot->output = create_imagefile(path, format, view->width, view->height, view->max_iter);
+  return mandelbrot->output == NULL;
+}
+
+void mandelbrot_set_cache(mandelbrot_t mandelbrot, tilecache_t cache)
+{
+  mandelbrot->cache = cache;
+}
+
+int mandelbrot_set_primes(mandelbrot_t mandelbrot, const primesieve_bitmap_t* primes)
+{
+  if(primes && primes->checked < mandelbrot->view.max_iter)
+  {
+    vlog("The prime bitmap only goes up to %" PRIu64 ", it needs to cover %" PRIu32 " iterations.",
+         primes->checked, mandelbrot->view.max_iter);
+    return 1;
+  }
+
+  mandelbrot->primes = primes;
+  return 0;
+}
+
+// Row y of the grid, from image column 0, in the ring. The rows of a band are contiguous.
+static uint32_t* image_row(mandelbrot_t mandelbrot, size_t y)
+{
+  size_t band = y / MANDELBROT_TILE_SIZE;
+  return mandelbrot->iterations
+    + ((band % mandelbrot->window) * MANDELBROT_TILE_SIZE + y % MANDELBROT_TILE_SIZE) * mandelbrot->view.width;
+}
+
+// With a tile cache, move the image onto the lattice of points that are multiples of step
+// in the plane, by less than half a pixel, and line the grid of tiles up with the lattice
+// of tiles. Every frame with the same step then computes exactly the same counts for the
+// tiles they share. Doubling or halving step keeps the points on the lattice, too.
+static void place_on_lattice(mandelbrot_t mandelbrot)
+{
+  const mandelbrot_view_t* view = &mandelbrot->view;
+  double column = floor(mandelbrot->left / mandelbrot->step + 0.5);
+  double row    = floor(-mandelbrot->top / mandelbrot->step + 0.5);
+
+  mandelbrot->first_column = (int64_t)floor(column / MANDELBROT_TILE_SIZE);
+  mandelbrot->first_row    = (int64_t)floor(row / MANDELBROT_TILE_SIZE);
+  mandelbrot->origin_x = (double)(mandelbrot->first_column * MANDELBROT_TILE_SIZE);
+  mandelbrot->origin_y = (double)(mandelbrot->first_row * MANDELBROT_TILE_SIZE);
+  mandelbrot->offset_x = (size_t)(column - mandelbrot->origin_x);
+  mandelbrot->offset_y = (size_t)(row - mandelbrot->origin_y);
+  mandelbrot->left = 0;
+  mandelbrot->top  = 0;
+  mandelbrot->tiles_x = (mandelbrot->offset_x + view->width + MANDELBROT_TILE_SIZE - 1) / MANDELBROT_TILE_SIZE;
+  mandelbrot->tiles_y = (mandelbrot->offset_y + view->height + MANDELBROT_TILE_SIZE - 1) / MANDELBROT_TILE_SIZE;
+}
+
+// Allocate the ring, on the first request: without an output file it holds the whole
+// image, with one just enough bands to keep every worker busy while the oldest band
+// is waiting for its last tiles, and one more for the band that is being written.
+static int allocate_image(work_queue_t queue, mandelbrot_t mandelbrot)
+{
+  const mandelbrot_view_t* view = &mandelbrot->view;
+
+  if(mandelbrot->cache && mandelbrot->mode != MANDELBROT_MODE_DIRECT)
+  {
+    dlog("Mandelbrot %p renders with perturbation, without its tile cache.", mandelbrot);
+    mandelbrot->cache = NULL;
+  }
+  if(mandelbrot->cache)
+    place_on_lattice(mandelbrot);
+
+  mandelbrot->window = mandelbrot->tiles_y;
+  if(mandelbrot->output)
+  {
+    size_t workers = MAX(1, queue_get_worker_count(queue));
+    mandelbrot->window = MIN(mandelbrot->tiles_y, 3 + (2 * workers - 1) / mandelbrot->tiles_x);
+    mandelbrot->band_tiles = calloc(mandelbrot->window, sizeof(size_t));
+  }
+
+  // Not cleared: every pixel is written by the worker that renders its tile, which
+  // places the pages near that worker on first touch.
+  size_t rows = MIN(mandelbrot->offset_y + view->height, mandelbrot->window * MANDELBROT_TILE_SIZE);
+  mandelbrot->iterations = malloc(rows * view->width * sizeof(uint32_t));
+  if(! mandelbrot->iterations)
+  {
+    vlog("Failed to allocate %zu rows of %zu pixels.", rows, view->width);
+    mandelbrot->failed = 1;
+    return 1;
+  }
+  if(mandelbrot->output)
+    dlog("Mandelbrot %p streams its rows through %zu bands of %d rows.",
+         mandelbrot, mandelbrot->window, MANDELBROT_TILE_SIZE);
+  return 0;
+}
+
+// Write the rows of a band that are part of the image, and finish the file after the last
+// band, so it can be used right away. Runs outside the queue lock: only one band is written
+// at a time, and nothing else touches the output file or the band's slot meanwhile.
+static void write_band(tile_t* tile)
+{
+  mandelbrot_t mandelbrot = tile->mandelbrot;
+  const mandelbrot_view_t* view = &mandelbrot->view;
+  size_t y = MAX(tile->y, mandelbrot->offset_y);
+  size_t rows = MIN(tile->y + MANDELBROT_TILE_SIZE, mandelbrot->offset_y + view->height) - y;
+
+  tile->failed = imagefile_append(mandelbrot->output, image_row(mandelbrot, y), rows);
+  if(tile->failed)
+    vlog("!!! WARNING! Writing the image failed, the image file will be incomplete.");
+  if(tile->y / MANDELBROT_TILE_SIZE == mandelbrot->tiles_y - 1 || tile->failed)
+  {
+    if(imagefile_close(mandelbrot->output) && ! tile->failed)
+    {
+      vlog("!!! WARNING! Failed to finish image file.");
+      tile->failed = 1;
+    }
+    mandelbrot->output = NULL;
+  }
+}
+
+int mandelbrot_set_kernel(mandelbrot_t mandelbrot, mandelbrot_kernel_t kernel)
+{
+  if(kernel == MANDELBROT_KERNEL_AUTO) kernel = mandelbrot_best_kernel();
+  if(! kernel_supported(kernel))
+  {
+    dlog("This CPU does not support the %s kernel.", mandelbrot_kernel_name(kernel));
+    return 1;
+  }
+
+  mandelbrot->kernel  = kernel;
+  mandelbrot->escape  = kernel_function(kernel);
+  mandelbrot->perturb = perturb_function(kernel);
+  mandelbrot->resume  = continue_function(kernel);
+  return 0;
+}
+
+void mandelbrot_set_mode(mandelbrot_t mandelbrot, mandelbrot_mode_t mode)
+{
+  const mandelbrot_view_t* view = &mandelbrot->view;
+
+  if(mode == MANDELBROT_MODE_AUTO)
+  {
+    double re = fixed_to_double(&view->center_re), im = fixed_to_double(&view->center_im);
+    double magnitude = MAX(1.0, MAX(fabs(re), fabs(im)));
+    mode = mandelbrot->step < MANDELBROT_DEEP_ZOOM * magnitude ? MANDELBROT_MODE_PERTURBATION
+                                                                : MANDELBROT_MODE_DIRECT;
+  }
+  // The reference orbit keeps 64 bits on top of the pixel size, in all but the integer limb.
+  if(mode == MANDELBROT_MODE_PERTURBATION && mandelbrot->step < ldexp(1.0, -64 * (FIXED_LIMBS - 2)))
+    vlog("Warning: a %g wide view is beyond the precision of the reference orbit.", view->span);
+
+  mandelbrot->mode = mode;
+}
+
+// Iterate the center of the view in fixed point, with enough limbs to tell pixels apart.
+static void compute_orbit(mandelbrot_t mandelbrot)
+{
+  const mandelbrot_view_t* view = &mandelbrot->view;
+  orbit_t* orbit = &mandelbrot->orbit;
+  size_t limbs = fixed_limbs_for(mandelbrot->step);
+  fixed_t zr = fixed_from_double(0), zi = fixed_from_double(0), zr2, zi2;
+
+  orbit->re = malloc((view->max_iter + 1) * sizeof(double));
+  orbit->im = malloc((view->max_iter + 1) * sizeof(double));
+  orbit->re[0] = orbit->im[0] = 0;
+  for(orbit->length = 0; orbit->length < view->max_iter; )
+  {
+    fixed_mul(&zr2, &zr, &zr, limbs);
+    fixed_mul(&zi2, &zi, &zi, limbs);
+    if(fixed_to_double(&zr2) + fixed_to_double(&zi2) > 4.0) break;
+
+    fixed_mul(&zi, &zr, &zi, limbs);
+    fixed_add(&zi, &zi, &zi, limbs);
+    fixed_add(&zi, &zi, &view->center_im, limbs);
+    fixed_sub(&zr, &zr2, &zi2, limbs);
+    fixed_add(&zr, &zr, &view->center_re, limbs);
+    orbit->length++;
+    orbit->re[orbit->length] = fixed_to_double(&zr);
+    orbit->im[orbit->length] = fixed_to_double(&zi);
+  }
+
+  dlog("Reference orbit of Mandelbrot %p has %zu points, computed with %zu limbs.",
+       mandelbrot, orbit->length, limbs);
+}
+
+void mandelbrot_set_subdivision(mandelbrot_t mandelbrot, int enabled)
+{
+  mandelbrot->subdivide = enabled;
+}
+
+// Release the references of a tile to cached tiles.
+static void release_cached(tile_t* tile)
+{
+  for(size_t i = 0; i < 4; i++)
+  {
+    if(tile->cached[i]) refcount_decrement(tile->cached[i]);
+    tile->cached[i] = NULL;
+  }
+}
+
+// Find out where the counts of a tile can come from, with a tile cache.
+static void plan_tile(mandelbrot_t mandelbrot, tile_t* tile)
+{
+  uint32_t max_iter = mandelbrot->view.max_iter;
+  tilecache_key_t key = { mandelbrot->step,
+                          mandelbrot->first_column + (int64_t)(tile->x / MANDELBROT_TILE_SIZE),
+                          mandelbrot->first_row + (int64_t)(tile->y / MANDELBROT_TILE_SIZE),
+                          mandelbrot->subdivide };
+
+  tile->key    = key;
+  tile->source = TILE_RENDER;
+  tile->result = NULL;
+  memset(tile->cached, 0, sizeof(tile->cached));
+
+  // Without subdivision every pixel is exact, so counts above max_iter can be cut off.
+  cached_tile_t* cached = tilecache_get(mandelbrot->cache, &key);
+  if(cached && (cached->max_iter == max_iter || (cached->max_iter > max_iter && ! mandelbrot->subdivide)))
+    tile->source = TILE_COPY;
+  else if(cached && cached->max_iter < max_iter)
+    tile->source = TILE_CONTINUE;
+  tile->cached[0] = cached;
+  if(tile->source != TILE_RENDER) return;
+  release_cached(tile);
+
+  // When zooming out by two, the tile is every other pixel of four tiles with half the
+  // step. Subdivision depends on the size of the rectangles, so only without it.
+  if(mandelbrot->subdivide) return;
+  for(size_t i = 0; i < 4; i++)
+  {
+    tilecache_key_t half = { key.step / 2, 2 * key.column + (int64_t)(i % 2), 2 * key.row + (int64_t)(i / 2), 0 };
+    tile->cached[i] = tilecache_get(mandelbrot->cache, &half);
+    if(! tile->cached[i] || tile->cached[i]->max_iter < max_iter)
+    {
+      release_cached(tile);
+      return;
+    }
+  }
+  tile->source = TILE_DOWNSAMPLE;
+}
+
+void* mandelbrot_request_work(work_queue_t queue, size_t worker_id)
+{
+  mandelbrot_t mandelbrot = queue_get_private_data(queue);
+  if(mandelbrot->failed) return NULL;
+  if(! mandelbrot->iterations && allocate_image(queue, mandelbrot)) return NULL;
+
+  // Once all tiles of the oldest band are done, a worker writes it, before it renders more.
+  if(mandelbrot->band_tiles && ! mandelbrot->writing && mandelbrot->head_band < mandelbrot->tiles_y
+     && mandelbrot->band_tiles[mandelbrot->head_band % mandelbrot->window] == mandelbrot->tiles_x)
+  {
+    tile_t* tile = queue_alloc(queue, worker_id, sizeof(tile_t));
+    memset(tile, 0, sizeof(tile_t));
+    tile->y     = mandelbrot->head_band * MANDELBROT_TILE_SIZE;
+    tile->write = 1;
+    tile->mandelbrot = mandelbrot;
+    mandelbrot->writing = 1;
+    return tile;
+  }
+  if(mandelbrot->next_tile == mandelbrot->tiles_x * mandelbrot->tiles_y)
+  { // Bands that are still being rendered or written come back through report.
+    if(mandelbrot->band_tiles && mandelbrot->head_band < mandelbrot->tiles_y) return QUEUE_WORK_PENDING;
+    return NULL;
+  }
+  if(mandelbrot->mode == MANDELBROT_MODE_PERTURBATION && ! mandelbrot->orbit.re)
+    compute_orbit(mandelbrot);
+
+  // Rows are written in order, so never run further ahead than the ring holds.
+  if(mandelbrot->next_tile / mandelbrot->tiles_x >= mandelbrot->head_band + mandelbrot->window)
+  {
+    dlog("Ring full - worker %zu waits for band %zu to finish.", worker_id, mandelbrot->head_band);
+    return QUEUE_WORK_PENDING;
+  }
+
+  size_t index = mandelbrot->next_tile++;
+  tile_t* tile = queue_alloc(queue, worker_id, sizeof(tile_t));
+  tile->x      = (index % mandelbrot->tiles_x) * MANDELBROT_TILE_SIZE;
+  tile->y      = (index / mandelbrot->tiles_x) * MANDELBROT_TILE_SIZE;
+  tile->mandelbrot = mandelbrot;
+  tile->write  = 0;
+  if(mandelbrot->cache)
+  { // Cached tiles are whole tiles of the lattice, also where they stick out of the image.
+    tile->width = tile->height = MANDELBROT_TILE_SIZE;
+    plan_tile(mandelbrot, tile);
+  } else {
+    tile->width  = MIN(MANDELBROT_TILE_SIZE, mandelbrot->view.width - tile->x);
+    tile->height = MIN(MANDELBROT_TILE_SIZE, mandelbrot->view.height - tile->y);
+    tile->source = TILE_RENDER;
+    tile->result = NULL;
+    memset(tile->cached, 0, sizeof(tile->cached));
+  }
+
+  return tile;
+}
+
+// Whether c lies in the main cardioid or in the period 2 bulb, which are inside the set.
+static int in_main_bulbs(double cr, double ci)
+{
+  if(cr < -1.25 || cr > 0.375 || fabs(ci) > 0.65) return 0;
+
+  double ci2 = ci * ci, xr = cr - 0.25;
+  double q = xr * xr + ci2;
+  if(q * (q + xr) < 0.25 * ci2) return 1;
+  return (cr + 1.0) * (cr + 1.0) + ci2 < 0.0625;
+}
+
+// Compute count pixels of a tile, along row y from column x, or down column x from row y
+// when vertical is set. Pixels in the main cardioid or bulb are filled in directly.
+static void compute_run(tile_t* tile, size_t x, size_t y, size_t count, int vertical)
+{
+  mandelbrot_t mandelbrot = tile->mandelbrot;
+  size_t at = (y - tile->y) * tile->stride + (x - tile->x);
+  uint32_t column[MANDELBROT_TILE_SIZE];
+  double column_last_re[MANDELBROT_TILE_SIZE], column_last_im[MANDELBROT_TILE_SIZE];
+  uint32_t* out = vertical ? column : tile->image + at;
+  double* last_re = ! tile->last_re ? NULL : vertical ? column_last_re : tile->last_re + at;
+  double* last_im = ! tile->last_im ? NULL : vertical ? column_last_im : tile->last_im + at;
+
+  if(mandelbrot->mode == MANDELBROT_MODE_PERTURBATION)
+    mandelbrot->perturb(mandelbrot, x, y, count, vertical, out);
+  else
+  {
+    // Hand the runs between pixels inside the bulbs to the kernel.
+    size_t start = 0;
+    for(size_t i = 0; i <= count; i++)
+    {
+      if(i < count && ! in_main_bulbs(column_re(mandelbrot, vertical ? x : x + i),
+                                      row_im(mandelbrot, vertical ? y + i : y)))
+        continue;
+
+      if(i > start)
+        mandelbrot->escape(mandelbrot, vertical ? x : x + start, vertical ? y + start : y, i - start,
+                           vertical, out + start, last_re ? last_re + start : NULL, last_im ? last_im + start : NULL);
+      if(i < count)
+      {
+        out[i] = mandelbrot->view.max_iter;
+        if(last_re) last_re[i] = last_im[i] = NAN;
+        tile->skipped++;
+      }
+      start = i + 1;
+    }
+  }
+
+  if(vertical)
+    for(size_t i = 0; i < count; i++)
+    {
+      tile->image[at + i * tile->stride] = column[i];
+      if(last_re)
+      {
+        tile->last_re[at + i * tile->stride] = column_last_re[i];
+        tile->last_im[at + i * tile->stride] = column_last_im[i];
+      }
+    }
+}
+
+// Rectangles are split until they are this many pixels wide or high. They are only split
+// into narrower ones while those stay this wide, as rows shorter than a few vectors
+// waste most of the lanes of the kernels.
+#define SUBDIVIDE_MIN 16
+
+// Render the inside of a rectangle whose border is already computed (Mariani-Silver): when
+// the whole border has the same count, so does the inside, otherwise split the rectangle
+// in two and try again on both halves.
+static void subdivide(tile_t* tile, size_t x, size_t y, size_t width, size_t height)
+{
+  size_t stride = tile->stride;
+  uint32_t* image = tile->image + (y - tile->y) * stride + (x - tile->x);
+
+  if(width <= 2 || height <= 2) return;
+
+  uint32_t value = image[0];
+  int uniform = 1;
+  for(size_t i = 0; i < width && uniform; i++)
+    uniform = image[i] == value && image[(height - 1) * stride + i] == value;
+  for(size_t j = 1; j < height - 1 && uniform; j++)
+    uniform = image[j * stride] == value && image[j * stride + width - 1] == value;
+
+  if(uniform)
+  {
+    for(size_t j = 1; j < height - 1; j++)
+      for(size_t i = 1; i < width - 1; i++)
+        image[j * stride + i] = value;
+    // Filled in pixels have no orbit.
+    if(tile->last_re)
+      for(size_t j = 1; j < height - 1; j++)
+        for(size_t i = 1; i < width - 1; i++)
+          tile->last_re[(y - tile->y + j) * stride + x - tile->x + i] = NAN;
+    tile->skipped += (width - 2) * (height - 2);
+  }
+  else if(width > 2 * SUBDIVIDE_MIN && width >= height)
+  {
+    size_t middle = width / 2;
+    compute_run(tile, x + middle, y + 1, height - 2, 1);
+    subdivide(tile, x, y, middle + 1, height);
+    subdivide(tile, x + middle, y, width - middle, height);
+  }
+  else if(height > SUBDIVIDE_MIN)
+  {
+    size_t middle = height / 2;
+    compute_run(tile, x + 1, y + middle, width - 2, 0);
+    subdivide(tile, x, y, width, middle + 1);
+    subdivide(tile, x, y + middle, width, height - middle);
+  }
+  else
+  {
+    for(size_t j = 1; j < height - 1; j++)
+      compute_run(tile, x + 1, y + j, width - 2, 0);
+  }
+}
+
+// Compute every pixel of a tile, or its border and then subdivide.
+static void render_tile(tile_t* tile)
+{
+  if(tile->mandelbrot->subdivide)
+  {
+    compute_run(tile, tile->x, tile->y, tile->width, 0);
+    if(tile->height > 1)
+      compute_run(tile, tile->x, tile->y + tile->height - 1, tile->width, 0);
+    if(tile->height > 2)
+    {
+      compute_run(tile, tile->x, tile->y + 1, tile->height - 2, 1);
+      if(tile->width > 1)
+        compute_run(tile, tile->x + tile->width - 1, tile->y + 1, tile->height - 2, 1);
+    }
+    subdivide(tile, tile->x, tile->y, tile->width, tile->height);
+  }
+  else
+  {
+    for(size_t y = tile->y; y < tile->y + tile->height; y++)
+      compute_run(tile, tile->x, y, tile->width, 0);
+  }
+}
+
+#define TILE_PIXELS (MANDELBROT_TILE_SIZE * MANDELBROT_TILE_SIZE)
+
+// Make the tile for the cache from the counts of a whole tile, and the last points of
+// their orbits, NaN for pixels that were filled in. Of the pixels at max_iter, those in
+// the main cardioid or bulb stay inside, the others get their orbit saved.
+static cached_tile_t* save_tile(tile_t* tile, const uint32_t* counts, const double* last_re, const double* last_im)
+{
+  mandelbrot_t mandelbrot = tile->mandelbrot;
+  uint32_t max_iter = mandelbrot->view.max_iter;
+  uint8_t settled[TILE_PIXELS];
+  size_t saved = 0;
+
+  for(size_t i = 0; i < TILE_PIXELS; i++)
+  {
+    settled[i] = counts[i] != max_iter
+      || (isnan(last_re[i]) && in_main_bulbs(column_re(mandelbrot, tile->x + i % MANDELBROT_TILE_SIZE),
+                                             row_im(mandelbrot, tile->y + i / MANDELBROT_TILE_SIZE)));
+    saved += ! settled[i];
+  }
+
+  cached_tile_t* cached = refcount_allocate(sizeof(cached_tile_t) + saved * sizeof(saved_orbit_t));
+  cached->max_iter = max_iter;
+  cached->saved    = saved;
+  memcpy(cached->counts, counts, sizeof(cached->counts));
+
+  saved_orbit_t* orbit = cached->orbits;
+  for(size_t i = 0; i < TILE_PIXELS; i++)
+  {
+    if(settled[i]) continue;
+    int known = ! isnan(last_re[i]);
+    orbit->zr    = known ? last_re[i] : 0;
+    orbit->zi    = known ? last_im[i] : 0;
+    orbit->n     = known ? max_iter : 0;
+    orbit->index = i;
+    orbit++;
+  }
+  return cached;
+}
+
+// Raise the max_iter of a cached tile: continue its saved orbits, and start over on the
+// pixels that were filled in. Its other pixels at max_iter stay inside.
+static void continue_tile(tile_t* tile, uint32_t* counts, double* last_re, double* last_im)
+{
+  mandelbrot_t mandelbrot = tile->mandelbrot;
+  const cached_tile_t* cached = tile->cached[0];
+  uint32_t max_iter = mandelbrot->view.max_iter;
+  size_t saved = cached->saved;
+
+  for(size_t i = 0; i < TILE_PIXELS; i++)
+  {
+    counts[i] = cached->counts[i] == cached->max_iter ? max_iter : cached->counts[i];
+    last_re[i] = last_im[i] = NAN;
+  }
+
+  if(saved == 0) return;
+
+  // Line the orbits up for the kernel.
+  double* orbits = malloc(saved * 4 * sizeof(double));
+  uint32_t* n = malloc(saved * sizeof(uint32_t));
+  double *cr = orbits, *ci = cr + saved, *zr = ci + saved, *zi = zr + saved;
+  for(size_t s = 0; s < saved; s++)
+  {
+    const saved_orbit_t* orbit = &cached->orbits[s];
+    cr[s] = column_re(mandelbrot, tile->x + orbit->index % MANDELBROT_TILE_SIZE);
+    ci[s] = row_im(mandelbrot, tile->y + orbit->index / MANDELBROT_TILE_SIZE);
+    zr[s] = orbit->zr;
+    zi[s] = orbit->zi;
+    n[s]  = orbit->n;
+  }
+
+  mandelbrot->resume(mandelbrot, saved, cr, ci, zr, zi, n);
+
+  for(size_t s = 0; s < saved; s++)
+  {
+    size_t i = cached->orbits[s].index;
+    counts[i]  = n[s];
+    last_re[i] = zr[s];
+    last_im[i] = zi[s];
+  }
+  free(orbits);
+  free(n);
+}
+
+// Zooming out by two: pixel (i, j) of the tile is pixel (2i, 2j) of one of the four cached
+// tiles with half the step, which lies exactly on the same point. Their counts above
+// max_iter are cut off, so their orbits are only known if they stopped at max_iter.
+static void downsample_tile(tile_t* tile, uint32_t* counts, double* last_re, double* last_im)
+{
+  const size_t half = MANDELBROT_TILE_SIZE / 2;
+  uint32_t max_iter = tile->mandelbrot->view.max_iter;
+
+  for(size_t j = 0; j < MANDELBROT_TILE_SIZE; j++)
+    for(size_t i = 0; i < MANDELBROT_TILE_SIZE; i++)
+    {
+      const cached_tile_t* cached = tile->cached[(j >= half) * 2 + (i >= half)];
+      uint32_t count = cached->counts[(2 * j % MANDELBROT_TILE_SIZE) * MANDELBROT_TILE_SIZE + 2 * i % MANDELBROT_TILE_SIZE];
+      counts[j * MANDELBROT_TILE_SIZE + i] = MIN(count, max_iter);
+      last_re[j * MANDELBROT_TILE_SIZE + i] = last_im[j * MANDELBROT_TILE_SIZE + i] = NAN;
+    }
+
+  for(size_t q = 0; q < 4; q++)
+  {
+    const cached_tile_t* cached = tile->cached[q];
+    if(cached->max_iter != max_iter) continue;
+
+    for(size_t s = 0; s < cached->saved; s++)
+    {
+      const saved_orbit_t* orbit = &cached->orbits[s];
+      size_t x = orbit->index % MANDELBROT_TILE_SIZE, y = orbit->index / MANDELBROT_TILE_SIZE;
+      if(x % 2 || y % 2 || orbit->n == 0) continue;
+
+      size_t i = (y / 2 + q / 2 * half) * MANDELBROT_TILE_SIZE + x / 2 + q % 2 * half;
+      last_re[i] = orbit->zr;
+      last_im[i] = orbit->zi;
+    }
+  }
+}
+
+// Add up a finished run of counts in the image. With prime coloring, the escaped pixels
+// whose count is not prime are cleared to 0 afterwards.
+static void finish_run(tile_t* tile, uint32_t* counts, size_t count)
+{
+  const primesieve_bitmap_t* primes = tile->mandelbrot->primes;
+  uint32_t max_iter = tile->mandelbrot->view.max_iter;
+
+  for(size_t x = 0; x < count; x++)
+  {
+    tile->total  += counts[x];
+    tile->inside += counts[x] == max_iter;
+  }
+  if(! primes) return;
+
+  for(size_t x = 0; x < count; x++)
+  {
+    if(counts[x] == max_iter) continue;
+    if(primesieve_is_prime(primes, counts[x]))
+      tile->prime++;
+    else
+      counts[x] = 0;
+  }
+}
+
+// Copy the part of a whole tile that lies inside the image into the ring, and add it up.
+static void place_tile(tile_t* tile, const uint32_t* counts)
+{
+  mandelbrot_t mandelbrot = tile->mandelbrot;
+  const mandelbrot_view_t* view = &mandelbrot->view;
+  size_t left  = MAX(tile->x, mandelbrot->offset_x);
+  size_t right = MIN(tile->x + MANDELBROT_TILE_SIZE, mandelbrot->offset_x + view->width);
+  size_t top    = MAX(tile->y, mandelbrot->offset_y);
+  size_t bottom = MIN(tile->y + MANDELBROT_TILE_SIZE, mandelbrot->offset_y + view->height);
+
+  for(size_t y = top; y < bottom; y++)
+  {
+    const uint32_t* from = counts + (y - tile->y) * MANDELBROT_TILE_SIZE + (left - tile->x);
+    uint32_t* row = image_row(mandelbrot, y) + (left - mandelbrot->offset_x);
+
+    memcpy(row, from, (right - left) * sizeof(uint32_t));
+    finish_run(tile, row, right - left);
+  }
+}
+
+// Make a whole tile of the lattice, from the cache where possible.
+static void cached_work(tile_t* tile)
+{
+  uint32_t max_iter = tile->mandelbrot->view.max_iter;
+  uint32_t* counts = malloc(TILE_PIXELS * (sizeof(uint32_t) + 2 * sizeof(double)));
+  double* last_re = (double*)(counts + TILE_PIXELS);
+  double* last_im = last_re + TILE_PIXELS;
+
+  switch(tile->source)
+  {
+  case TILE_RENDER:
+    for(size_t i = 0; i < TILE_PIXELS; i++)
+      last_re[i] = last_im[i] = NAN;
+    tile->image   = counts;
+    tile->stride  = MANDELBROT_TILE_SIZE;
+    tile->last_re = last_re;
+    tile->last_im = last_im;
+    render_tile(tile);
+    tile->result = save_tile(tile, counts, last_re, last_im);
+    break;
+  case TILE_COPY:
+    for(size_t i = 0; i < TILE_PIXELS; i++)
+      counts[i] = MIN(tile->cached[0]->counts[i], max_iter);
+    break;
+  case TILE_CONTINUE:
+    continue_tile(tile, counts, last_re, last_im);
+    tile->result = save_tile(tile, counts, last_re, last_im);
+    break;
+  case TILE_DOWNSAMPLE:
+    downsample_tile(tile, counts, last_re, last_im);
+    tile->result = save_tile(tile, counts, last_re, last_im);
+    break;
+  }
+
+  place_tile(tile, counts);
+  free(counts);
+}
+
+void* mandelbrot_do_work(void* work_desc)
+{
+  tile_t* tile = work_desc;
+  mandelbrot_t mandelbrot = tile->mandelbrot;
+
+  if(tile->write)
+  {
+    write_band(tile);
+    return tile;
+  }
+
+  tile->total = tile->inside = tile->skipped = tile->prime = 0;
+  if(mandelbrot->cache)
+  {
+    cached_work(tile);
+    return tile;
+  }
+
+  tile->image   = image_row(mandelbrot, tile->y) + tile->x;
+  tile->stride  = mandelbrot->view.width;
+  tile->last_re = tile->last_im = NULL;
+  render_tile(tile);
+
+  for(size_t y = 0; y < tile->height; y++)
+    finish_run(tile, tile->image + y * tile->stride, tile->width);
+
+  return tile;
+}
+
+void mandelbrot_report_results(work_queue_t queue, size_t worker_id, void* results)
+{
+  tile_t* tile = results;
+  mandelbrot_t mandelbrot = queue_get_private_data(queue);
+
+  if(tile->write)
+  { // The band's slot is free for the next band.
+    mandelbrot->band_tiles[mandelbrot->head_band % mandelbrot->window] = 0;
+    mandelbrot->head_band++;
+    mandelbrot->writing = 0;
+    mandelbrot->failed |= tile->failed;
+    queue_free(queue, tile);
+    return;
+  }
+
+  mandelbrot->total  += tile->total;
+  mandelbrot->inside += tile->inside;
+  mandelbrot->skipped += tile->skipped;
+  mandelbrot->prime  += tile->prime;
+  mandelbrot->tiles_done++;
+  mandelbrot->tiles_from[tile->source]++;
+  if(tile->result)
+  {
+    tilecache_put(mandelbrot->cache, &tile->key, tile->result);
+    refcount_decrement(tile->result);
+  }
+  release_cached(tile);
+  if(mandelbrot->band_tiles)
+    mandelbrot->band_tiles[(tile->y / MANDELBROT_TILE_SIZE) % mandelbrot->window]++;
+  queue_free(queue, tile);
+}
+
+const uint32_t* mandelbrot_iterations(mandelbrot_t mandelbrot)
+{
+  if(mandelbrot->band_tiles || ! mandelbrot->iterations) return NULL;
+  return image_row(mandelbrot, mandelbrot->offset_y);
+}
+
+int mandelbrot_complete(mandelbrot_t mandelbrot)
+{
+  return ! mandelbrot->failed && mandelbrot->tiles_done == mandelbrot->tiles_x * mandelbrot->tiles_y;
+}
+
+uint64_t mandelbrot_total_iterations(mandelbrot_t mandelbrot)
+{
+  return mandelbrot->total;
+}
+
+uint64_t mandelbrot_skipped_pixels(mandelbrot_t mandelbrot)
+{
+  return mandelbrot->skipped;
+}
+
+void mandelbrot_print(mandelbrot_t mandelbrot)
+{
+  const mandelbrot_view_t* view = &mandelbrot->view;
+  // Enough decimals to place the center within a pixel.
+  size_t decimals = MIN(MAX(6.0, ceil(-log10(mandelbrot->step)) + 2), 300.0);
+  char re[330], im[330];
+
+  fixed_format(&view->center_re, decimals, re, sizeof(re));
+  fixed_format(&view->center_im, decimals, im, sizeof(im));
+  vlog("Mandelbrot %p: %zux%zu pixels around %s %s i, %g wide, %s kernel, %s",
+       mandelbrot, view->width, view->height, re, im, view->span, mandelbrot_kernel_name(mandelbrot->kernel),
+       mandelbrot->mode == MANDELBROT_MODE_PERTURBATION ? "perturbation" : "direct");
+  if(mandelbrot->mode == MANDELBROT_MODE_PERTURBATION)
+    vlog(" => Reference orbit of %zu iterations", mandelbrot->orbit.length);
+  vlog(" => %zu of %zu tiles rendered", mandelbrot->tiles_done, mandelbrot->tiles_x * mandelbrot->tiles_y);
+  vlog(" => %" PRIu64 " iterations, %" PRIu32 " at most per pixel", mandelbrot->total, view->max_iter);
+  vlog(" => %" PRIu64 " pixels inside the set", mandelbrot->inside);
+  vlog(" => %" PRIu64 " pixels (%.1f%%) filled in without iterating", mandelbrot->skipped,
+       100.0 * mandelbrot->skipped / (view->width * view->height));
+  if(mandelbrot->primes)
+    vlog(" => %" PRIu64 " pixels escaped after a prime number of iterations", mandelbrot->prime);
+  if(mandelbrot->cache)
+    vlog(" => %zu tiles from the cache, %zu continued to more iterations, %zu scaled down from half the step",
+         mandelbrot->tiles_from[TILE_COPY], mandelbrot->tiles_from[TILE_CONTINUE], mandelbrot->tiles_from[TILE_DOWNSAMPLE]);
+}
@@ -0,0 +1,235 @@
+#ifndef _MANDELPRIME_MANDELBROT_H_
+#define _MANDELPRIME_MANDELBROT_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+#include "workqueue.h"
+#include "fixedpoint.h"
+#include "imagefile.h"
+#include "tilecache.h"
+#include "primesieve.h"
+
+/**
+ * This header offers an escape time renderer for the Mandelbrot set.
+ *
+ * The image is split into square tiles of MANDELBROT_TILE_SIZE pixels, which are handed
+ * out as work units; use the mandelbrot_* callbacks with create_work_queue. Workers
+ * write the iteration counts of their tile straight into the image.
+ *
+ * The image can be streamed to a file instead (@see mandelbrot_set_output), for frames
+ * larger than memory. It is then kept as a ring of a few bands, rows of tiles, and tiles
+ * are handed out in row-major order: once every tile of the oldest band is done, a worker
+ * writes its rows as a work unit of its own, outside the queue lock, and its slot is reused.
+ * Workers that would run past the ring wait for that, so memory use depends on the width
+ * of the image and the number of workers, not on its height.
+ *
+ * The inner loop runs on SIMD vectors, several pixels at once; lanes that have escaped
+ * stop counting, and a vector is done once all its lanes have escaped. The widest
+ * kernel the CPU supports is picked at runtime. All kernels do the same floating point
+ * operations in the same order, so they produce exactly the same image.
+ *
+ * Most of the time goes to pixels inside the set, which iterate all the way to max_iter.
+ * Three things cut that short:
+ * - Points in the main cardioid or the period 2 bulb are recognised with a formula.
+ * - Orbits that come back exactly to an earlier point are periodic, and stop iterating.
+ * - Tiles are subdivided (Mariani-Silver): a rectangle whose border has the same count
+ *   everywhere is filled in with that count, without computing its inside.
+ * The first two give exactly the counts of iterating every pixel; subdivision is a
+ * heuristic, which misses details that fit between the border pixels, and can be turned
+ * off with mandelbrot_set_subdivision.
+ *
+ * Deep zooms, where pixels are too close together for doubles to tell them apart, use
+ * perturbation: one reference orbit, at the center of the image, is computed in
+ * fixed point with as many limbs as the zoom needs, and every pixel only iterates its difference to that orbit
+ * in doubles. When a pixel's orbit gets closer to 0 than to the reference, or the
+ * reference orbit ends, the pixel is rebased onto the start of the reference orbit
+ * (Zhuoran's method), which avoids the glitches of plain perturbation. This works down
+ * to pixels of about 1e-270, where the reference orbit runs out of limbs.
+ *
+ * Frames of an animation can share their tiles through a tile cache (@see
+ * mandelbrot_set_cache). The image is then moved onto the lattice of points that are
+ * multiples of its pixel size, so a tile of the lattice has the same counts in every frame
+ * it is in, and only the tiles that are not in the cache are rendered. A cached tile keeps
+ * the orbits of its pixels that did not escape, so raising max_iter continues them, rather
+ * than starting over.
+ *
+ * With prime coloring (@see mandelbrot_set_primes), only the pixels that escape after a
+ * prime number of iterations keep their count, looked up in a bitmap from the sieve.
+ **/
+
+#define MANDELBROT_TILE_SIZE 64
+
+/**
+ * Pointer type referring to a Mandelbrot render.
+ **/
+typedef struct mandelbrot* mandelbrot_t;
+
+/**
+ * Implementations of the escape time loop.
+ **/
+typedef enum {
+  MANDELBROT_KERNEL_AUTO,   ///< The widest kernel the CPU supports.
+  MANDELBROT_KERNEL_SCALAR, ///< One pixel at a time, on any CPU.
+  MANDELBROT_KERNEL_SSE2,   ///< 2 doubles per vector.
+  MANDELBROT_KERNEL_AVX2,   ///< 4 doubles per vector.
+  MANDELBROT_KERNEL_AVX512, ///< 8 doubles per vector.
+} mandelbrot_kernel_t;
+
+/**
+ * How pixels are iterated.
+ **/
+typedef enum {
+  MANDELBROT_MODE_AUTO,         ///< Perturbation for views less than MANDELBROT_DEEP_ZOOM wide.
+  MANDELBROT_MODE_DIRECT,       ///< Iterate every pixel on its own, in doubles.
+  MANDELBROT_MODE_PERTURBATION, ///< Iterate every pixel relative to a reference orbit.
+} mandelbrot_mode_t;
+
+/**
+ * MANDELBROT_MODE_AUTO switches to perturbation when a pixel is smaller than this,
+ * relative to the distance of the center to 0 (or 1, whichever is larger).
+ **/
+#define MANDELBROT_DEEP_ZOOM 1e-13
+
+/**
+ * The part of the complex plane to render, and at what resolution.
+ **/
+typedef struct {
+  fixed_t  center_re; ///< Real part of the center of the image.
+  fixed_t  center_im; ///< Imaginary part of the center of the image.
+  double   span;      ///< Width of the image in the complex plane, pixels are square.
+  size_t   width;     ///< In pixels.
+  size_t   height;    ///< In pixels.
+  uint32_t max_iter;  ///< Points that have not escaped after this many iterations are inside.
+} mandelbrot_view_t;
+
+/**
+ * Create a new render. The image is allocated when the first tile is requested.
+ *
+ * @param view The part of the plane to render.
+ * @return The render.
+ **/
+mandelbrot_t create_mandelbrot(const mandelbrot_view_t* view);
+void destroy_mandelbrot(mandelbrot_t mandelbrot);
+
+/**
+ * Choose the kernel to render with, before the render starts.
+ *
+ * @param mandelbrot The render to change.
+ * @param kernel     The kernel to use (@see mandelbrot_kernel_t).
+ * @return 0 on success, non-zero if this CPU does not support the kernel.
+ **/
+int mandelbrot_set_kernel(mandelbrot_t mandelbrot, mandelbrot_kernel_t kernel);
+
+/**
+ * Choose how pixels are iterated, before the render starts.
+ *
+ * Perturbation needs gathers, so with the SSE2 kernel it runs on the scalar kernel.
+ *
+ * @param mandelbrot The render to change.
+ * @param mode       How to iterate pixels (@see mandelbrot_mode_t).
+ **/
+void mandelbrot_set_mode(mandelbrot_t mandelbrot, mandelbrot_mode_t mode);
+
+/**
+ * Stream the image to a file, before the render starts, instead of keeping it in memory.
+ *
+ * The file is finished as soon as the last row is written, or when the render is
+ * destroyed, incomplete.
+ *
+ * @param mandelbrot The render to change.
+ * @param path       Path of the file to create.
+ * @param format     Format to write (@see imagefile.h).
+ * @return 0 on success, non-zero if the file could not be created.
+ **/
+int mandelbrot_set_output(mandelbrot_t mandelbrot, const char* path, imagefile_format_t format);
+
+/**
+ * Share tiles with other renders through a cache, before the render starts.
+ *
+ * The image moves by less than half a pixel, onto the lattice of points at multiples of its
+ * pixel size in the plane. Tiles are rendered whole, also where they stick out of the
+ * image, and kept in the cache. Tiles with the same pixel size and subdivision setting are
+ * taken from the cache:
+ * - with the same max_iter, or without subdivision a higher one, as they are;
+ * - with a lower max_iter by continuing the orbits of the pixels that had not escaped, and
+ *   computing the pixels subdivision filled in at max_iter;
+ * - without subdivision, when zooming out by two, from every other pixel of the four tiles
+ *   with half the pixel size.
+ * Without subdivision, this gives exactly the counts of rendering the image on the lattice
+ * without a cache.
+ *
+ * Perturbation renders do not use the cache. The cache is only used from the work queue
+ * callbacks, under the queue lock, so it can not be shared by renders that run at the
+ * same time.
+ *
+ * @param mandelbrot The render to change.
+ * @param cache      The cache to use, or NULL for none.
+ **/
+void mandelbrot_set_cache(mandelbrot_t mandelbrot, tilecache_t cache);
+
+/**
+ * Color by the primes among the counts, before the render starts: escaped pixels whose
+ * count is not prime get 0 in the image, the others keep their count. Totals and cached
+ * tiles still use the counts themselves.
+ *
+ * @param mandelbrot The render to change.
+ * @param primes     Bitmap of the primes up to at least max_iter (@see primesieve_set_bitmap),
+ *                   which is not changed during the render, or NULL for plain counts.
+ * @return 0 on success, non-zero if the bitmap does not cover max_iter.
+ **/
+int mandelbrot_set_primes(mandelbrot_t mandelbrot, const primesieve_bitmap_t* primes);
+
+/**
+ * Choose whether tiles are subdivided, before the render starts. It is on by default.
+ *
+ * @param mandelbrot The render to change.
+ * @param enabled    Non-zero to fill rectangles with a uniform border without iterating
+ *                   their inside, zero to compute every pixel.
+ **/
+void mandelbrot_set_subdivision(mandelbrot_t mandelbrot, int enabled);
+
+/**
+ * @return The widest kernel this CPU supports.
+ **/
+mandelbrot_kernel_t mandelbrot_best_kernel(void);
+
+/**
+ * @return A short name for a kernel, like "avx2".
+ **/
+const char* mandelbrot_kernel_name(mandelbrot_kernel_t kernel);
+
+void* mandelbrot_request_work(work_queue_t queue, size_t worker_id);
+void  mandelbrot_report_results(work_queue_t queue, size_t worker_id, void* results);
+void* mandelbrot_do_work(void* work_desc);
+
+/**
+ * Get the iteration counts, only valid once the work queue has finished.
+ *
+ * @return width * height iteration counts, row by row from the top left. Points inside
+ *         the set have max_iter. With prime coloring, escaped points without a prime count have 0. NULL if the image was streamed to a file, or could not
+ *         be allocated.
+ **/
+const uint32_t* mandelbrot_iterations(mandelbrot_t mandelbrot);
+
+/**
+ * @return Non-zero if every tile has been rendered, and written if there is an output
+ *         file, without errors. Only valid once the work queue has finished.
+ **/
+int mandelbrot_complete(mandelbrot_t mandelbrot);
+
+/**
+ * @return The total number of iterations of all pixels, only valid once the work queue has finished.
+ **/
+uint64_t mandelbrot_total_iterations(mandelbrot_t mandelbrot);
+
+/**
+ * @return The number of pixels that were filled in without iterating them, by subdivision
+ *         or because they are in the main cardioid or bulb. Only valid once the work queue
+ *         has finished.
+ **/
+uint64_t mandelbrot_skipped_pixels(mandelbrot_t mandelbrot);
+
+void mandelbrot_print(mandelbrot_t mandelbrot);
+
+#endif // _MANDELPRIME_MANDELBROT_H_
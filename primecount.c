@@ -0,0 +1,259 @@
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "math.h"
+
+#include "primecount.h"
+#include "log.h"
+
+// These macro's have double evaluation, so be weary.
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+#define CHUNK_SIZE         (64 * 1024)      ///< Table entries updated per work unit.
+#define PARALLEL_THRESHOLD (4 * CHUNK_SIZE) ///< Rounds this large are split over several workers.
+
+typedef enum {
+  UNIT_HI,     ///< Compute one chunk of hi_next for a parallel round.
+  UNIT_LO,     ///< Compute one chunk of lo_next for a parallel round.
+  UNIT_SERIAL, ///< Process all rounds for candidates [begin, end] in place.
+} unit_type_t;
+
+typedef struct {
+  unit_type_t  type;
+  uint64_t     prime;      ///< Prime of the parallel round.
+  uint64_t     begin, end; ///< Index range [begin, end) for chunks, candidate range [begin, end] for serial units.
+  primecount_t counter;
+} pc_work_t;
+
+struct primecount
+{
+  uint64_t  x;
+  uint64_t  root;           ///< floor(sqrt(x)).
+
+  uint64_t* lo;             ///< lo[v] = S(v) for v <= root.
+  uint64_t* hi;             ///< hi[k] = S(x / k) for 1 <= k <= root.
+  uint64_t* lo_next;        ///< New values computed during a parallel round.
+  uint64_t* hi_next;
+
+  uint64_t  next_candidate; ///< Smallest number that has not been considered as a prime yet.
+
+  uint64_t  round_prime;    ///< Prime of the parallel round in progress, or 0.
+  uint64_t  hi_dispensed, hi_limit; ///< hi indices [1, hi_limit] are updated, up to hi_dispensed handed out.
+  uint64_t  lo_dispensed, lo_limit; ///< lo indices [p^2, lo_limit] are updated, up to lo_dispensed handed out.
+  size_t    outstanding;    ///< Units handed out but not reported yet.
+};
+
+// Integer square root, rounded down.
+static uint64_t isqrt(uint64_t n)
+{
+  uint64_t root = sqrt((double)n);
+
+  while(root > 0 && (root > UINT32_MAX || root * root > n)) root--;
+  while(root < UINT32_MAX && (root + 1) * (root + 1) <= n) root++;
+
+  return root;
+}
+
+primecount_t create_primecount(uint64_t x)
+{
+  primecount_t counter = calloc(1, sizeof(struct primecount));
+
+  counter->x    = x;
+  counter->root = isqrt(x);
+
+  counter->lo      = malloc(sizeof(uint64_t) * (counter->root + 2));
+  counter->hi      = malloc(sizeof(uint64_t) * (counter->root + 2));
+  counter->lo_next = malloc(sizeof(uint64_t) * (counter->root + 2));
+  counter->hi_next = malloc(sizeof(uint64_t) * (counter->root + 2));
+
+  // Initially, S(v) counts all of [2, v].
+  counter->lo[0] = 0;
+  for(uint64_t v = 1; v <= counter->root; v++)
+    counter->lo[v] = v - 1;
+  counter->hi[0] = 0;
+  for(uint64_t k = 1; k <= counter->root; k++)
+    counter->hi[k] = x / k - 1;
+
+  counter->next_candidate = 2;
+
+  return counter;
+}
+
+void destroy_primecount(primecount_t counter)
+{
+  free(counter->hi_next);
+  free(counter->lo_next);
+  free(counter->hi);
+  free(counter->lo);
+  free(counter);
+}
+
+// Number of table entries updated by the round for p.
+static uint64_t round_size(primecount_t counter, uint64_t p)
+{
+  uint64_t p2 = p * p;
+  uint64_t size = MIN(counter->root, counter->x / p2);
+
+  if(p2 <= counter->root) size += counter->root - p2 + 1;
+  return size;
+}
+
+static pc_work_t* new_unit(work_queue_t queue, size_t worker_id, unit_type_t type,
+                           uint64_t prime, uint64_t begin, uint64_t end)
+{
+  primecount_t counter = queue_get_private_data(queue);
+  pc_work_t* work = queue_alloc(queue, worker_id, sizeof(pc_work_t));
+
+  work->type    = type;
+  work->prime   = prime;
+  work->begin   = begin;
+  work->end     = end;
+  work->counter = counter;
+  counter->outstanding++;
+
+  return work;
+}
+
+void* primecount_request_work(work_queue_t queue, size_t worker_id)
+{
+  primecount_t counter = queue_get_private_data(queue);
+
+  if(counter->round_prime)
+  { // Hand out the rest of the parallel round.
+    if(counter->hi_dispensed < counter->hi_limit)
+    {
+      uint64_t begin = counter->hi_dispensed + 1;
+      counter->hi_dispensed = MIN(counter->hi_limit, counter->hi_dispensed + CHUNK_SIZE);
+      return new_unit(queue, worker_id, UNIT_HI, counter->round_prime, begin, counter->hi_dispensed + 1);
+    }
+    if(counter->lo_dispensed < counter->lo_limit)
+    {
+      uint64_t begin = counter->lo_dispensed + 1;
+      counter->lo_dispensed = MIN(counter->lo_limit, counter->lo_dispensed + CHUNK_SIZE);
+      return new_unit(queue, worker_id, UNIT_LO, counter->round_prime, begin, counter->lo_dispensed + 1);
+    }
+  }
+
+  // Rounds depend on all earlier rounds, so wait until they are committed.
+  if(counter->outstanding) return QUEUE_WORK_PENDING;
+
+  // Find the next prime to process; all primes below it have been, so lo[] is final here.
+  uint64_t p = counter->next_candidate;
+  while(p <= counter->root && counter->lo[p] == counter->lo[p - 1]) p++;
+  if(p > counter->root) return NULL;
+
+  if(round_size(counter, p) >= PARALLEL_THRESHOLD)
+  {
+    uint64_t p2 = p * p;
+
+    dlog("Starting parallel round for %" PRIu64 " (%" PRIu64 " entries).", p, round_size(counter, p));
+    counter->round_prime  = p;
+    counter->hi_dispensed = 0;
+    counter->hi_limit     = MIN(counter->root, counter->x / p2);
+    counter->lo_dispensed = p2 - 1;
+    counter->lo_limit     = p2 <= counter->root ? counter->root : p2 - 1;
+    counter->next_candidate = p + 1;
+    return primecount_request_work(queue, worker_id);
+  }
+
+  // Batch the following rounds into one serial unit of about CHUNK_SIZE updates.
+  uint64_t end = p, work = round_size(counter, p);
+  while(end < counter->root && work < CHUNK_SIZE)
+  {
+    end++;
+    work += round_size(counter, end);
+  }
+  counter->next_candidate = end + 1;
+
+  dlog("Handing out serial rounds [%" PRIu64 ", %" PRIu64 "] to worker %zu.", p, end, worker_id);
+  return new_unit(queue, worker_id, UNIT_SERIAL, 0, p, end);
+}
+
+void primecount_report_results(work_queue_t queue, size_t worker_id, void* results)
+{
+  pc_work_t* work = (pc_work_t*)results;
+  primecount_t counter = queue_get_private_data(queue);
+
+  counter->outstanding--;
+  queue_free(queue, work);
+
+  if(counter->round_prime
+     && counter->outstanding == 0
+     && counter->hi_dispensed == counter->hi_limit
+     && counter->lo_dispensed == counter->lo_limit)
+  { // Parallel round is complete, commit its results.
+    uint64_t p2 = counter->round_prime * counter->round_prime;
+
+    memcpy(counter->hi + 1, counter->hi_next + 1, counter->hi_limit * sizeof(uint64_t));
+    if(counter->lo_limit >= p2)
+      memcpy(counter->lo + p2, counter->lo_next + p2, (counter->lo_limit - p2 + 1) * sizeof(uint64_t));
+
+    dlog("Committed round for %" PRIu64 ".", counter->round_prime);
+    counter->round_prime = 0;
+  }
+}
+
+// Apply the round for p in place. Entries are updated in the order in which every
+// read still sees the value from before this round: hi ascending, then lo descending.
+static void serial_round(primecount_t counter, uint64_t p)
+{
+  uint64_t x = counter->x, root = counter->root;
+  uint64_t* lo = counter->lo;
+  uint64_t* hi = counter->hi;
+  uint64_t sp = lo[p - 1], p2 = p * p;
+  uint64_t hi_limit = MIN(root, x / p2);
+
+  for(uint64_t k = 1; k <= hi_limit; k++)
+  {
+    uint64_t d = k * p;
+    hi[k] -= (d <= root ? hi[d] : lo[x / d]) - sp;
+  }
+  for(uint64_t v = root; v >= p2; v--)
+    lo[v] -= lo[v / p] - sp;
+}
+
+void* primecount_do_work(void* work_desc)
+{
+  pc_work_t* work = (pc_work_t*)work_desc;
+  primecount_t counter = work->counter;
+  uint64_t x = counter->x, root = counter->root;
+  uint64_t* lo = counter->lo;
+  uint64_t* hi = counter->hi;
+  uint64_t p = work->prime;
+
+  switch(work->type)
+  {
+  case UNIT_HI:
+    for(uint64_t k = work->begin; k < work->end; k++)
+    {
+      uint64_t d = k * p;
+      counter->hi_next[k] = hi[k] - ((d <= root ? hi[d] : lo[x / d]) - lo[p - 1]);
+    }
+    break;
+  case UNIT_LO:
+    for(uint64_t v = work->begin; v < work->end; v++)
+      counter->lo_next[v] = lo[v] - (lo[v / p] - lo[p - 1]);
+    break;
+  case UNIT_SERIAL:
+    for(uint64_t candidate = work->begin; candidate <= work->end; candidate++)
+    {
+      if(lo[candidate] != lo[candidate - 1])
+        serial_round(counter, candidate);
+    }
+    break;
+  }
+
+  return work;
+}
+
+uint64_t primecount_result(primecount_t counter)
+{
+  if(counter->x < 2) return 0;
+  return counter->hi[1];
+}
+
+void primecount_print(primecount_t counter)
+{
+  vlog("Prime counter %p: pi(%" PRIu64 ") = %" PRIu64, counter, counter->x, primecount_result(counter));
+}
@@ -0,0 +1,39 @@
+#ifndef _MANDELPRIME_PRIMECOUNT_H_
+#define _MANDELPRIME_PRIMECOUNT_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+#include "workqueue.h"
+
+/**
+ * This header offers a sublinear prime counting engine: pi(x) in O(x^(3/4)) time and
+ * O(x^(1/2)) memory, using Lucy_Hedgehog's variant of the Legendre/Meissel method.
+ *
+ * For every v in { x / k } it keeps S(v), the count of numbers in [2, v] that are not
+ * a multiple of any prime processed so far. Processing prime p updates every v >= p^2:
+ *   S(v) -= S(v / p) - S(p - 1)
+ * Once all primes up to sqrt(x) have been processed, S(x) = pi(x).
+ *
+ * The rounds for small primes touch most of the table and are split into chunks that
+ * workers compute in parallel; the many small rounds for larger primes are batched into
+ * serial work units. Use the primecount_* callbacks with create_work_queue.
+ **/
+
+typedef struct primecount* primecount_t;
+
+primecount_t create_primecount(uint64_t x);
+void destroy_primecount(primecount_t counter);
+
+void* primecount_request_work(work_queue_t queue, size_t worker_id);
+void  primecount_report_results(work_queue_t queue, size_t worker_id, void* results);
+void* primecount_do_work(void* work_desc);
+
+/**
+ * @return pi(x), only valid once the work queue has finished.
+ **/
+uint64_t primecount_result(primecount_t counter);
+
+void primecount_print(primecount_t counter);
+
+#endif // _MANDELPRIME_PRIMECOUNT_H_
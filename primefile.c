@@ -0,0 +1,302 @@
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+
+#include "primefile.h"
+#include "primestore.h"
+#include "log.h"
+
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t interval;
+} header_t;
+
+typedef struct {
+  uint64_t value;  ///< Prime at index n * interval.
+  uint64_t offset; ///< File offset of the gap following that prime.
+} index_entry_t;
+
+typedef struct {
+  uint64_t count;
+  uint64_t max_checked;
+  uint64_t index_offset;
+  uint64_t last;
+  uint64_t magic;
+} footer_t;
+
+struct primefile_writer
+{
+  int       fd;
+  uint8_t*  buffer;
+  size_t    buffered;
+  uint64_t  offset;   ///< File offset of the first byte in buffer.
+
+  index_entry_t* index;
+  size_t    index_count;
+  size_t    index_capacity;
+  uint32_t  interval;
+
+  uint64_t  count;
+  uint64_t  last;
+  int       failed;
+};
+
+struct primefile
+{
+  const uint8_t*       data;
+  size_t               size;
+  const header_t*      header;
+  const index_entry_t* index;
+  size_t               index_count;
+  const footer_t*      footer;
+};
+
+static int write_all(int fd, const void* data, size_t size)
+{
+  while(size)
+  {
+    ssize_t written = write(fd, data, size);
+    if(written < 0)
+    {
+      if(errno == EINTR) continue;
+      vlog("Failed to write prime file: %s", strerror(errno));
+      return 1;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+static void flush_buffer(primefile_writer_t writer)
+{
+  if(! writer->failed)
+    writer->failed = write_all(writer->fd, writer->buffer, writer->buffered);
+  writer->offset  += writer->buffered;
+  writer->buffered = 0;
+}
+
+primefile_writer_t create_primefile(const char* path, uint32_t interval)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+  {
+    vlog("Failed to create prime file %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  primefile_writer_t writer = calloc(1, sizeof(struct primefile_writer));
+  writer->fd = fd;
+  writer->buffer = malloc(WRITE_BUFFER_SIZE);
+  writer->interval = interval ? interval : PRIMEFILE_INTERVAL;
+  writer->index_capacity = 1024;
+  writer->index = malloc(writer->index_capacity * sizeof(index_entry_t));
+
+  header_t header = { PRIMEFILE_MAGIC, PRIMEFILE_VERSION, writer->interval };
+  memcpy(writer->buffer, &header, sizeof(header));
+  writer->buffered = sizeof(header);
+
+  return writer;
+}
+
+int primefile_append(primefile_writer_t writer, const uint64_t* primes, size_t count)
+{
+  for(size_t i = 0; i < count; i++)
+  {
+    if(writer->buffered + 10 > WRITE_BUFFER_SIZE)
+      flush_buffer(writer);
+
+    writer->buffered += primestore_encode_gap(writer->buffer + writer->buffered,
+                                              primes[i] - writer->last);
+    writer->last = primes[i];
+
+    if(writer->count % writer->interval == 0)
+    {
+      if(writer->index_count == writer->index_capacity)
+      {
+        writer->index_capacity *= 2;
+        writer->index = realloc(writer->index, writer->index_capacity * sizeof(index_entry_t));
+      }
+      writer->index[writer->index_count].value  = primes[i];
+      writer->index[writer->index_count].offset = writer->offset + writer->buffered;
+      writer->index_count++;
+    }
+    writer->count++;
+  }
+
+  return writer->failed;
+}
+
+int primefile_close(primefile_writer_t writer, uint64_t max_checked)
+{
+  flush_buffer(writer);
+
+  footer_t footer = { writer->count, max_checked, writer->offset, writer->last, PRIMEFILE_MAGIC };
+  int failed = writer->failed
+    || write_all(writer->fd, writer->index, writer->index_count * sizeof(index_entry_t))
+    || write_all(writer->fd, &footer, sizeof(footer));
+
+  if(close(writer->fd))
+  {
+    vlog("Failed to close prime file: %s", strerror(errno));
+    failed = 1;
+  }
+
+  free(writer->index);
+  free(writer->buffer);
+  free(writer);
+  return failed;
+}
+
+primefile_t open_primefile(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+  {
+    vlog("Failed to open prime file %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) || st.st_size < (off_t)(sizeof(header_t) + sizeof(footer_t)))
+  {
+    vlog("Prime file %s is too short.", path);
+    close(fd);
+    return NULL;
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    vlog("Failed to map prime file %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  primefile_t file = calloc(1, sizeof(struct primefile));
+  file->data   = data;
+  file->size   = st.st_size;
+  file->header = data;
+  file->footer = data + file->size - sizeof(footer_t);
+
+  uint64_t index_end = file->size - sizeof(footer_t);
+  if(file->header->magic != PRIMEFILE_MAGIC
+     || file->header->version != PRIMEFILE_VERSION
+     || file->header->interval == 0
+     || file->footer->magic != PRIMEFILE_MAGIC
+     || file->footer->index_offset < sizeof(header_t)
+     || file->footer->index_offset > index_end
+     || (index_end - file->footer->index_offset) % sizeof(index_entry_t))
+  {
+    vlog("%s is not a valid prime file.", path);
+    close_primefile(file);
+    return NULL;
+  }
+
+  file->index = data + file->footer->index_offset;
+  file->index_count = (index_end - file->footer->index_offset) / sizeof(index_entry_t);
+  if(file->index_count != (file->footer->count + file->header->interval - 1) / file->header->interval)
+  {
+    vlog("Prime file %s has a corrupted index.", path);
+    close_primefile(file);
+    return NULL;
+  }
+
+  return file;
+}
+
+void close_primefile(primefile_t file)
+{
+  munmap((void*)file->data, file->size);
+  free(file);
+}
+
+size_t primefile_count(primefile_t file)
+{
+  return file->footer->count;
+}
+
+uint64_t primefile_max_checked(primefile_t file)
+{
+  return file->footer->max_checked;
+}
+
+uint64_t primefile_nth_prime(primefile_t file, size_t n)
+{
+  if(n == 0 || n > file->footer->count) return 0;
+
+  size_t index = n - 1;
+  const index_entry_t* entry = file->index + index / file->header->interval;
+  const uint8_t* pos = file->data + entry->offset;
+  uint64_t value = entry->value;
+
+  for(size_t i = index % file->header->interval; i > 0; i--)
+    value += primestore_decode_gap(&pos);
+
+  return value;
+}
+
+void primefile_iter_init(primefile_t file, primefile_iter_t* iter, uint64_t start)
+{
+  iter->count = file->footer->count;
+
+  if(file->index_count == 0 || file->index[0].value >= start)
+  {
+    iter->pos   = file->data + sizeof(header_t);
+    iter->value = 0;
+    iter->index = 0;
+    return;
+  }
+
+  // Binary search for the last index entry below start.
+  size_t low = 0, high = file->index_count - 1;
+  while(low < high)
+  {
+    size_t mid = (low + high + 1) / 2;
+    if(file->index[mid].value < start)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+
+  iter->pos   = file->data + file->index[low].offset;
+  iter->value = file->index[low].value;
+  iter->index = low * file->header->interval + 1;
+
+  // Skip the primes below start, without consuming the first one >= start.
+  while(iter->index < iter->count)
+  {
+    const uint8_t* pos = iter->pos;
+    uint64_t next = iter->value + primestore_decode_gap(&pos);
+    if(next >= start) break;
+    iter->pos   = pos;
+    iter->value = next;
+    iter->index++;
+  }
+}
+
+uint64_t primefile_iter_next(primefile_iter_t* iter)
+{
+  if(iter->index >= iter->count) return 0;
+
+  iter->value += primestore_decode_gap(&iter->pos);
+  iter->index++;
+
+  return iter->value;
+}
+
+size_t primefile_pi(primefile_t file, uint64_t x)
+{
+  if(x == UINT64_MAX) return file->footer->count;
+
+  primefile_iter_t iter;
+  primefile_iter_init(file, &iter, x + 1);
+  return iter.index;
+}
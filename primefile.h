@@ -0,0 +1,130 @@
+#ifndef _MANDELPRIME_PRIMEFILE_H_
+#define _MANDELPRIME_PRIMEFILE_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+/**
+ * This header offers an on-disk format for an ascending list of primes, with a
+ * streaming writer and a memory mapped reader.
+ *
+ * File layout:
+ *  - A header: PRIMEFILE_MAGIC, the format version and the index interval.
+ *  - The primes, as varint encoded gaps (@see primestore_encode_gap), the first
+ *    prime being stored as its distance from 0.
+ *  - A sparse index: for every interval-th prime, its value and the file offset
+ *    right behind its gap. The entry for the prime at index k * interval is entry k.
+ *  - A footer: prime count, largest number checked, index position and PRIMEFILE_MAGIC.
+ *
+ * The index and footer are written when the writer is closed, so a file is only
+ * readable once its writer has been closed.
+ **/
+
+#define PRIMEFILE_MAGIC    0x31454d4952504d4dULL // "MMPRIME1"
+#define PRIMEFILE_VERSION  1
+#define PRIMEFILE_INTERVAL 4096
+
+/**
+ * Pointer type referring to a prime file that is being written.
+ **/
+typedef struct primefile_writer* primefile_writer_t;
+
+/**
+ * Pointer type referring to a memory mapped prime file.
+ **/
+typedef struct primefile* primefile_t;
+
+/**
+ * Iterator over the primes in a prime file, @see primefile_iter_init.
+ **/
+typedef struct {
+  const uint8_t* pos;   ///< Next gap to decode.
+  uint64_t       value; ///< Last prime returned.
+  size_t         index; ///< Index of the next prime to return.
+  size_t         count; ///< Number of primes in the file.
+} primefile_iter_t;
+
+/**
+ * Create a new prime file, replacing any existing file at path.
+ *
+ * @param path     Path of the file.
+ * @param interval Number of primes between index entries, or 0 for PRIMEFILE_INTERVAL.
+ * @return A writer, or NULL if the file could not be created.
+ **/
+primefile_writer_t create_primefile(const char* path, uint32_t interval);
+
+/**
+ * Append primes to a prime file.
+ *
+ * @param writer The file to append to.
+ * @param primes Ascending list of primes, all larger than the last prime appended.
+ * @param count  Number of primes in the list.
+ * @return 0 on success, non-zero if writing failed.
+ **/
+int primefile_append(primefile_writer_t writer, const uint64_t* primes, size_t count);
+
+/**
+ * Write the index and footer and close a prime file.
+ *
+ * @param writer      The file to close. The writer is freed, even on failure.
+ * @param max_checked Largest number that was checked for primality, all primes up to
+ *                    this number must have been appended.
+ * @return 0 on success, non-zero if writing failed.
+ **/
+int primefile_close(primefile_writer_t writer, uint64_t max_checked);
+
+/**
+ * Open and memory map a prime file for reading.
+ *
+ * The mapping is shared, so processes that open the same file share one copy of it
+ * in the page cache.
+ *
+ * @param path Path of the file.
+ * @return The mapped file, or NULL if it could not be opened or is not a valid prime file.
+ **/
+primefile_t open_primefile(const char* path);
+
+/**
+ * Unmap and close a prime file.
+ **/
+void close_primefile(primefile_t file);
+
+/**
+ * @return The number of primes in the file.
+ **/
+size_t primefile_count(primefile_t file);
+
+/**
+ * @return The largest number the file's primes were checked up to.
+ **/
+uint64_t primefile_max_checked(primefile_t file);
+
+/**
+ * @return The n-th prime (primefile_nth_prime(file, 1) == 2), or 0 if it is not in the file.
+ **/
+uint64_t primefile_nth_prime(primefile_t file, size_t n);
+
+/**
+ * Count the primes smaller than or equal to x.
+ *
+ * Only exact if x <= primefile_max_checked(file).
+ **/
+size_t primefile_pi(primefile_t file, uint64_t x);
+
+/**
+ * Start iterating over the primes in a file, starting at the first prime >= start.
+ *
+ * Primes are decoded straight from the mapping; nothing is copied.
+ *
+ * @param file  The file to iterate over.
+ * @param iter  The iterator to initialize.
+ * @param start Lower bound of the primes to return.
+ **/
+void primefile_iter_init(primefile_t file, primefile_iter_t* iter, uint64_t start);
+
+/**
+ * @return The next prime of an iterator, or 0 if the iterator is past the end.
+ **/
+uint64_t primefile_iter_next(primefile_iter_t* iter);
+
+#endif // _MANDELPRIME_PRIMEFILE_H_
@@ -2,10 +2,15 @@
 #include "stdlib.h"
 #include "string.h"
 #include "inttypes.h"
+#include "math.h"
+#include "pthread.h"
 
 #include "primesieve.h"
 #include "log.h"
-#include "refcount.h"
+#include "primetable.h"
+#include "primestore.h"
+#include "primefile.h"
+#include "checkpoint.h"
 
 // These macro's have double evaluation, so be weary.
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
@@ -39,110 +44,337 @@ static uint64_t firstprimes[500] = {
   3433, 3449, 3457, 3461, 3463, 3467, 3469, 3491, 3499, 3511, 3517, 3527, 3529, 3533, 3539, 3541, 3547, 3557, 3559, 3571
 };
 #define firstprimes_count (sizeof(firstprimes)/sizeof(firstprimes[1]))
-#define INIT_SIZE 10000
-#define WORK_SIZE 5000
+#define SEGMENT_SIZE (32 * 1024)             ///< Bytes per sieve segment, small enough to stay in L1.
+#define WHEEL        30                      ///< Numbers covered by one segment byte.
+#define WORK_SIZE    (8 * WHEEL * SEGMENT_SIZE) ///< Numbers in the first work units, before any have been timed.
+#define MIN_WORK_SIZE (WHEEL * SEGMENT_SIZE)    ///< A single segment.
+// Units that store primes are capped lower, since their result buffers grow with their size.
+#define MAX_WORK_SIZE       (32 * WHEEL * SEGMENT_SIZE)
+#define MAX_COUNT_WORK_SIZE (256 * WHEEL * SEGMENT_SIZE)
+#define REORDER_SIZE 256 ///< Units that may be dispensed ahead of the oldest unfinished one.
+#define BITMAP_BLOCK_WORDS 8 ///< Words of a bitmap per rank, 1024 numbers.
+#define BITMAP_BLOCK_BITS  (64 * BITMAP_BLOCK_WORDS)
+
+// Segments store one bit per number coprime to 30: byte k of a segment starting
+// at base holds base + 30k + wheel_residues[bit].
+static const uint8_t  wheel_residues[8] = { 1, 7, 11, 13, 17, 19, 23, 29 };
+static const uint8_t  wheel_gaps[8]     = { 6, 4, 2, 4, 2, 4, 6, 2 };
+static uint8_t        wheel_bit[WHEEL]; ///< Bit index of a residue, or 0xff if it is not coprime to 30.
+
+// Multiples of the presieve primes are removed by copying in a precomputed
+// pattern, which repeats every 7 * 11 * 13 * 17 bytes.
+static const uint64_t presieve_primes[] = { 7, 11, 13, 17 };
+#define presieve_count (sizeof(presieve_primes)/sizeof(presieve_primes[0]))
+#define PRESIEVE_SIZE  (7 * 11 * 13 * 17)
+static uint8_t        presieve_pattern[PRESIEVE_SIZE];
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+
+static void init_wheel(void)
+{
+  memset(wheel_bit, 0xff, sizeof(wheel_bit));
+  for(int i = 0; i < 8; i++)
+    wheel_bit[wheel_residues[i]] = i;
+
+  memset(presieve_pattern, 0xff, PRESIEVE_SIZE);
+  for(size_t i = 0; i < presieve_count; i++)
+  {
+    uint64_t p = presieve_primes[i];
+    for(uint64_t multiple = p; multiple < (uint64_t)PRESIEVE_SIZE * WHEEL; multiple += 2 * p)
+    {
+      uint8_t bit = wheel_bit[multiple % WHEEL];
+      if(bit != 0xff)
+        presieve_pattern[multiple / WHEEL] &= ~(1 << bit);
+    }
+  }
+}
   
 typedef struct work {
+  uint64_t  seq;           ///< Position of this unit in dispensing order.
   uint64_t  start, stop;
-  uint64_t* primes;
+  uint64_t* primes;        ///< Primes found that are <= collect_limit.
   size_t    count;
-  uint64_t* sieve;
-  uint64_t* sieve_end;
-  struct work* next;
+  uint64_t  collect_limit; ///< Larger primes are only counted.
+  uint64_t  total;         ///< Number of primes found in [start, stop].
+  uint64_t  largest;       ///< Largest prime found in [start, stop], or 0.
+  primetable_t table;       ///< Base primes, read without locking.
+  size_t    base_end;      ///< Index in table of the first prime that is not needed for [start, stop].
+  uint8_t*  scratch;       ///< Segment and base prime state for sieve_range, @see scratch_size.
 } work_t;
 
 struct primesieve
 {
-  uint64_t* primes;
-  size_t    count;
-  size_t    capacity;
+  primetable_t primes;     ///< Primes shared with the workers, all primes in PRIMESIEVE_STORE_ARRAY mode.
+
+  primesieve_storage_t storage;
+  primestore_t store;      ///< All primes found, in PRIMESIEVE_STORE_COMPACT mode.
+  uint64_t  base_limit;    ///< Largest prime that can be needed to sieve up to max_number.
+  uint64_t  total;         ///< Number of primes found so far, in all storage modes.
+  uint64_t  largest;       ///< Largest prime found so far.
+  primefile_writer_t output; ///< File that all primes are streamed to, in order, or NULL.
+  checkpoint_t checkpoint; ///< File that the verified prefix is saved to now and then, or NULL.
+  primesieve_bitmap_t* bitmap; ///< Primes up to its limit, or NULL.
 
   uint64_t  max_checked;   ///< Largest number checked for primality.
   uint64_t  max_dispensed; ///< Largest number that has been sent to a worker.
   uint64_t  max_number;    ///< Bound to stop at (no number above this will be checked).
 
-  work_t*   results_list;  ///< Sorted list of results that have predecessors which are not finished yet.
+  uint64_t  next_seq;      ///< Sequence number of the next unit to dispense.
+  uint64_t  head_seq;      ///< Sequence number of the next unit to append.
+  work_t*   reorder[REORDER_SIZE]; ///< Finished units waiting for their predecessors, indexed by seq % REORDER_SIZE.
+
+  unit_sizer_t sizer;      ///< Picks the size of work units, based on how long earlier ones took.
 };
 
-static void grow_sieve(primesieve_t sieve)
+// Integer square root, rounded down.
+static uint64_t isqrt(uint64_t n)
 {
-  sieve->capacity *= 2;
-  sieve->primes = refcount_resize(sieve->primes, sieve->capacity * sizeof(uint64_t));
+  uint64_t root = sqrt((double)n);
+
+  while(root > 0 && (root > UINT32_MAX || root * root > n)) root--;
+  while(root < UINT32_MAX && (root + 1) * (root + 1) <= n) root++;
+
+  return root;
 }
 
 primesieve_t create_primesieve(uint64_t max_number)
+{
+  return create_primesieve_with_storage(max_number, PRIMESIEVE_STORE_ARRAY);
+}
+
+// Creates a sieve that has not found any primes yet.
+static primesieve_t allocate_primesieve(uint64_t max_number, primesieve_storage_t storage)
 {
   primesieve_t sieve = calloc(1, sizeof(struct primesieve));
 
-  sieve->primes = refcount_allocate(sizeof(uint64_t) * INIT_SIZE);
-  memcpy(sieve->primes, firstprimes, sizeof(firstprimes));
+  pthread_once(&wheel_once, init_wheel);
+
+  sieve->primes = create_primetable();
+  sieve->max_number = max_number;
+
+  sieve->storage = storage;
+  sieve->base_limit = isqrt(max_number);
+  if(storage == PRIMESIEVE_STORE_COMPACT)
+    sieve->store = create_primestore();
+  unit_sizer_init(&sieve->sizer, WORK_SIZE, MIN_WORK_SIZE,
+                  storage == PRIMESIEVE_STORE_NONE ? MAX_COUNT_WORK_SIZE : MAX_WORK_SIZE);
+
+  return sieve;
+}
+
+// Keep primes that have been verified: all of them in the store, and the ones that
+// workers may still need in the shared table. The initial primes always stay in the
+// table, so primesieve_pi can count up to the number checked before any work was done.
+static void keep_primes(primesieve_t sieve, const uint64_t* primes, size_t count)
+{
+  size_t shared_count = count;
+  if(sieve->storage != PRIMESIEVE_STORE_ARRAY)
+  { // Only primes that workers may still need are kept uncompressed.
+    uint64_t shared_limit = MAX(sieve->base_limit, firstprimes[firstprimes_count - 1]);
+    if(sieve->store)
+      primestore_append(sieve->store, primes, count);
+    while(shared_count && primes[shared_count - 1] > shared_limit)
+      shared_count--;
+  }
+
+  if(primetable_append(sieve->primes, primes, shared_count))
+    vlog("!!! WARNING! Prime table is full, primes from %" PRIu64 " on are only counted.", primes[0]);
+}
+
+static void load_checkpoint_primes(void* priv_data, const uint64_t* primes, size_t count)
+{
+  keep_primes((primesieve_t)priv_data, primes, count);
+}
 
-  sieve->count = firstprimes_count;
-  sieve->capacity = INIT_SIZE;
+static void get_checkpoint_state(primesieve_t sieve, checkpoint_state_t* state)
+{
+  state->max_checked  = sieve->max_checked;
+  state->total        = sieve->total;
+  state->largest      = sieve->largest;
+  // Without storage, only the primes up to base_limit are collected.
+  state->stored_limit = sieve->storage == PRIMESIEVE_STORE_NONE ? MIN(sieve->max_checked, sieve->base_limit)
+                                                                : sieve->max_checked;
+}
+
+primesieve_t create_primesieve_with_storage(uint64_t max_number, primesieve_storage_t storage)
+{
+  primesieve_t sieve = allocate_primesieve(max_number, storage);
+
+  keep_primes(sieve, firstprimes, firstprimes_count);
   sieve->max_checked = firstprimes[firstprimes_count - 1];
   sieve->max_dispensed = sieve->max_checked;
-  sieve->max_number = max_number;
+  sieve->total = firstprimes_count;
+  sieve->largest = firstprimes[firstprimes_count - 1];
+
+  return sieve;
+}
+
+primesieve_t create_primesieve_from_checkpoint(const char* path, uint64_t max_number,
+                                               primesieve_storage_t storage, double interval)
+{
+  primesieve_t sieve = allocate_primesieve(max_number, storage);
+  checkpoint_state_t state;
+
+  sieve->checkpoint = resume_checkpoint(path, interval, &state, load_checkpoint_primes, sieve);
+  if(! sieve->checkpoint)
+  {
+    destroy_primesieve(sieve);
+    return NULL;
+  }
+
+  sieve->max_checked = state.max_checked;
+  sieve->max_dispensed = sieve->max_checked;
+  sieve->total = state.total;
+  sieve->largest = state.largest;
+
+  // The checkpoint must hold every prime this storage mode keeps.
+  checkpoint_state_t needed;
+  get_checkpoint_state(sieve, &needed);
+  if(state.stored_limit < needed.stored_limit)
+  {
+    vlog("Checkpoint %s only holds the primes up to %" PRIu64 ", cannot resume this sieve from it.",
+         path, state.stored_limit);
+    destroy_primesieve(sieve);
+    return NULL;
+  }
+  if(sieve->max_checked >= max_number)
+    vlog("Checkpoint %s already covers all numbers up to %" PRIu64 ".", path, max_number);
 
   return sieve;
 }
 
 void destroy_primesieve(primesieve_t sieve)
 {
-  work_t* work = sieve->results_list;
-  while(work)
+  for(uint64_t seq = sieve->head_seq; seq < sieve->next_seq; seq++)
   {
-    work_t* next = work->next;
+    work_t* work = sieve->reorder[seq % REORDER_SIZE];
+    if(! work) continue;
 
-    free(work->primes);
-    refcount_free(work->sieve);
-    free(work);
-    
-    work = next;
+    // The queue is gone by now, so its pool can not take these back.
+    queue_free(NULL, work->scratch);
+    queue_free(NULL, work->primes);
+    queue_free(NULL, work);
   }
 
-  refcount_free(sieve->primes);
+  if(sieve->output) primefile_close(sieve->output, sieve->max_checked);
+  if(sieve->checkpoint)
+  {
+    checkpoint_state_t state;
+    get_checkpoint_state(sieve, &state);
+    close_checkpoint(sieve->checkpoint, &state);
+  }
+  if(sieve->store) destroy_primestore(sieve->store);
+  if(sieve->bitmap)
+  {
+    free(sieve->bitmap->words);
+    free(sieve->bitmap->ranks);
+    free(sieve->bitmap);
+  }
+  destroy_primetable(sieve->primes);
   free(sieve);
 }
 
+// Upper bound on the number of primes in [start, stop], used to size result buffers.
+// Uses the Montgomery-Vaughan form of the Brun-Titchmarsh theorem: pi(x+y) - pi(x) < 2y / log(y).
+static size_t max_primes_in_range(uint64_t start, uint64_t stop)
+{
+  uint64_t length = stop - start + 1;
+
+  if(length < 64) return length;
+  return (size_t)(2.0 * length / log(length)) + 1;
+}
+
+// Bytes of scratch space sieve_range needs when sieving with the primes below base_end:
+// next_multiple and the base primes themselves, a segment padded to whole words for
+// popcount, and next_wheel.
+static size_t scratch_size(size_t base_end)
+{
+  return base_end * (2 * sizeof(uint64_t) + 1) + SEGMENT_SIZE + sizeof(uint64_t);
+}
+
 void* primesieve_request_work(work_queue_t queue, size_t worker_id)
 {
-  work_t* new_work = calloc(1, sizeof(work_t));
   primesieve_t sieve = queue_get_private_data(queue);
 
   // Check if all work is done.
   if(sieve->max_dispensed >= sieve->max_number) return NULL;
 
-  new_work->sieve = sieve->primes;
-  refcount_increment(new_work->sieve);
-  new_work->sieve_end = sieve->primes + sieve->count;
+  // Only numbers up to max_checked^2 can be sieved with the primes found so far.
+  uint64_t sieve_limit = sieve->max_checked > UINT32_MAX ? UINT64_MAX
+                                                         : sieve->max_checked * sieve->max_checked;
+  if(sieve->max_dispensed >= sieve_limit)
+  {
+    dlog("No work available - worker %zu waits for [%" PRIu64 ", %" PRIu64 "] to finish.",
+         worker_id, sieve->max_checked + 1, sieve->max_dispensed);
+    return QUEUE_WORK_PENDING;
+  }
+  // Results are merged in order, so never run further ahead than the reorder buffer holds.
+  if(sieve->next_seq - sieve->head_seq >= REORDER_SIZE)
+  {
+    dlog("Reorder buffer full - worker %zu waits for [%" PRIu64 ", ...] to finish.",
+         worker_id, sieve->max_checked + 1);
+    return QUEUE_WORK_PENDING;
+  }
+
+  // All buffers of a unit come from the queue's pool, and return to it in append_work.
+  work_t* new_work = queue_alloc(queue, worker_id, sizeof(work_t));
+  memset(new_work, 0, sizeof(work_t));
+  new_work->seq = sieve->next_seq++;
+
+  new_work->table = sieve->primes;
 
   new_work->start = sieve->max_dispensed + 1;
-  new_work->stop  = MIN(sieve->max_checked * sieve->max_checked,
-                        new_work->start + WORK_SIZE - 1);
+  uint64_t size = unit_sizer_next(&sieve->sizer, queue, sieve->max_number - sieve->max_dispensed);
+  new_work->stop  = MIN(sieve_limit, new_work->start + size - 1);
   new_work->stop  = MIN(sieve->max_number, new_work->stop);
-  new_work->primes = malloc(sizeof(uint64_t) * WORK_SIZE);
 
-  if(new_work->start <= new_work->stop)
-  {
-    dlog("Handing out [%" PRIu64 ", %" PRIu64 "] to worker %zu.",
-         new_work->start, new_work->stop, worker_id);
-  } else {
-    vlog("No work available - worker %zu will be idle for a while.",
-         worker_id);
-  }
+  // Without storage, only the base primes and the primes for the bitmap are collected.
+  new_work->collect_limit = UINT64_MAX;
+  if(sieve->storage == PRIMESIEVE_STORE_NONE)
+    new_work->collect_limit = MAX(sieve->base_limit, sieve->bitmap ? sieve->bitmap->limit : 0);
+
+  if(new_work->start <= new_work->collect_limit)
+    new_work->primes = queue_alloc(queue, worker_id, sizeof(uint64_t)
+                                   * max_primes_in_range(new_work->start,
+                                                         MIN(new_work->stop, new_work->collect_limit)));
 
-  sieve->max_dispensed = MAX(new_work->stop, sieve->max_dispensed);
+  new_work->base_end = primetable_count_upto(sieve->primes, isqrt(new_work->stop), primetable_count(sieve->primes));
+  new_work->scratch  = queue_alloc(queue, worker_id, scratch_size(new_work->base_end));
+  dlog("Handing out [%" PRIu64 ", %" PRIu64 "] to worker %zu.",
+       new_work->start, new_work->stop, worker_id);
+
+  sieve->max_dispensed = new_work->stop;
 
   return new_work;
 }
 
-// Helper function that updates the sieve to include any primes found in work
-// and then frees all the memory used for work.
-// Returns work->next
-static work_t* append_work(primesieve_t sieve, work_t* work)
+// Set the bits of primes, ascending and larger than the primes set before. The ranks of the
+// blocks up to the one of each prime are final by then.
+static void bitmap_append(primesieve_bitmap_t* bitmap, const uint64_t* primes, size_t count)
 {
-  work_t* res = work->next;
+  for(size_t i = 0; i < count && primes[i] <= bitmap->limit; i++)
+  {
+    uint64_t prime = primes[i];
+    if(prime == 2) continue;
+
+    while(bitmap->ranked <= prime / 2 / BITMAP_BLOCK_BITS)
+      bitmap->ranks[bitmap->ranked++] = bitmap->odd_primes;
+    bitmap->words[prime / 128] |= 1ULL << (prime / 2 % 64);
+    bitmap->odd_primes++;
+  }
+}
+
+// All primes up to checked have been set: finish the ranks of the blocks below it.
+static void bitmap_checked(primesieve_bitmap_t* bitmap, uint64_t checked)
+{
+  bitmap->checked = MIN(checked, bitmap->limit);
+  while(bitmap->ranked * BITMAP_BLOCK_BITS <= (bitmap->checked + 1) / 2)
+    bitmap->ranks[bitmap->ranked++] = bitmap->odd_primes;
+}
 
+// Helper function that updates the sieve to include any primes found in work
+// and then returns all the memory used for work to the queue's pool.
+static void append_work(work_queue_t queue, primesieve_t sieve, work_t* work)
+{
   if(work->start != sieve->max_checked + 1)
   {
     vlog("!!! WARNING! Appending primes in range [%" PRIu64 ", %" PRIu64 "], but the current sieve has only checked values up to %" PRIu64 "!!",
@@ -151,136 +383,451 @@ static work_t* append_work(primesieve_t sieve, work_t* work)
     dlog("Appending primes in range [%" PRIu64 ", %" PRIu64 "]", work->start, work->stop); 
   }
 
-  while(sieve->capacity < sieve->count + work->count)
-  { // Out of space, resize array
-    grow_sieve(sieve);
+  if(sieve->output && primefile_append(sieve->output, work->primes, work->count))
+  {
+    vlog("!!! WARNING! Writing primes failed, output file will be incomplete.");
+    primefile_close(sieve->output, sieve->max_checked);
+    sieve->output = NULL;
   }
 
-  memcpy(sieve->primes + sieve->count,
-         work->primes, work->count * sizeof(uint64_t));
-  sieve->count += work->count;
+  if(sieve->checkpoint)
+    checkpoint_append(sieve->checkpoint, work->primes, work->count);
+
+  keep_primes(sieve, work->primes, work->count);
   sieve->max_checked = MAX(work->stop, sieve->max_checked);
+  if(sieve->bitmap)
+  {
+    bitmap_append(sieve->bitmap, work->primes, work->count);
+    bitmap_checked(sieve->bitmap, sieve->max_checked);
+  }
+  sieve->total += work->total;
+  sieve->largest = MAX(work->largest, sieve->largest);
+
+  if(sieve->output && sieve->max_checked >= sieve->max_number)
+  { // All primes have been written, finish the file so readers can use it.
+    if(primefile_close(sieve->output, sieve->max_checked))
+      vlog("!!! WARNING! Failed to finish output file.");
+    sieve->output = NULL;
+  }
+  if(sieve->checkpoint && sieve->max_checked >= sieve->max_number)
+  { // Save the final state right away, rather than when the sieve is destroyed.
+    checkpoint_state_t state;
+    get_checkpoint_state(sieve, &state);
+    if(close_checkpoint(sieve->checkpoint, &state))
+      vlog("!!! WARNING! Failed to write checkpoint.");
+    sieve->checkpoint = NULL;
+  }
   
-  refcount_decrement(work->sieve);
-  free(work->primes);
-  free(work);
+  queue_free(queue, work->scratch);
+  queue_free(queue, work->primes);
+  queue_free(queue, work);
+}
+
+void  primesieve_report_results(work_queue_t queue, size_t worker_id, void* results)
+{
+  work_t* work_res = (work_t*)results;
+  primesieve_t sieve = queue_get_private_data(queue);
+
+  dlog("Recieved [%" PRIu64 ", %" PRIu64 "] from worker %zu, found %" PRIu64 " new primes.",
+       work_res->start, work_res->stop, worker_id, work_res->total);
+
+  unit_sizer_observe(&sieve->sizer, work_res->stop - work_res->start + 1, queue_get_unit_time(queue));
+
+  // Park the results in their slot, then append every unit that is no longer
+  // waiting for a predecessor.
+  sieve->reorder[work_res->seq % REORDER_SIZE] = work_res;
+  if(work_res->seq != sieve->head_seq)
+    dlog("Queueing [%" PRIu64 ", %" PRIu64 "] because of missing work starting at %" PRIu64,
+         work_res->start, work_res->stop, sieve->max_checked+1);
+
+  work_t* work;
+  while((work = sieve->reorder[sieve->head_seq % REORDER_SIZE]))
+  {
+    sieve->reorder[sieve->head_seq % REORDER_SIZE] = NULL;
+    sieve->head_seq++;
+    append_work(queue, sieve, work);
+  }
+
+  if(sieve->checkpoint)
+  {
+    checkpoint_state_t state;
+    get_checkpoint_state(sieve, &state);
+    checkpoint_update(sieve->checkpoint, &state);
+  }
+
+#if VERBOSE
+  dlog("Next value needed is %" PRIu64 ", results left in queue:", sieve->max_checked+1);
 
-  return res;
+  for(uint64_t seq = sieve->head_seq; seq < sieve->next_seq; seq++)
+  {
+    work = sieve->reorder[seq % REORDER_SIZE];
+    if(work) dlog(" - [%" PRIu64 ", %" PRIu64 "]", work->start, work->stop);
+  }
+#endif
 }
 
-static void insert_in_list(primesieve_t sieve, work_t* work_res)
+// Fill a segment starting at base (a multiple of WHEEL) with the presieve pattern.
+static void presieve_segment(uint8_t* segment, size_t size, uint64_t base)
 {
-  dlog("Queueing [%" PRIu64 ", %" PRIu64 "] because of missing work starting at %" PRIu64,
-       work_res->start, work_res->stop, sieve->max_checked+1);
-  
-  if(sieve->results_list == NULL
-     || sieve->results_list->start >= work_res->start)
-  { // Current work should be at the head of the list
-    work_res->next = sieve->results_list;
-    sieve->results_list = work_res;
-    dlog("Inserting  [%" PRIu64 ", %" PRIu64 "] at the front of the list.", work_res->start, work_res->stop);
-  } else {
-    // Current work should be inserted somewhere in the list.
-    work_t *prev_work = NULL,
-      *next_work = sieve->results_list;
-    
-    while(next_work && next_work->start < work_res->start)
+  size_t offset = (base / WHEEL) % PRESIEVE_SIZE;
+
+  for(size_t done = 0; done < size; offset = 0)
+  {
+    size_t chunk = MIN(size - done, PRESIEVE_SIZE - offset);
+    memcpy(segment + done, presieve_pattern + offset, chunk);
+    done += chunk;
+  }
+
+  if(base == 0)
+  { // The presieve primes crossed themselves off, and 1 is not prime.
+    for(size_t i = 0; i < presieve_count; i++)
+      segment[0] |= 1 << wheel_bit[presieve_primes[i]];
+    segment[0] &= ~1;
+  }
+}
+
+// Record a prime found by a worker: primes up to collect_limit are stored, the rest only counted.
+static inline void found_prime(work_t* work, uint64_t prime)
+{
+  if(prime <= work->collect_limit)
+  {
+    work->primes[work->count] = prime;
+    work->count++;
+  }
+  work->total++;
+  work->largest = prime;
+}
+
+// Segmented, wheel-factorized sieve of Eratosthenes over [work->start, work->stop].
+//
+// Each segment holds the numbers coprime to 30 as bits, SEGMENT_SIZE bytes at a time.
+// Multiples of 7 to 17 are removed by the presieve pattern; larger base primes p
+// cross off p * q for q coprime to 30. For every base prime, the next multiple and
+// the wheel position of q are kept in next_multiple and next_wheel, so each segment
+// picks up exactly where the previous one stopped.
+//
+// Segments that lie entirely above work->collect_limit are only counted with popcount.
+static void sieve_range(work_t* work)
+{
+  uint64_t low = work->start, high = work->stop;
+
+  for(int i = 0; i < 3; i++)
+  {
+    if(low <= firstprimes[i] && firstprimes[i] <= high)
+    { // 2, 3 and 5 are not on the wheel
+      found_prime(work, firstprimes[i]);
+    }
+  }
+  low = MAX(low, 7);
+  if(low > high) return;
+
+  // Base primes: everything from 19 up to sqrt(high). The table only grows, so
+  // the entries below base_end are final.
+  size_t base_first = 3 + presieve_count;
+  size_t base_count = work->base_end > base_first ? work->base_end - base_first : 0;
+
+  uint64_t* next_multiple = (uint64_t*)work->scratch;
+  uint64_t* base_primes   = next_multiple + base_count;
+  uint8_t*  segment       = (uint8_t*)(base_primes + base_count);
+  uint8_t*  next_wheel    = segment + SEGMENT_SIZE + sizeof(uint64_t);
+  for(size_t i = 0; i < base_count; )
+  {
+    size_t run;
+    const uint64_t* chunk = primetable_chunk(work->table, base_first + i, &run);
+    run = MIN(run, base_count - i);
+    memcpy(base_primes + i, chunk, run * sizeof(uint64_t));
+    i += run;
+  }
+  for(size_t i = 0; i < base_count; i++)
+  {
+    uint64_t p = base_primes[i];
+    uint64_t q = MAX(p, (low + p - 1) / p);
+    uint8_t  r = q % WHEEL, w = 0;
+
+    while(w < 8 && wheel_residues[w] < r) w++;
+    if(w == 8)
+      q += WHEEL + 1 - r, w = 0;
+    else
+      q += wheel_residues[w] - r;
+
+    next_multiple[i] = p * q;
+    next_wheel[i]    = w;
+  }
+
+  for(uint64_t base = low - low % WHEEL; base <= high; base += (uint64_t)WHEEL * SEGMENT_SIZE)
+  {
+    uint64_t seg_high = MIN(high, base + (uint64_t)WHEEL * SEGMENT_SIZE - 1);
+    size_t   seg_size = (seg_high - base) / WHEEL + 1;
+
+    presieve_segment(segment, seg_size, base);
+    for(size_t i = 0; i < base_count; i++)
     {
-      prev_work = next_work;
-      next_work = next_work->next;
-      
+      uint64_t p = base_primes[i];
+      uint64_t multiple = next_multiple[i];
+      uint8_t  w = next_wheel[i];
+      for(; multiple <= seg_high; w = (w + 1) & 7)
+      {
+        uint64_t offset = multiple - base;
+        segment[offset / WHEEL] &= ~(1 << wheel_bit[offset % WHEEL]);
+        multiple += p * wheel_gaps[w];
+      }
+      next_multiple[i] = multiple;
+      next_wheel[i]    = w;
     }
-    
-    if(next_work) // work_res should be inserted between prev and next
+
+    // Remove the numbers outside [low, high] from the first and last byte.
+    for(int bit = 0; bit < 8; bit++)
     {
-      dlog("Inserting  [%" PRIu64 ", %" PRIu64 "] between [%" PRIu64 ", %" PRIu64 "] and [%" PRIu64 ", %" PRIu64 "]",
-           work_res->start, work_res->stop, prev_work->start, prev_work->stop, next_work->start, next_work->stop);
-      work_res->next  = prev_work->next;
-      prev_work->next = work_res;
-    } else { // work_res should be inserted at the end of the list.
-      dlog("Inserting  [%" PRIu64 ", %" PRIu64 "] after [%" PRIu64 ", %" PRIu64 "]", work_res->start, work_res->stop, prev_work->start, prev_work->stop);
-      prev_work->next = work_res;
+      if(base + wheel_residues[bit] < low)
+        segment[0] &= ~(1 << bit);
+      if(base + (seg_size - 1) * WHEEL + wheel_residues[bit] > seg_high)
+        segment[seg_size - 1] &= ~(1 << bit);
     }
+
+    if(base > work->collect_limit)
+    {
+      uint64_t* words = (uint64_t*)segment;
+      memset(segment + seg_size, 0, sizeof(uint64_t));
+      for(size_t i = 0; i < (seg_size + sizeof(uint64_t) - 1) / sizeof(uint64_t); i++)
+        work->total += __builtin_popcountll(words[i]);
+
+      size_t last = seg_size;
+      while(last > 0 && segment[last - 1] == 0) last--;
+      if(last > 0)
+        work->largest = base + (last - 1) * WHEEL + wheel_residues[31 - __builtin_clz(segment[last - 1])];
+    } else {
+      for(size_t i = 0; i < seg_size; i++)
+      {
+        uint8_t bits = segment[i];
+        while(bits)
+        {
+          found_prime(work, base + i * WHEEL + wheel_residues[__builtin_ctz(bits)]);
+          bits &= bits - 1;
+        }
+      }
+    }
+
+    if(seg_high == high) break; // Avoid overflowing base near UINT64_MAX
   }
 }
 
-void  primesieve_report_results(work_queue_t queue, size_t worker_id, void* results)
+void* primesieve_do_work(void* work_desc)
 {
-  work_t* work_res = (work_t*)results;
-  primesieve_t sieve = queue_get_private_data(queue);
+  work_t* work = (work_t*)work_desc;
 
-  dlog("Recieved [%" PRIu64 ", %" PRIu64 "] from worker %zu, found %zu new primes.",
-       work_res->start, work_res->stop, worker_id, work_res->count);
+  sieve_range(work);
+
+  return work;
+}
 
-  if(sieve->max_checked + 1 >= work_res->start)
+int primesieve_set_output(primesieve_t sieve, const char* path)
+{
+  if(sieve->storage == PRIMESIEVE_STORE_NONE)
   {
-    // No gap between the last accepted work and these results
-    // Insert this result
-    append_work(sieve, work_res);
+    vlog("Sieve %p only counts primes, it has no output to write.", sieve);
+    return 1;
+  }
+
+  sieve->output = create_primefile(path, PRIMEFILE_INTERVAL);
+  if(! sieve->output) return 1;
 
-    // Insert any results that were queued but are now ready to be added
-    while(sieve->results_list &&
-          sieve->results_list->start <= sieve->max_checked + 1)
+  // Everything found so far (the initial primes) goes in first.
+  if(sieve->store)
+  {
+    primestore_iter_t iter;
+    primestore_iter_init(sieve->store, &iter, 0);
+    uint64_t prime;
+    while((prime = primestore_iter_next(&iter)))
+      primefile_append(sieve->output, &prime, 1);
+  } else {
+    size_t count = primetable_count(sieve->primes);
+    for(size_t index = 0, run; index < count; index += run)
     {
-      sieve->results_list = append_work(sieve, sieve->results_list);
+      const uint64_t* chunk = primetable_chunk(sieve->primes, index, &run);
+      primefile_append(sieve->output, chunk, run);
     }
+  }
+
+  return 0;
+}
+
+int primesieve_set_checkpoint(primesieve_t sieve, const char* path, double interval)
+{
+  if(sieve->checkpoint)
+  {
+    vlog("Sieve %p already saves checkpoints.", sieve);
+    return 1;
+  }
+
+  sieve->checkpoint = create_checkpoint(path, interval);
+  if(! sieve->checkpoint) return 1;
+
+  // Everything found so far (the initial primes) goes in the first record.
+  if(sieve->store)
+  {
+    primestore_iter_t iter;
+    primestore_iter_init(sieve->store, &iter, 0);
+    uint64_t prime;
+    while((prime = primestore_iter_next(&iter)))
+      checkpoint_append(sieve->checkpoint, &prime, 1);
   } else {
-    // Gap between the last accepted work and these results,
-    // so just insert them into the queue for later copying.
+    size_t count = primetable_count(sieve->primes);
+    for(size_t index = 0, run; index < count; index += run)
+    {
+      const uint64_t* chunk = primetable_chunk(sieve->primes, index, &run);
+      checkpoint_append(sieve->checkpoint, chunk, run);
+    }
+  }
+
+  return 0;
+}
 
-    insert_in_list(sieve, work_res);
+int primesieve_set_bitmap(primesieve_t sieve, uint64_t limit)
+{
+  if(sieve->bitmap)
+  {
+    vlog("Sieve %p already keeps a bitmap.", sieve);
+    return 1;
   }
 
-#if VERBOSE
-  dlog("Next value needed is %" PRIu64 ", results left in queue:", sieve->max_checked+1);
+  // The initial primes are always known. Without storage, the primes after them are gone
+  // from base_limit to max_checked.
+  uint64_t initial = firstprimes[firstprimes_count - 1];
+  checkpoint_state_t state;
+  get_checkpoint_state(sieve, &state);
+  if(MAX(state.stored_limit, initial) < MIN(limit, sieve->max_checked))
+  {
+    vlog("Sieve %p only kept the primes up to %" PRIu64 ", cannot make a bitmap up to %" PRIu64 ".",
+         sieve, state.stored_limit, limit);
+    return 1;
+  }
 
-  work_res = sieve->results_list;
-  while(work_res)
+  primesieve_bitmap_t* bitmap = calloc(1, sizeof(primesieve_bitmap_t));
+  bitmap->limit = limit;
+  // One word and one rank to spare, for lookups at limit itself.
+  bitmap->words = calloc(limit / 128 + 2, sizeof(uint64_t));
+  bitmap->ranks = calloc(limit / 2 / BITMAP_BLOCK_BITS + 2, sizeof(uint64_t));
+
+  // The initial primes go in first, then whatever else a checkpoint brought in.
+  bitmap_append(bitmap, firstprimes, firstprimes_count);
+  if(sieve->store)
   {
-    dlog(" - [%" PRIu64 ", %" PRIu64 "]", work_res->start, work_res->stop);
-    work_res = work_res->next;
+    primestore_iter_t iter;
+    primestore_iter_init(sieve->store, &iter, 0);
+    uint64_t prime;
+    while((prime = primestore_iter_next(&iter)) && prime <= limit)
+      if(prime > initial)
+        bitmap_append(bitmap, &prime, 1);
+  } else {
+    size_t count = primetable_count(sieve->primes);
+    size_t first = primetable_count_upto(sieve->primes, initial, count);
+    for(size_t index = first, run; index < count; index += run)
+    {
+      const uint64_t* chunk = primetable_chunk(sieve->primes, index, &run);
+      bitmap_append(bitmap, chunk, run);
+    }
   }
-#endif
+  bitmap_checked(bitmap, sieve->max_checked);
+
+  sieve->bitmap = bitmap;
+  return 0;
 }
 
-void* primesieve_do_work(void* work_desc)
+const primesieve_bitmap_t* primesieve_bitmap(primesieve_t sieve)
 {
-  work_t* work = (work_t*)work_desc;
+  return sieve->bitmap;
+}
 
-  if(work->start <= work->stop)
+size_t primesieve_bitmap_rank(const primesieve_bitmap_t* bitmap, uint64_t x)
+{
+  x = MIN(x, bitmap->checked);
+  if(x < 2) return 0;
+
+  // 2, and the odd primes among the first bits odd numbers.
+  uint64_t bits = (x + 1) / 2;
+  size_t word = bits / 64, block = bits / BITMAP_BLOCK_BITS;
+  size_t rank = 1 + bitmap->ranks[block];
+
+  for(size_t w = block * BITMAP_BLOCK_WORDS; w < word; w++)
+    rank += __builtin_popcountll(bitmap->words[w]);
+  if(bits % 64)
+    rank += __builtin_popcountll(bitmap->words[word] & ((1ULL << (bits % 64)) - 1));
+  return rank;
+}
+
+uint64_t primesieve_bitmap_select(const primesieve_bitmap_t* bitmap, size_t n)
+{
+  if(n == 0 || bitmap->checked < 2) return 0;
+  if(n == 1) return 2;
+  if(n - 1 > bitmap->odd_primes) return 0;
+
+  // Binary search for the last block with fewer than n - 1 odd primes below it.
+  uint64_t odd = n - 1;
+  size_t low = 0, high = bitmap->ranked;
+  while(high - low > 1)
   {
-    uint64_t curr_num = work->start;
-    while(curr_num <= work->stop)
+    size_t mid = low + (high - low) / 2;
+    if(bitmap->ranks[mid] < odd)
+      low = mid;
+    else
+      high = mid;
+  }
+
+  odd -= bitmap->ranks[low];
+  for(size_t w = low * BITMAP_BLOCK_WORDS; ; w++)
+  {
+    uint64_t bits = bitmap->words[w];
+    size_t count = __builtin_popcountll(bits);
+    if(count < odd)
     {
-      uint64_t* divisor = work->sieve;
-      
-      while(curr_num % *divisor != 0
-            && (*divisor) * (*divisor) < curr_num)
-        divisor++;
-      
-      if(curr_num % *divisor != 0)
-      {
-        // curr_num is prime.
-        work->primes[work->count] = curr_num;
-        work->count++;
-      }
-      
-      curr_num++;
+      odd -= count;
+      continue;
     }
-  } else {
-    // No work, sleep for a while.
-    struct timespec sleep;
-    sleep.tv_sec  = 3;
-    sleep.tv_nsec = 0;
-    clock_nanosleep(CLOCK_MONOTONIC, 0, &sleep, NULL);
+
+    // Drop the odd - 1 lowest primes of the word, the next one is it.
+    while(--odd)
+      bits &= bits - 1;
+    return 128 * w + 2 * __builtin_ctzll(bits) + 1;
   }
+}
 
-  return work;
+size_t primesieve_count(primesieve_t sieve)
+{
+  return sieve->total;
+}
+
+uint64_t primesieve_nth_prime(primesieve_t sieve, size_t n)
+{
+  if(n == 0 || n > sieve->total) return 0;
+  if(n == sieve->total) return sieve->largest;
+
+  if(sieve->store) return primestore_get(sieve->store, n - 1);
+  if(n > primetable_count(sieve->primes)) return 0; // Only counted, not stored
+  return primetable_get(sieve->primes, n - 1);
+}
+
+size_t primesieve_pi(primesieve_t sieve, uint64_t x)
+{
+  if(x >= sieve->max_checked) return sieve->total;
+  if(sieve->store) return primestore_count_upto(sieve->store, x);
+  size_t count = primetable_count(sieve->primes);
+  if(count == sieve->total || (count && x <= primetable_get(sieve->primes, count - 1)))
+    return primetable_count_upto(sieve->primes, x, count);
+
+  return SIZE_MAX; // Only counted, not stored
 }
 
 void primesieve_print(primesieve_t sieve)
 {
+  size_t count = primesieve_count(sieve);
+
   vlog("Sieve %p has checked all primes up to %" PRIu64, sieve, sieve->max_checked);
-  vlog(" => %zu primes found", sieve->count);
-  vlog(" => Largest prime: %" PRIu64, sieve->primes[sieve->count-1]);
+  vlog(" => %zu primes found", count);
+  vlog(" => Largest prime: %" PRIu64, sieve->largest);
+  if(sieve->store)
+    vlog(" => Compact storage uses %zu bytes", primestore_bytes(sieve->store));
+  if(sieve->bitmap)
+    vlog(" => Bitmap of the primes up to %" PRIu64 " uses %zu bytes", sieve->bitmap->limit,
+         (size_t)(sieve->bitmap->limit / 128 + 2) * sizeof(uint64_t)
+         + (size_t)(sieve->bitmap->limit / 2 / BITMAP_BLOCK_BITS + 2) * sizeof(uint64_t));
 }
@@ -5,13 +5,150 @@
 
 typedef struct primesieve* primesieve_t;
 
+/**
+ * Which numbers up to a limit are prime, one bit per odd number (@see primesieve_set_bitmap).
+ *
+ * Word x / 128 holds the odd numbers from 128 (x / 128) to 128 (x / 128) + 127, bit x / 2 % 64
+ * is set if x is prime. Every 1024 numbers, the number of odd primes below them is kept as
+ * well, so counting the primes up to x takes at most eight popcounts.
+ **/
+typedef struct {
+  uint64_t* words;
+  uint64_t* ranks;      ///< Odd primes below 1024 b, for the blocks b that are final.
+  size_t    ranked;     ///< Entries of ranks that are final.
+  uint64_t  limit;      ///< Largest number there is room for.
+  uint64_t  checked;    ///< Largest number whose bit is final, at most limit.
+  uint64_t  odd_primes; ///< Set bits so far.
+} primesieve_bitmap_t;
+
+/**
+ * How a sieve keeps the primes it has found.
+ **/
+typedef enum {
+  PRIMESIEVE_STORE_ARRAY,   ///< Every prime as a uint64_t, fastest lookups.
+  PRIMESIEVE_STORE_COMPACT, ///< Gap encoded, about one byte per prime (@see primestore.h).
+  PRIMESIEVE_STORE_NONE,    ///< Count only: keep just the primes up to sqrt(max_number) needed for sieving.
+} primesieve_storage_t;
+
 primesieve_t create_primesieve(uint64_t max_number);
+primesieve_t create_primesieve_with_storage(uint64_t max_number, primesieve_storage_t storage);
+
+/**
+ * Create a sieve that continues from a checkpoint (@see primesieve_set_checkpoint).
+ *
+ * Work is dispensed from the largest number checked in the checkpoint onwards, and new
+ * records are appended to the same file.
+ *
+ * @param path       Path of the checkpoint file.
+ * @param max_number Bound to stop at.
+ * @param storage    How the sieve keeps its primes. A checkpoint written in
+ *                   PRIMESIEVE_STORE_NONE mode can only be resumed in that mode.
+ * @param interval   Minimum number of seconds between new records.
+ * @return The sieve, or NULL if the checkpoint could not be read or lacks primes the sieve needs.
+ **/
+primesieve_t create_primesieve_from_checkpoint(const char* path, uint64_t max_number,
+                                               primesieve_storage_t storage, double interval);
 void destroy_primesieve(primesieve_t);
 
 void* primesieve_request_work(work_queue_t queue, size_t worker_id);
 void  primesieve_report_results(work_queue_t queue, size_t worker_id, void* results);
 void* primesieve_do_work(void* work_desc);
 
+/**
+ * Stream all primes found by a sieve, in order, to a prime file (@see primefile.h).
+ *
+ * Must be called before the sieve is handed to a work queue. The file is finished
+ * as soon as all primes up to max_number have been found, or when the sieve is destroyed.
+ *
+ * @param sieve The sieve to write the primes of.
+ * @param path  Path of the file to create.
+ * @return 0 on success, non-zero if the file could not be created.
+ **/
+int primesieve_set_output(primesieve_t sieve, const char* path);
+
+/**
+ * Save the numbers a sieve has verified to a checkpoint file now and then (@see checkpoint.h).
+ *
+ * Must be called before the sieve is handed to a work queue. Records are written in the
+ * background, at most every interval seconds, and a final one once all primes up to
+ * max_number have been found or the sieve is destroyed.
+ *
+ * @param sieve    The sieve to save.
+ * @param path     Path of the file to create.
+ * @param interval Minimum number of seconds between records.
+ * @return 0 on success, non-zero if the file could not be created.
+ **/
+int primesieve_set_checkpoint(primesieve_t sieve, const char* path, double interval);
+
+/**
+ * Keep a bitmap of the primes up to limit (@see primesieve_bitmap_t), filled in from the
+ * primes the sieve finds, in order. Costs limit / 16 bytes.
+ *
+ * Must be called before the sieve is handed to a work queue. Without storage
+ * (PRIMESIEVE_STORE_NONE), the primes up to limit are collected as well, so they can be
+ * set; a sieve resumed from a checkpoint must not have counted any of them already.
+ *
+ * @param sieve The sieve to keep the bitmap of.
+ * @param limit Largest number the bitmap covers. Numbers above what the sieve checks stay 0.
+ * @return 0 on success, non-zero if the sieve already has a bitmap, or lacks primes for it.
+ **/
+int primesieve_set_bitmap(primesieve_t sieve, uint64_t limit);
+
+/**
+ * Get the bitmap of a sieve. It grows as the sieve appends primes, and can be read from
+ * any thread once the work queue has finished.
+ *
+ * @return The bitmap, or NULL if there is none (@see primesieve_set_bitmap).
+ **/
+const primesieve_bitmap_t* primesieve_bitmap(primesieve_t sieve);
+
+/**
+ * Test a number against a bitmap, with a single bit lookup.
+ *
+ * @param bitmap The bitmap to look in.
+ * @param x      The number to test [<= bitmap->checked].
+ * @return Non-zero if x is prime, 0 if it is not.
+ **/
+static inline int primesieve_is_prime(const primesieve_bitmap_t* bitmap, uint64_t x)
+{
+  if(x % 2 == 0) return x == 2;
+  return (bitmap->words[x / 128] >> (x / 2 % 64)) & 1;
+}
+
+/**
+ * Count the primes smaller than or equal to x in a bitmap.
+ *
+ * @return pi(x), for x up to bitmap->checked. Larger values of x count all primes in the bitmap.
+ **/
+size_t primesieve_bitmap_rank(const primesieve_bitmap_t* bitmap, uint64_t x);
+
+/**
+ * Find the n-th prime in a bitmap.
+ *
+ * @return The n-th prime (primesieve_bitmap_select(bitmap, 1) == 2), or 0 if the bitmap
+ *         holds fewer than n primes.
+ **/
+uint64_t primesieve_bitmap_select(const primesieve_bitmap_t* bitmap, size_t n);
+
+/**
+ * @return The number of primes found so far.
+ **/
+size_t   primesieve_count(primesieve_t sieve);
+
+/**
+ * @return The n-th prime (primesieve_nth_prime(sieve, 1) == 2), or 0 if it has not been found
+ *         or was only counted (PRIMESIEVE_STORE_NONE).
+ **/
+uint64_t primesieve_nth_prime(primesieve_t sieve, size_t n);
+
+/**
+ * Count the primes smaller than or equal to x.
+ *
+ * @return pi(x), or SIZE_MAX if the sieve only counted the primes around x (PRIMESIEVE_STORE_NONE).
+ *         Values of x beyond the largest number checked so far count all primes found.
+ **/
+size_t   primesieve_pi(primesieve_t sieve, uint64_t x);
+
 void primesieve_print(primesieve_t sieve);
 
 
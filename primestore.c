@@ -0,0 +1,166 @@
+#include "stdlib.h"
+#include "string.h"
+
+#include "primestore.h"
+#include "log.h"
+
+#define INIT_BYTES 4096
+
+typedef struct {
+  uint64_t value;  ///< Prime at index n * PRIMESTORE_INTERVAL.
+  size_t   offset; ///< Offset of the gap following that prime.
+} checkpoint_t;
+
+struct primestore
+{
+  uint8_t*      gaps;
+  size_t        size;
+  size_t        capacity;
+
+  checkpoint_t* checkpoints;
+  size_t        checkpoint_capacity;
+
+  size_t        count;
+  uint64_t      last;
+};
+
+primestore_t create_primestore(void)
+{
+  primestore_t store = calloc(1, sizeof(struct primestore));
+
+  store->capacity = INIT_BYTES;
+  store->gaps = malloc(store->capacity);
+  store->checkpoint_capacity = INIT_BYTES / PRIMESTORE_INTERVAL;
+  store->checkpoints = malloc(store->checkpoint_capacity * sizeof(checkpoint_t));
+
+  return store;
+}
+
+void destroy_primestore(primestore_t store)
+{
+  free(store->checkpoints);
+  free(store->gaps);
+  free(store);
+}
+
+void primestore_append(primestore_t store, const uint64_t* primes, size_t count)
+{
+  // A gap never takes more than 10 bytes.
+  while(store->capacity < store->size + 10 * count)
+  {
+    store->capacity *= 2;
+    store->gaps = realloc(store->gaps, store->capacity);
+  }
+
+  for(size_t i = 0; i < count; i++)
+  {
+    store->size += primestore_encode_gap(store->gaps + store->size, primes[i] - store->last);
+    store->last = primes[i];
+
+    if(store->count % PRIMESTORE_INTERVAL == 0)
+    {
+      size_t n = store->count / PRIMESTORE_INTERVAL;
+      if(n == store->checkpoint_capacity)
+      {
+        store->checkpoint_capacity *= 2;
+        store->checkpoints = realloc(store->checkpoints,
+                                     store->checkpoint_capacity * sizeof(checkpoint_t));
+      }
+      store->checkpoints[n].value  = primes[i];
+      store->checkpoints[n].offset = store->size;
+    }
+    store->count++;
+  }
+}
+
+size_t primestore_count(primestore_t store)
+{
+  return store->count;
+}
+
+size_t primestore_bytes(primestore_t store)
+{
+  return store->size
+    + (store->count + PRIMESTORE_INTERVAL - 1) / PRIMESTORE_INTERVAL * sizeof(checkpoint_t);
+}
+
+uint64_t primestore_last(primestore_t store)
+{
+  return store->last;
+}
+
+void primestore_iter_init(primestore_t store, primestore_iter_t* iter, size_t index)
+{
+  iter->store = store;
+  iter->count = store->count;
+  iter->index = index;
+  iter->pos   = NULL;
+  iter->value = 0;
+
+  if(index >= store->count) return;
+
+  // Position the iterator at the checkpoint before index, then skip ahead.
+  size_t n = index / PRIMESTORE_INTERVAL;
+  iter->value = store->checkpoints[n].value;
+  iter->pos   = store->gaps + store->checkpoints[n].offset;
+  iter->index = n * PRIMESTORE_INTERVAL;
+  if(iter->index == index)
+  { // Next call should return the checkpoint itself.
+    iter->value = 0;
+    return;
+  }
+
+  iter->index++;
+  while(iter->index < index)
+  {
+    iter->value += primestore_decode_gap(&iter->pos);
+    iter->index++;
+  }
+}
+
+uint64_t primestore_iter_next(primestore_iter_t* iter)
+{
+  if(iter->index >= iter->count) return 0;
+
+  if(iter->value == 0)
+  { // Positioned on a checkpoint
+    iter->value = iter->store->checkpoints[iter->index / PRIMESTORE_INTERVAL].value;
+  } else {
+    iter->value += primestore_decode_gap(&iter->pos);
+  }
+  iter->index++;
+
+  return iter->value;
+}
+
+uint64_t primestore_get(primestore_t store, size_t index)
+{
+  primestore_iter_t iter;
+  primestore_iter_init(store, &iter, index);
+  return primestore_iter_next(&iter);
+}
+
+size_t primestore_count_upto(primestore_t store, uint64_t bound)
+{
+  if(store->count == 0 || store->checkpoints[0].value > bound) return 0;
+
+  // Binary search for the last checkpoint <= bound.
+  size_t low = 0, high = (store->count - 1) / PRIMESTORE_INTERVAL;
+  while(low < high)
+  {
+    size_t mid = (low + high + 1) / 2;
+    if(store->checkpoints[mid].value <= bound)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+
+  primestore_iter_t iter;
+  primestore_iter_init(store, &iter, low * PRIMESTORE_INTERVAL);
+  size_t result = low * PRIMESTORE_INTERVAL;
+  uint64_t prime;
+  while((prime = primestore_iter_next(&iter)) && prime <= bound)
+    result++;
+
+  return result;
+}
@@ -0,0 +1,144 @@
+#ifndef _MANDELPRIME_PRIMESTORE_H_
+#define _MANDELPRIME_PRIMESTORE_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+/**
+ * This header offers a compact, append-only store for an ascending list of primes.
+ *
+ * Primes are stored as the gaps between them, varint encoded (7 bits per byte, the
+ * high bit marks a continuation). Below 1e11 nearly every gap fits in a single byte.
+ * Every PRIMESTORE_INTERVAL primes, the absolute value and byte offset of a prime are
+ * kept as a checkpoint, so lookups only decode at most PRIMESTORE_INTERVAL - 1 gaps.
+ **/
+
+#define PRIMESTORE_INTERVAL 64
+
+/**
+ * Encode a gap as a varint.
+ *
+ * @param dest Destination buffer, with room for at least 10 bytes.
+ * @param gap  The gap to encode.
+ * @return The number of bytes written.
+ **/
+static inline size_t primestore_encode_gap(uint8_t* dest, uint64_t gap)
+{
+  size_t size = 0;
+
+  while(gap >= 0x80)
+  {
+    dest[size++] = (gap & 0x7f) | 0x80;
+    gap >>= 7;
+  }
+  dest[size++] = gap;
+
+  return size;
+}
+
+/**
+ * Decode a varint gap and advance the read position past it.
+ **/
+static inline uint64_t primestore_decode_gap(const uint8_t** pos)
+{
+  const uint8_t* p = *pos;
+  uint64_t gap = 0;
+  int shift = 0;
+
+  while(*p & 0x80)
+  {
+    gap |= (uint64_t)(*p & 0x7f) << shift;
+    shift += 7;
+    p++;
+  }
+  gap |= (uint64_t)*p << shift;
+  *pos = p + 1;
+
+  return gap;
+}
+
+/**
+ * Pointer type referring to a prime store.
+ **/
+typedef struct primestore* primestore_t;
+
+/**
+ * Iterator over the primes in a store, @see primestore_iter_init.
+ **/
+typedef struct {
+  const uint8_t* pos;   ///< Next gap to decode.
+  uint64_t       value; ///< Last prime returned.
+  size_t         index; ///< Index of the next prime to return.
+  size_t         count; ///< Number of primes in the store when the iterator was created.
+  primestore_t   store;
+} primestore_iter_t;
+
+/**
+ * Creates a new, empty prime store.
+ **/
+primestore_t create_primestore(void);
+
+/**
+ * Releases all memory used by a prime store.
+ **/
+void destroy_primestore(primestore_t store);
+
+/**
+ * Append primes to the store.
+ *
+ * @param store  The store to append to.
+ * @param primes Ascending list of primes, all larger than the last prime in the store.
+ * @param count  Number of primes in the list.
+ **/
+void primestore_append(primestore_t store, const uint64_t* primes, size_t count);
+
+/**
+ * @return The number of primes in the store.
+ **/
+size_t primestore_count(primestore_t store);
+
+/**
+ * @return The number of bytes used by the store, including checkpoints.
+ **/
+size_t primestore_bytes(primestore_t store);
+
+/**
+ * @return The largest prime in the store, or 0 if the store is empty.
+ **/
+uint64_t primestore_last(primestore_t store);
+
+/**
+ * Look up a prime by its index.
+ *
+ * @param store The store to search.
+ * @param index Index of the prime to look up [< primestore_count(store)].
+ * @return The prime at index, or 0 if the index is out of range.
+ **/
+uint64_t primestore_get(primestore_t store, size_t index);
+
+/**
+ * Count the primes in the store that are smaller than or equal to a bound.
+ *
+ * @param store The store to search.
+ * @param bound Upper bound (inclusive).
+ * @return The number of primes <= bound.
+ **/
+size_t primestore_count_upto(primestore_t store, uint64_t bound);
+
+/**
+ * Start iterating over the store at a given index.
+ *
+ * The iterator is invalidated by any call to primestore_append.
+ *
+ * @param store The store to iterate over.
+ * @param iter  The iterator to initialize.
+ * @param index Index of the first prime to return.
+ **/
+void primestore_iter_init(primestore_t store, primestore_iter_t* iter, size_t index);
+
+/**
+ * @return The next prime of an iterator, or 0 if the iterator is past the end.
+ **/
+uint64_t primestore_iter_next(primestore_iter_t* iter);
+
+#endif // _MANDELPRIME_PRIMESTORE_H_
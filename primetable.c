@@ -0,0 +1,92 @@
+#include "stdlib.h"
+#include "string.h"
+
+#include "primetable.h"
+#include "log.h"
+
+// These macro's have double evaluation, so be weary.
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+struct primetable
+{
+  size_t    count;   ///< Published with release semantics, after the primes are written.
+  size_t    chunk_count;
+  uint64_t* chunks[PRIMETABLE_MAX_CHUNKS];
+};
+
+primetable_t create_primetable(void)
+{
+  return calloc(1, sizeof(struct primetable));
+}
+
+void destroy_primetable(primetable_t table)
+{
+  for(size_t i = 0; i < table->chunk_count; i++)
+    free(table->chunks[i]);
+  free(table);
+}
+
+int primetable_append(primetable_t table, const uint64_t* primes, size_t count)
+{
+  size_t size = table->count; // Only the writer changes count.
+
+  if(count > (size_t)PRIMETABLE_MAX_CHUNKS * PRIMETABLE_CHUNK_SIZE - size)
+  {
+    vlog("Prime table %p is full, cannot append %zu primes.", table, count);
+    return 1;
+  }
+
+  while(count)
+  {
+    size_t chunk = size / PRIMETABLE_CHUNK_SIZE, offset = size % PRIMETABLE_CHUNK_SIZE;
+    if(chunk == table->chunk_count)
+    {
+      table->chunks[chunk] = malloc(PRIMETABLE_CHUNK_SIZE * sizeof(uint64_t));
+      table->chunk_count++;
+    }
+
+    size_t n = MIN(count, PRIMETABLE_CHUNK_SIZE - offset);
+    memcpy(table->chunks[chunk] + offset, primes, n * sizeof(uint64_t));
+    primes += n;
+    count  -= n;
+    size   += n;
+  }
+
+  // Readers that see the new count also see the primes and chunk pointers written above.
+  __atomic_store_n(&table->count, size, __ATOMIC_RELEASE);
+  return 0;
+}
+
+size_t primetable_count(primetable_t table)
+{
+  return __atomic_load_n(&table->count, __ATOMIC_ACQUIRE);
+}
+
+uint64_t primetable_get(primetable_t table, size_t index)
+{
+  return table->chunks[index / PRIMETABLE_CHUNK_SIZE][index % PRIMETABLE_CHUNK_SIZE];
+}
+
+const uint64_t* primetable_chunk(primetable_t table, size_t index, size_t* count)
+{
+  size_t offset = index % PRIMETABLE_CHUNK_SIZE;
+
+  *count = MIN(primetable_count(table) - index, PRIMETABLE_CHUNK_SIZE - offset);
+  return table->chunks[index / PRIMETABLE_CHUNK_SIZE] + offset;
+}
+
+size_t primetable_count_upto(primetable_t table, uint64_t bound, size_t limit)
+{
+  // Binary search for the first prime > bound
+  size_t low = 0, high = limit;
+  while(low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+    if(primetable_get(table, mid) <= bound)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
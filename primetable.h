@@ -0,0 +1,84 @@
+#ifndef _MANDELPRIME_PRIMETABLE_H_
+#define _MANDELPRIME_PRIMETABLE_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+/**
+ * This header offers an append-only table of primes that can be read while it grows.
+ *
+ * Primes are kept in chunks of PRIMETABLE_CHUNK_SIZE entries. Chunks are allocated as
+ * the table grows and never move, so appending never copies existing entries, and a
+ * pointer into the table stays valid until the table is destroyed.
+ *
+ * There is a single writer, but any number of threads may read the table without
+ * locking: the number of primes is published atomically after the primes themselves
+ * have been written, so every index below primetable_count() can be read safely.
+ **/
+
+#define PRIMETABLE_CHUNK_SIZE (1 << 16)
+#define PRIMETABLE_MAX_CHUNKS (1 << 16) ///< Room for 2^32 primes, all primes below 1e11.
+
+/**
+ * Pointer type referring to a prime table.
+ **/
+typedef struct primetable* primetable_t;
+
+/**
+ * Creates a new, empty prime table.
+ **/
+primetable_t create_primetable(void);
+
+/**
+ * Releases all memory used by a prime table. No reader may be using it anymore.
+ **/
+void destroy_primetable(primetable_t table);
+
+/**
+ * Append primes to the table. Only one thread may append at a time.
+ *
+ * @param table  The table to append to.
+ * @param primes Ascending list of primes, all larger than the last prime in the table.
+ * @param count  Number of primes in the list.
+ * @return 0 on success, non-zero if the table is full (nothing is appended).
+ **/
+int primetable_append(primetable_t table, const uint64_t* primes, size_t count);
+
+/**
+ * Get the number of primes in the table. Safe to call while another thread appends.
+ *
+ * @return The number of primes that have been published.
+ **/
+size_t primetable_count(primetable_t table);
+
+/**
+ * Look up a prime by its index.
+ *
+ * @param table The table to search.
+ * @param index Index of the prime to look up [< primetable_count(table)].
+ * @return The prime at index.
+ **/
+uint64_t primetable_get(primetable_t table, size_t index);
+
+/**
+ * Get the contiguous run of primes that starts at an index.
+ *
+ * @param table The table to read.
+ * @param index Index of the first prime [< primetable_count(table)].
+ * @param count Set to the number of primes that follow in the same chunk, index included,
+ *              up to primetable_count(table).
+ * @return Pointer to the prime at index.
+ **/
+const uint64_t* primetable_chunk(primetable_t table, size_t index, size_t* count);
+
+/**
+ * Count the primes in the table that are smaller than or equal to a bound.
+ *
+ * @param table The table to search.
+ * @param bound Upper bound (inclusive).
+ * @param limit Only the first limit primes are searched [<= primetable_count(table)].
+ * @return The number of primes <= bound among the first limit primes.
+ **/
+size_t primetable_count_upto(primetable_t table, uint64_t bound, size_t limit);
+
+#endif // _MANDELPRIME_PRIMETABLE_H_
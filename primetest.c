@@ -0,0 +1,373 @@
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+#include "primetest.h"
+#include "log.h"
+
+// These macro's have double evaluation, so be weary.
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+#define UNIT_SIZE (256 * 1024) ///< Numbers per work unit.
+
+typedef unsigned __int128 uint128_t;
+
+static const uint64_t bases[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+#define base_count (sizeof(bases)/sizeof(bases[0]))
+
+static const uint64_t small_primes[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53 };
+#define small_prime_count (sizeof(small_primes)/sizeof(small_primes[0]))
+
+/**
+ * Montgomery arithmetic modulo an odd n, with R = 2^64.
+ **/
+typedef struct {
+  uint64_t n;
+  uint64_t n_inv;     ///< n^-1 mod 2^64.
+  uint64_t one;       ///< R mod n, i.e. 1 in Montgomery form.
+  uint64_t minus_one; ///< n - 1 in Montgomery form.
+  uint64_t r2;        ///< R^2 mod n, to convert into Montgomery form.
+} montgomery_t;
+
+static void montgomery_init(montgomery_t* m, uint64_t n)
+{
+  // Newton's iteration doubles the correct low bits each step, starting from 3.
+  uint64_t inv = n;
+  for(int i = 0; i < 5; i++)
+    inv *= 2 - n * inv;
+
+  m->n         = n;
+  m->n_inv     = inv;
+  m->one       = (0 - n) % n;
+  m->minus_one = n - m->one;
+  m->r2        = (uint128_t)m->one * m->one % n;
+}
+
+// Returns a * b / R mod n. Since q * n matches a * b in the low 64 bits,
+// the high halves can be subtracted directly, which cannot overflow even for n >= 2^63.
+static inline uint64_t montgomery_mul(const montgomery_t* m, uint64_t a, uint64_t b)
+{
+  uint128_t t  = (uint128_t)a * b;
+  uint64_t  q  = (uint64_t)t * m->n_inv;
+  uint64_t  hi = t >> 64;
+  uint64_t  qn = ((uint128_t)q * m->n) >> 64;
+
+  return hi >= qn ? hi - qn : hi - qn + m->n;
+}
+
+// Miller-Rabin for PRIMETEST_LANES odd numbers > 53 at once: for every base, the
+// modular exponentiations of all lanes run in lockstep.
+static void test_lanes(const uint64_t* numbers, uint8_t* is_prime)
+{
+  montgomery_t m[PRIMETEST_LANES];
+  uint64_t d[PRIMETEST_LANES];
+  int      s[PRIMETEST_LANES];
+  int      top_bit = 0;
+
+  for(int l = 0; l < PRIMETEST_LANES; l++)
+  {
+    montgomery_init(&m[l], numbers[l]);
+    s[l] = __builtin_ctzll(numbers[l] - 1);
+    d[l] = (numbers[l] - 1) >> s[l];
+    top_bit = MAX(top_bit, 63 - __builtin_clzll(d[l]));
+    is_prime[l] = 1;
+  }
+
+  for(size_t b = 0; b < base_count; b++)
+  {
+    uint64_t a[PRIMETEST_LANES], x[PRIMETEST_LANES];
+
+    for(int l = 0; l < PRIMETEST_LANES; l++)
+    {
+      a[l] = montgomery_mul(&m[l], bases[b] % numbers[l], m[l].r2);
+      x[l] = m[l].one;
+    }
+
+    // Left-to-right exponentiation. Lanes with shorter exponents square 1 until their top bit.
+    for(int bit = top_bit; bit >= 0; bit--)
+    {
+      for(int l = 0; l < PRIMETEST_LANES; l++)
+      {
+        uint64_t sq = montgomery_mul(&m[l], x[l], x[l]);
+        uint64_t mu = montgomery_mul(&m[l], sq, a[l]);
+        x[l] = (d[l] >> bit) & 1 ? mu : sq;
+      }
+    }
+
+    for(int l = 0; l < PRIMETEST_LANES; l++)
+    {
+      if(! is_prime[l] || a[l] == 0) continue; // Base is a multiple of n
+      if(x[l] == m[l].one || x[l] == m[l].minus_one) continue;
+
+      int witness = 1;
+      for(int i = 1; i < s[l] && witness; i++)
+      {
+        x[l] = montgomery_mul(&m[l], x[l], x[l]);
+        if(x[l] == m[l].minus_one) witness = 0;
+      }
+      if(witness) is_prime[l] = 0;
+    }
+  }
+}
+
+// Trial division by the small primes. Returns 1 or 0 if that settles it, -1 if not.
+static int small_test(uint64_t n)
+{
+  if(n < 2) return 0;
+  for(size_t i = 0; i < small_prime_count; i++)
+  {
+    if(n == small_primes[i]) return 1;
+    if(n % small_primes[i] == 0) return 0;
+  }
+  if(n < small_primes[small_prime_count - 1] * small_primes[small_prime_count - 1]) return 1;
+  return -1;
+}
+
+void primetest_batch(const uint64_t* numbers, uint8_t* is_prime, size_t count)
+{
+  uint64_t lanes[PRIMETEST_LANES];
+  size_t   lane_index[PRIMETEST_LANES];
+  uint8_t  lane_result[PRIMETEST_LANES];
+  int      used = 0;
+
+  for(size_t i = 0; i < count; i++)
+  {
+    int result = small_test(numbers[i]);
+    if(result >= 0)
+    {
+      is_prime[i] = result;
+      continue;
+    }
+
+    lanes[used] = numbers[i];
+    lane_index[used] = i;
+    if(++used == PRIMETEST_LANES)
+    {
+      test_lanes(lanes, lane_result);
+      for(int l = 0; l < PRIMETEST_LANES; l++)
+        is_prime[lane_index[l]] = lane_result[l];
+      used = 0;
+    }
+  }
+
+  if(used)
+  { // Pad the last group with a known prime.
+    for(int l = used; l < PRIMETEST_LANES; l++)
+      lanes[l] = 59;
+    test_lanes(lanes, lane_result);
+    for(int l = 0; l < used; l++)
+      is_prime[lane_index[l]] = lane_result[l];
+  }
+}
+
+int primetest_is_prime(uint64_t n)
+{
+  uint8_t result;
+  primetest_batch(&n, &result, 1);
+  return result;
+}
+
+typedef struct {
+  uint64_t  start, stop;
+  size_t    index;       ///< Position of this unit in the window.
+  uint64_t* primes;
+  size_t    count;
+  primetest_t test;
+} pt_work_t;
+
+struct primetest
+{
+  uint64_t  start, stop;
+  uint64_t  next_start;    ///< First number that has not been handed out.
+  int       dispensed_all;
+
+  uint32_t* sieve_primes;  ///< Odd primes below PRIMETEST_PRESIEVE_LIMIT.
+  size_t    sieve_count;
+
+  pt_work_t** results;     ///< Finished units, by index.
+  size_t    unit_count;    ///< Number of units handed out.
+  size_t    unit_capacity;
+  size_t    count;         ///< Primes found in all finished units.
+};
+
+primetest_t create_primetest(uint64_t start, uint64_t stop)
+{
+  primetest_t test = calloc(1, sizeof(struct primetest));
+
+  test->start = start;
+  test->stop  = stop;
+  test->next_start = start;
+  test->dispensed_all = start > stop;
+
+  // Sieve the presieve primes themselves.
+  uint8_t* composite = calloc(PRIMETEST_PRESIEVE_LIMIT, 1);
+  test->sieve_primes = malloc(sizeof(uint32_t) * PRIMETEST_PRESIEVE_LIMIT / 2);
+  for(uint32_t i = 3; i < PRIMETEST_PRESIEVE_LIMIT; i += 2)
+  {
+    if(composite[i]) continue;
+    test->sieve_primes[test->sieve_count++] = i;
+    for(uint32_t j = i * i; j < PRIMETEST_PRESIEVE_LIMIT; j += 2 * i)
+      composite[j] = 1;
+  }
+  free(composite);
+
+  test->unit_capacity = 64;
+  test->results = calloc(test->unit_capacity, sizeof(pt_work_t*));
+
+  return test;
+}
+
+void destroy_primetest(primetest_t test)
+{
+  for(size_t i = 0; i < test->unit_count; i++)
+  {
+    if(! test->results[i]) continue;
+    free(test->results[i]->primes);
+    free(test->results[i]);
+  }
+  free(test->results);
+  free(test->sieve_primes);
+  free(test);
+}
+
+static pt_work_t* next_unit(primetest_t test)
+{
+  pt_work_t* work = calloc(1, sizeof(pt_work_t));
+  work->test  = test;
+  work->start = test->next_start;
+  work->stop  = test->stop - work->start < UNIT_SIZE ? test->stop : work->start + UNIT_SIZE - 1;
+  work->index = test->unit_count++;
+
+  if(work->stop == test->stop)
+    test->dispensed_all = 1;
+  else
+    test->next_start = work->stop + 1;
+
+  if(test->unit_count > test->unit_capacity)
+  {
+    test->results = realloc(test->results, 2 * test->unit_capacity * sizeof(pt_work_t*));
+    memset(test->results + test->unit_capacity, 0, test->unit_capacity * sizeof(pt_work_t*));
+    test->unit_capacity *= 2;
+  }
+
+  return work;
+}
+
+void* primetest_request_work(work_queue_t queue, size_t worker_id)
+{
+  primetest_t test = queue_get_private_data(queue);
+
+  if(test->dispensed_all) return NULL;
+
+  pt_work_t* work = next_unit(test);
+  dlog("Handing out [%" PRIu64 ", %" PRIu64 "] to worker %zu.", work->start, work->stop, worker_id);
+  return work;
+}
+
+void primetest_submit_work(primetest_t test, work_queue_t queue)
+{
+  while(! test->dispensed_all)
+    queue_submit_work(queue, next_unit(test));
+}
+
+void primetest_report_results(work_queue_t queue, size_t worker_id, void* results)
+{
+  pt_work_t* work = (pt_work_t*)results;
+  primetest_t test = queue_get_private_data(queue);
+
+  dlog("Recieved [%" PRIu64 ", %" PRIu64 "] from worker %zu, found %zu primes.",
+       work->start, work->stop, worker_id, work->count);
+
+  test->results[work->index] = work;
+  test->count += work->count;
+}
+
+void* primetest_do_work(void* work_desc)
+{
+  pt_work_t* work = (pt_work_t*)work_desc;
+  primetest_t test = work->test;
+  uint64_t low = work->start, high = work->stop;
+
+  work->primes = malloc(sizeof(uint64_t) * (UNIT_SIZE / 2 + 1));
+  if(low <= 2 && high >= 2)
+    work->primes[work->count++] = 2;
+
+  low = MAX(low, 3) | 1; // First odd number in range
+  if(low > high) return work;
+
+  // Presieve: candidate i is low + 2i.
+  size_t size = (high - low) / 2 + 1;
+  uint8_t* candidate = malloc(size);
+  memset(candidate, 1, size);
+  for(size_t i = 0; i < test->sieve_count; i++)
+  {
+    uint64_t p = test->sieve_primes[i];
+    uint64_t multiple = MAX(p * p, (low / p + (low % p != 0)) * p);
+    if(multiple % 2 == 0) multiple += p;
+    if(multiple < low) continue; // Overflowed
+    for(uint64_t j = (multiple - low) / 2; j < size; j += p)
+      candidate[j] = 0;
+  }
+
+  uint64_t* batch = malloc(sizeof(uint64_t) * size);
+  size_t batch_size = 0;
+  for(size_t i = 0; i < size; i++)
+    if(candidate[i]) batch[batch_size++] = low + 2 * i;
+
+  // Survivors below PRIMETEST_PRESIEVE_LIMIT^2 are prime already.
+  size_t settled = 0;
+  while(settled < batch_size && batch[settled] < (uint64_t)PRIMETEST_PRESIEVE_LIMIT * PRIMETEST_PRESIEVE_LIMIT)
+    candidate[settled++] = 1;
+  primetest_batch(batch + settled, candidate + settled, batch_size - settled);
+
+  for(size_t i = 0; i < batch_size; i++)
+    if(candidate[i]) work->primes[work->count++] = batch[i];
+
+  free(batch);
+  free(candidate);
+  return work;
+}
+
+size_t primetest_count(primetest_t test)
+{
+  return test->count;
+}
+
+size_t primetest_copy_primes(primetest_t test, uint64_t* dest, size_t max)
+{
+  size_t copied = 0;
+
+  for(size_t i = 0; i < test->unit_count && copied < max; i++)
+  {
+    pt_work_t* work = test->results[i];
+    if(! work) continue;
+
+    size_t count = MIN(work->count, max - copied);
+    memcpy(dest + copied, work->primes, count * sizeof(uint64_t));
+    copied += count;
+  }
+
+  return copied;
+}
+
+void primetest_print(primetest_t test)
+{
+  uint64_t first = 0, last = 0;
+
+  for(size_t i = 0; i < test->unit_count; i++)
+  {
+    pt_work_t* work = test->results[i];
+    if(! work || ! work->count) continue;
+    if(! first) first = work->primes[0];
+    last = work->primes[work->count - 1];
+  }
+
+  vlog("Prime test %p has checked all numbers in [%" PRIu64 ", %" PRIu64 "]", test, test->start, test->stop);
+  vlog(" => %zu primes found", test->count);
+  if(test->count)
+  {
+    vlog(" => Smallest prime: %" PRIu64, first);
+    vlog(" => Largest prime: %" PRIu64, last);
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef _MANDELPRIME_PRIMETEST_H_
+#define _MANDELPRIME_PRIMETEST_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+#include "workqueue.h"
+
+/**
+ * This header offers primality testing for arbitrary 64-bit numbers, for ranges
+ * that are too sparse or too large to sieve from the bottom (e.g. windows near 2^64).
+ *
+ * Numbers are tested with the deterministic Miller-Rabin bases for n < 2^64
+ * (2, 325, 9375, 28178, 450775, 9780504, 1795265022), in Montgomery arithmetic.
+ * The batched interface tests PRIMETEST_LANES numbers in lockstep, so the
+ * independent modular multiplication chains of each lane overlap in the pipeline.
+ *
+ * The primetest_* work queue callbacks test a window [start, stop]: each unit
+ * removes multiples of the primes below PRIMETEST_PRESIEVE_LIMIT and runs the
+ * survivors through primetest_batch.
+ **/
+
+#define PRIMETEST_LANES          4
+#define PRIMETEST_PRESIEVE_LIMIT 65536
+
+/**
+ * @return non-zero if n is prime, 0 if it is not.
+ **/
+int primetest_is_prime(uint64_t n);
+
+/**
+ * Test a batch of numbers.
+ *
+ * @param numbers  The numbers to test.
+ * @param is_prime Set to 1 for every prime in numbers, 0 for every other number.
+ * @param count    The number of numbers to test.
+ **/
+void primetest_batch(const uint64_t* numbers, uint8_t* is_prime, size_t count);
+
+typedef struct primetest* primetest_t;
+
+/**
+ * Create a primality test job for all numbers in [start, stop].
+ **/
+primetest_t create_primetest(uint64_t start, uint64_t stop);
+void destroy_primetest(primetest_t test);
+
+void* primetest_request_work(work_queue_t queue, size_t worker_id);
+void  primetest_report_results(work_queue_t queue, size_t worker_id, void* results);
+void* primetest_do_work(void* work_desc);
+
+/**
+ * Split the whole window into units up front and add them to a queue that uses
+ * QUEUE_SCHEDULER_STEALING (@see queue_submit_work).
+ **/
+void primetest_submit_work(primetest_t test, work_queue_t queue);
+
+/**
+ * @return The number of primes found in the window.
+ **/
+size_t primetest_count(primetest_t test);
+
+/**
+ * Copy the primes found in the window, in ascending order.
+ *
+ * @param test  The finished test job.
+ * @param dest  Destination array.
+ * @param max   Maximum number of primes to copy.
+ * @return The number of primes copied.
+ **/
+size_t primetest_copy_primes(primetest_t test, uint64_t* dest, size_t max);
+
+void primetest_print(primetest_t test);
+
+#endif // _MANDELPRIME_PRIMETEST_H_
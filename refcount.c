@@ -32,7 +32,7 @@ void* refcount_allocate(size_t bytes)
   refcount->size = bytes;
   refcount->ptr  = (void*)(refcount) + sizeof(refcount_ptr_t);
 
-  sanity_check(refcount);
+  sanity_check(refcount->ptr);
 
   dlog("Created reference counted pointer at %p.", refcount->ptr);
   
@@ -86,7 +86,7 @@ void  refcount_increment(void* ptr)
 {
   sanity_check(ptr);
   refcount_ptr_t *refcount = ptr - sizeof(refcount_ptr_t);
-  refcount->references++;
+  __atomic_add_fetch(&refcount->references, 1, __ATOMIC_RELAXED);
 }
 
 void  refcount_decrement(void* ptr)
@@ -94,7 +94,6 @@ void  refcount_decrement(void* ptr)
   sanity_check(ptr);
   refcount_ptr_t *refcount = ptr - sizeof(refcount_ptr_t);
 
-  if(refcount->references) refcount->references--;
-
-  if(refcount->references == 0) refcount_free(ptr);
+  // Only the thread that drops the last reference frees the pointer.
+  if(__atomic_sub_fetch(&refcount->references, 1, __ATOMIC_ACQ_REL) == 0) refcount_free(ptr);
 }
@@ -0,0 +1,176 @@
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+
+#include "tilecache.h"
+#include "refcount.h"
+#include "log.h"
+
+// These macro's have double evaluation, so be weary.
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+// Buckets per expected tile of this many bytes, a 64x64 tile of 32 bit counts.
+#define BUCKET_BYTES (64 * 64 * 4)
+#define MIN_BUCKETS  256
+
+typedef struct entry
+{
+  tilecache_key_t key;
+  void*           tile;
+  size_t          size;
+  struct entry*   next;    ///< Next entry in the same bucket.
+  struct entry*   newer;   ///< Towards the most recently used entry.
+  struct entry*   older;   ///< Towards the least recently used entry.
+} entry_t;
+
+struct tilecache
+{
+  size_t    budget;
+  size_t    used;        ///< Bytes taken by the tiles in the cache.
+  size_t    count;
+  entry_t** buckets;
+  size_t    bucket_mask; ///< Number of buckets - 1, a power of two.
+  entry_t*  newest;
+  entry_t*  oldest;
+
+  uint64_t  hits;
+  uint64_t  misses;
+  uint64_t  evictions;
+};
+
+static size_t hash_key(const tilecache_key_t* key)
+{
+  uint64_t step;
+  memcpy(&step, &key->step, sizeof(step));
+
+  uint64_t hash = step;
+  hash = (hash ^ (uint64_t)key->column) * 0x9e3779b97f4a7c15ULL;
+  hash = (hash ^ (uint64_t)key->row) * 0x9e3779b97f4a7c15ULL;
+  hash = (hash ^ (uint64_t)key->variant) * 0x9e3779b97f4a7c15ULL;
+  return hash ^ (hash >> 32);
+}
+
+static int same_key(const tilecache_key_t* a, const tilecache_key_t* b)
+{
+  return a->step == b->step && a->column == b->column && a->row == b->row && a->variant == b->variant;
+}
+
+// Remove an entry from the recently used list.
+static void unlink_entry(tilecache_t cache, entry_t* entry)
+{
+  if(entry->newer) entry->newer->older = entry->older;
+  else cache->newest = entry->older;
+  if(entry->older) entry->older->newer = entry->newer;
+  else cache->oldest = entry->newer;
+}
+
+// Put an entry at the front of the recently used list.
+static void link_newest(tilecache_t cache, entry_t* entry)
+{
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if(cache->newest) cache->newest->newer = entry;
+  else cache->oldest = entry;
+  cache->newest = entry;
+}
+
+// Find the link pointing to the entry for key, or to the end of its bucket.
+static entry_t** find_entry(tilecache_t cache, const tilecache_key_t* key)
+{
+  entry_t** link = &cache->buckets[hash_key(key) & cache->bucket_mask];
+  while(*link && ! same_key(&(*link)->key, key))
+    link = &(*link)->next;
+  return link;
+}
+
+static void remove_entry(tilecache_t cache, entry_t** link)
+{
+  entry_t* entry = *link;
+
+  *link = entry->next;
+  unlink_entry(cache, entry);
+  cache->used -= entry->size;
+  cache->count--;
+  refcount_decrement(entry->tile);
+  free(entry);
+}
+
+tilecache_t create_tilecache(size_t budget)
+{
+  tilecache_t cache = calloc(1, sizeof(struct tilecache));
+  size_t buckets = MIN_BUCKETS;
+
+  while(buckets < budget / BUCKET_BYTES)
+    buckets *= 2;
+  cache->budget      = budget;
+  cache->buckets     = calloc(buckets, sizeof(entry_t*));
+  cache->bucket_mask = buckets - 1;
+  return cache;
+}
+
+void destroy_tilecache(tilecache_t cache)
+{
+  for(size_t i = 0; i <= cache->bucket_mask; i++)
+    while(cache->buckets[i])
+      remove_entry(cache, &cache->buckets[i]);
+  free(cache->buckets);
+  free(cache);
+}
+
+void* tilecache_get(tilecache_t cache, const tilecache_key_t* key)
+{
+  entry_t* entry = *find_entry(cache, key);
+  if(! entry)
+  {
+    cache->misses++;
+    return NULL;
+  }
+
+  cache->hits++;
+  unlink_entry(cache, entry);
+  link_newest(cache, entry);
+  refcount_increment(entry->tile);
+  return entry->tile;
+}
+
+void tilecache_put(tilecache_t cache, const tilecache_key_t* key, void* tile)
+{
+  size_t size = refcount_size(tile) + sizeof(entry_t);
+  entry_t** link = find_entry(cache, key);
+
+  if(*link)
+    remove_entry(cache, link);
+  if(size > cache->budget) return;
+
+  // Make room, least recently used first. Removing entries can change the links of the
+  // bucket, so look the key up again afterwards.
+  while(cache->used + size > cache->budget)
+  {
+    entry_t* oldest = cache->oldest;
+    remove_entry(cache, find_entry(cache, &oldest->key));
+    cache->evictions++;
+  }
+  link = find_entry(cache, key);
+
+  entry_t* entry = malloc(sizeof(entry_t));
+  entry->key  = *key;
+  entry->tile = tile;
+  entry->size = size;
+  entry->next = NULL;
+  *link = entry;
+  link_newest(cache, entry);
+  refcount_increment(tile);
+
+  cache->used += size;
+  cache->count++;
+}
+
+void tilecache_print(tilecache_t cache)
+{
+  uint64_t lookups = MAX(1, cache->hits + cache->misses);
+
+  vlog("Tile cache %p: %zu tiles, %zu of %zu KiB", cache, cache->count, cache->used / 1024, cache->budget / 1024);
+  vlog(" => %" PRIu64 " of %" PRIu64 " lookups (%.1f%%) found their tile", cache->hits,
+       cache->hits + cache->misses, 100.0 * cache->hits / lookups);
+  vlog(" => %" PRIu64 " tiles dropped to stay within the budget", cache->evictions);
+}
@@ -0,0 +1,77 @@
+#ifndef _MANDELPRIME_TILECACHE_H_
+#define _MANDELPRIME_TILECACHE_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+/**
+ * This header offers a cache of rendered tiles, to share between frames that cover part
+ * of the same area, like the frames of a pan or a zoom.
+ *
+ * A tile is looked up by what it covers: its column and row on the grid of tiles for one
+ * pixel size, and a variant for anything else that changes its contents. The contents are
+ * opaque to the cache, it keeps them as reference counted pointers (@see refcount.h) and
+ * counts their size against a memory budget. Adding a tile that does not fit drops the
+ * tiles that were used least recently. A tile that is dropped while somebody still holds
+ * a reference to it stays valid until that reference is released.
+ *
+ * The cache does no locking: only one thread may use it at a time.
+ **/
+
+/**
+ * What a tile covers.
+ **/
+typedef struct {
+  double  step;    ///< Size of a pixel in the complex plane.
+  int64_t column;  ///< Column of the tile, counted from the tile at 0.
+  int64_t row;     ///< Row of the tile, counted from the tile at 0, downwards.
+  int     variant; ///< Anything else that changes the contents of the tile.
+} tilecache_key_t;
+
+/**
+ * Pointer type referring to a tile cache.
+ **/
+typedef struct tilecache* tilecache_t;
+
+/**
+ * Create a new, empty cache.
+ *
+ * @param budget Bytes the tiles in the cache may take, together.
+ * @return The cache.
+ **/
+tilecache_t create_tilecache(size_t budget);
+
+/**
+ * Release the cache's references to all its tiles, and free the cache.
+ **/
+void destroy_tilecache(tilecache_t cache);
+
+/**
+ * Look up a tile, and mark it as the most recently used one.
+ *
+ * @param cache The cache to search.
+ * @param key   The tile to look for.
+ * @return A new reference to the tile, which the caller releases with refcount_decrement,
+ *         or NULL if the tile is not in the cache.
+ **/
+void* tilecache_get(tilecache_t cache, const tilecache_key_t* key);
+
+/**
+ * Add a tile to the cache, replacing the tile with the same key, if any. The cache takes
+ * a reference of its own, the caller keeps its reference.
+ *
+ * Tiles that were used least recently are dropped until the new tile fits in the budget.
+ * A tile that is larger than the whole budget is not added.
+ *
+ * @param cache The cache to add to.
+ * @param key   What the tile covers.
+ * @param tile  A pointer allocated with refcount_allocate, which is not changed anymore.
+ **/
+void tilecache_put(tilecache_t cache, const tilecache_key_t* key, void* tile);
+
+/**
+ * Log the size of the cache, and how many lookups found their tile.
+ **/
+void tilecache_print(tilecache_t cache);
+
+#endif // _MANDELPRIME_TILECACHE_H_
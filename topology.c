@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "dirent.h"
+#include "pthread.h"
+#include "sched.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+
+#ifdef HAVE_LIBNUMA
+#include "numa.h"
+#endif
+
+#include "topology.h"
+#include "log.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#define MAX_NODES 1024 ///< Nodes that fit in the mask passed to mbind.
+
+static pthread_once_t  topology_once = PTHREAD_ONCE_INIT;
+static topology_cpu_t* topology;
+static size_t          topology_count;
+
+// Read a single integer from a sysfs file, or return fallback.
+static int read_sysfs_int(int cpu, const char* name, int fallback)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+  FILE* file = fopen(path, "r");
+  if(! file) return fallback;
+
+  int value;
+  if(fscanf(file, "%d", &value) != 1) value = fallback;
+  fclose(file);
+  return value;
+}
+
+// The node of a CPU shows up as a nodeN link in its sysfs directory.
+static int read_node(int cpu)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if(! dir) return 0;
+
+  int node = 0;
+  struct dirent* entry;
+  while((entry = readdir(dir)))
+  {
+    if(strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%d", &node) == 1)
+      break;
+  }
+  closedir(dir);
+  return node;
+}
+
+static int compare_compact(const void* a, const void* b)
+{
+  const topology_cpu_t* x = a;
+  const topology_cpu_t* y = b;
+  if(x->node    != y->node)    return x->node    < y->node    ? -1 : 1;
+  if(x->package != y->package) return x->package < y->package ? -1 : 1;
+  if(x->core    != y->core)    return x->core    < y->core    ? -1 : 1;
+  return x->cpu < y->cpu ? -1 : x->cpu > y->cpu;
+}
+
+static void read_topology(void)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(sched_getaffinity(0, sizeof(set), &set))
+  {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for(long cpu = 0; cpu < cpus && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, &set);
+  }
+
+  topology = malloc(CPU_COUNT(&set) * sizeof(topology_cpu_t));
+  for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if(! CPU_ISSET(cpu, &set)) continue;
+
+    topology_cpu_t* info = &topology[topology_count++];
+    info->cpu     = cpu;
+    info->node    = read_node(cpu);
+    info->package = read_sysfs_int(cpu, "physical_package_id", 0);
+    info->core    = read_sysfs_int(cpu, "core_id", cpu);
+    info->thread  = 0;
+  }
+
+  // Number the hardware threads of every core, in compact order they are adjacent.
+  qsort(topology, topology_count, sizeof(topology_cpu_t), compare_compact);
+  for(size_t i = 1; i < topology_count; i++)
+  {
+    if(topology[i].package == topology[i - 1].package && topology[i].core == topology[i - 1].core)
+      topology[i].thread = topology[i - 1].thread + 1;
+  }
+
+  dlog("Found %zu CPUs.", topology_count);
+}
+
+size_t topology_cpu_count(void)
+{
+  pthread_once(&topology_once, read_topology);
+  return topology_count;
+}
+
+typedef struct {
+  topology_cpu_t cpu;
+  size_t         core_rank; ///< Index of the core among the cores of its node.
+} scatter_key_t;
+
+static int compare_scatter(const void* a, const void* b)
+{
+  const scatter_key_t* x = a;
+  const scatter_key_t* y = b;
+  if(x->cpu.thread != y->cpu.thread) return x->cpu.thread < y->cpu.thread ? -1 : 1;
+  if(x->core_rank  != y->core_rank)  return x->core_rank  < y->core_rank  ? -1 : 1;
+  return compare_compact(&x->cpu, &y->cpu);
+}
+
+size_t topology_cpu_order(topology_order_t order, topology_cpu_t* cpus)
+{
+  pthread_once(&topology_once, read_topology);
+  memcpy(cpus, topology, topology_count * sizeof(topology_cpu_t));
+  if(order == TOPOLOGY_ORDER_COMPACT) return topology_count;
+
+  scatter_key_t* keys = malloc(topology_count * sizeof(scatter_key_t));
+  size_t core_rank = 0;
+  for(size_t i = 0; i < topology_count; i++)
+  {
+    if(i > 0 && topology[i].node != topology[i - 1].node)
+      core_rank = 0;
+    else if(i > 0 && topology[i].thread == 0)
+      core_rank++;
+    keys[i].cpu = topology[i];
+    keys[i].core_rank = core_rank;
+  }
+  qsort(keys, topology_count, sizeof(scatter_key_t), compare_scatter);
+  for(size_t i = 0; i < topology_count; i++)
+    cpus[i] = keys[i].cpu;
+  free(keys);
+
+  return topology_count;
+}
+
+int topology_node_of_cpu(int cpu)
+{
+  pthread_once(&topology_once, read_topology);
+  for(size_t i = 0; i < topology_count; i++)
+    if(topology[i].cpu == cpu) return topology[i].node;
+  return -1;
+}
+
+void* topology_alloc_on_node(size_t bytes, int node)
+{
+#ifdef HAVE_LIBNUMA
+  if(numa_available() >= 0)
+    return numa_alloc_onnode(bytes, node);
+#endif
+
+  void* ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(ptr == MAP_FAILED) return NULL;
+
+  // Nothing is touched yet, so if this fails the pages still end up on the node of the
+  // worker that uses them first.
+  if(node >= 0 && node < MAX_NODES)
+  {
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    if(syscall(SYS_mbind, ptr, bytes, MPOL_PREFERRED, mask, MAX_NODES + 1, 0))
+      dlog("Failed to bind %zu bytes to node %d.", bytes, node);
+  }
+  return ptr;
+}
+
+void topology_free_on_node(void* ptr, size_t bytes)
+{
+#ifdef HAVE_LIBNUMA
+  if(numa_available() >= 0)
+  {
+    numa_free(ptr, bytes);
+    return;
+  }
+#endif
+  munmap(ptr, bytes);
+}
@@ -0,0 +1,84 @@
+#ifndef _MANDELPRIME_TOPOLOGY_H_
+#define _MANDELPRIME_TOPOLOGY_H_
+
+#include "stddef.h"
+
+/**
+ * This header offers a description of the CPUs this process may run on, and memory
+ * allocations on a specific NUMA node.
+ *
+ * The topology is read from sysfs once, on first use. Where sysfs is not available,
+ * every CPU is reported as its own core on node 0.
+ *
+ * Node allocations use libnuma when the program is built with HAVE_LIBNUMA, and mbind
+ * otherwise. If the kernel refuses the placement, the memory is placed on the node of
+ * the thread that first touches it.
+ **/
+
+/**
+ * Description of a single CPU.
+ **/
+typedef struct {
+  int cpu;     ///< Operating system CPU number.
+  int node;    ///< NUMA node.
+  int package; ///< Physical package (socket).
+  int core;    ///< Core ID, unique within its package.
+  int thread;  ///< Index of this CPU among the hardware threads of its core.
+} topology_cpu_t;
+
+/**
+ * Order in which topology_cpu_order lists CPUs.
+ **/
+typedef enum {
+  /**
+   * Fill up one node at a time, and all hardware threads of a core before the next core.
+   **/
+  TOPOLOGY_ORDER_COMPACT,
+  /**
+   * Alternate between nodes, and use the first hardware thread of every core before the
+   * second thread of any.
+   **/
+  TOPOLOGY_ORDER_SCATTER,
+} topology_order_t;
+
+/**
+ * Get the number of CPUs this process may run on.
+ **/
+size_t topology_cpu_count(void);
+
+/**
+ * Get the CPUs this process may run on, in a given order.
+ *
+ * @param order Order to list the CPUs in (@see topology_order_t).
+ * @param cpus  Receives the CPUs, must have room for topology_cpu_count() entries.
+ * @return The number of CPUs written to cpus.
+ **/
+size_t topology_cpu_order(topology_order_t order, topology_cpu_t* cpus);
+
+/**
+ * Get the NUMA node of a CPU.
+ *
+ * @param cpu Operating system CPU number.
+ * @return The node, or -1 if the CPU is unknown.
+ **/
+int topology_node_of_cpu(int cpu);
+
+/**
+ * Allocate memory on a NUMA node. The memory is page aligned and zeroed, so only use
+ * this for allocations of at least a few pages.
+ *
+ * @param bytes Number of bytes to allocate.
+ * @param node  The node to place the memory on.
+ * @return A pointer to the memory, or NULL if it could not be allocated.
+ **/
+void* topology_alloc_on_node(size_t bytes, int node);
+
+/**
+ * Release memory allocated with topology_alloc_on_node.
+ *
+ * @param ptr   Pointer returned by topology_alloc_on_node.
+ * @param bytes Size passed to topology_alloc_on_node.
+ **/
+void topology_free_on_node(void* ptr, size_t bytes);
+
+#endif // _MANDELPRIME_TOPOLOGY_H_
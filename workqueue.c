@@ -1,16 +1,101 @@
+#define _GNU_SOURCE
 #include "pthread.h"
+#include "sched.h"
 #include "errno.h"
 #include "stdlib.h"
 #include "string.h"
 
 #include "time.h"
+#include "inttypes.h"
 
 #include "log.h"
+#include "topology.h"
 #include "workqueue.h"
 
+#define INIT_SLOT_SIZE 16
+#define DEFAULT_UNIT_TIME 0.01 ///< Seconds, @see queue_set_target_unit_time.
+#define RATE_SMOOTHING    0.3  ///< Weight of a new observation in unit_sizer_observe.
+#define POOL_MIN_BLOCK    64   ///< Bytes in the smallest pool block, including its header.
+#define POOL_CLASSES      40   ///< Block sizes are POOL_MIN_BLOCK << class.
+#define POOL_MAX_FREE     4    ///< Free blocks kept per size class and worker.
+#define POOL_NODE_MIN     (64 * 1024) ///< Smallest block placed on the node of a pinned worker.
+
+// These macro's have double evaluation, so be weary.
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+/**
+ * Results of a unit, with the time it took to process.
+ **/
+typedef struct {
+  void*  results;
+  double time;
+} finished_t;
+
+char queue_work_pending;
+
+/**
+ * Header in front of every block handed out by queue_alloc.
+ * While a block is on a free list, next links it to the next free block.
+ **/
+typedef union pool_block {
+  struct {
+    unsigned short    size_class;
+    unsigned short    on_node;   ///< Allocated with topology_alloc_on_node.
+    unsigned int      owner;     ///< Worker whose free list the block returns to.
+    union pool_block* next;
+  };
+  long double align; ///< Keep the payload aligned like malloc would.
+} pool_block_t;
+
+/**
+ * Statistics of a single worker, @see queue_get_stats.
+ *
+ * Only the worker itself writes them, with relaxed atomic stores so queue_get_stats can
+ * read them at any time. Every worker has its own cache line, so they are cheap to keep.
+ **/
+typedef struct {
+  uint64_t units;
+  uint64_t busy_ns;
+  uint64_t lock_wait_ns;
+  uint64_t callback_ns;
+  uint64_t idle_ns;
+} __attribute__((aligned(64))) worker_stats_t;
+
+/**
+ * Free blocks of one worker, per size class.
+ **/
+typedef struct {
+  pool_block_t* free[POOL_CLASSES];
+  size_t        free_count[POOL_CLASSES];
+} worker_pool_t;
+
+/**
+ * Per-worker state for QUEUE_SCHEDULER_STEALING.
+ *
+ * tasks is a ring buffer: the owner pushes and pops at bottom, thieves take from top.
+ * Finished results are parked in results until someone holding the queue lock
+ * hands them to report_work; spare is the buffer they are swapped with.
+ **/
+typedef struct {
+  pthread_mutex_t lock;
+
+  void**  tasks;
+  size_t  task_capacity; ///< Always a power of two.
+  size_t  top, bottom;   ///< Tasks are in [top, bottom), modulo task_capacity.
+
+  finished_t* results;
+  size_t  result_count;
+  size_t  result_capacity;
+  finished_t* spare;
+  size_t  spare_capacity;
+} worker_slot_t;
+
 struct work_queue {
   pthread_mutex_t lock;
   pthread_cond_t  cond;
+  pthread_cond_t  work_cond;     ///< Signalled when results are reported, for workers waiting on QUEUE_WORK_PENDING.
+  size_t          parked;        ///< Workers waiting on work_cond.
 
   pthread_t**     worker_threads;
   size_t          worker_count;
@@ -22,66 +107,469 @@ struct work_queue {
   int out_of_work;
   size_t workers_done;
 
+  queue_scheduler_t scheduler;
+  worker_slot_t*  slots[QUEUE_MAX_WORKERS]; ///< Allocated on first use, never freed before the queue.
+  size_t          slot_count;    ///< Number of slots that may have been allocated.
+  size_t          next_submit;   ///< Slot that receives the next task from queue_submit_work.
+  int             request_done;  ///< request_work has returned NULL (stealing only).
+
+  size_t          batch_size;    ///< Units claimed per request round.
+  size_t          prefetch;      ///< Units claimed ahead of the one being processed.
+
+  double          target_unit_time; ///< Seconds a unit should take, for producers that size units.
+  double          report_time;   ///< Processing time of the unit being reported.
+
+  worker_pool_t*  pools;         ///< Free lists per worker, @see queue_alloc.
+  size_t          pool_count;
+
+  worker_stats_t** stats;        ///< Per worker, allocated when the worker first starts.
+  size_t          stats_count;
+  struct timespec start_time;    ///< When the queue was created.
+
+  queue_affinity_t affinity;     ///< How workers are pinned, @see queue_set_affinity.
+  int*            affinity_cpus; ///< Worker i runs on affinity_cpus[i % affinity_count].
+  size_t          affinity_count;
+
+  pthread_t       reporter;      ///< Logs the statistics periodically, @see queue_set_stats_interval.
+  pthread_mutex_t reporter_lock;
+  pthread_cond_t  reporter_cond;
+  double          reporter_interval; ///< 0 if the reporter is not running.
+
   void* priv_data;
 };
 
 typedef struct {
   size_t              worker_id;
   work_queue_t        work_queue;
+  worker_stats_t*     stats;
 } worker_t;
 
+static inline uint64_t now_ns(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+// Only the owning worker writes its statistics.
+static inline void add_stat(uint64_t* counter, uint64_t value)
+{
+  __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+// CPU that worker_id is pinned to, or -1. Must hold queue->lock.
+static int worker_cpu(work_queue_t queue, size_t worker_id)
+{
+  if(queue->affinity == QUEUE_AFFINITY_NONE || queue->affinity_count == 0) return -1;
+  return queue->affinity_cpus[worker_id % queue->affinity_count];
+}
+
+static void release_block(pool_block_t* block)
+{
+  if(block->on_node)
+    topology_free_on_node(block, (size_t)POOL_MIN_BLOCK << block->size_class);
+  else
+    free(block);
+}
+
+// Take the queue lock, and count the time spent waiting for it since start.
+// Returns the time the lock was taken, so callers can chain measurements.
+static inline uint64_t lock_queue(work_queue_t queue, worker_stats_t* stats, uint64_t start)
+{
+  pthread_mutex_lock(&queue->lock);
+  uint64_t now = now_ns();
+  add_stat(&stats->lock_wait_ns, now - start);
+  return now;
+}
+
+// Wait for results that unlock new work, and count the time since start as idle.
+// Must hold queue->lock. Returns the time the wait ended.
+static inline uint64_t park(work_queue_t queue, worker_stats_t* stats, uint64_t start)
+{
+  queue->parked++;
+  pthread_cond_wait(&queue->work_cond, &queue->lock);
+  queue->parked--;
+  uint64_t now = now_ns();
+  add_stat(&stats->idle_ns, now - start);
+  return now;
+}
+
+// Returns the slot for a worker, allocating it if needed. Must hold queue->lock.
+static worker_slot_t* get_slot(work_queue_t queue, size_t index)
+{
+  worker_slot_t* slot = queue->slots[index];
+  if(slot) return slot;
+
+  slot = calloc(1, sizeof(worker_slot_t));
+  pthread_mutex_init(&slot->lock, NULL);
+  slot->task_capacity   = INIT_SLOT_SIZE;
+  slot->tasks           = malloc(slot->task_capacity * sizeof(void*));
+  slot->result_capacity = INIT_SLOT_SIZE;
+  slot->results         = malloc(slot->result_capacity * sizeof(finished_t));
+  slot->spare_capacity  = INIT_SLOT_SIZE;
+  slot->spare           = malloc(slot->spare_capacity * sizeof(finished_t));
+
+  __atomic_store_n(&queue->slots[index], slot, __ATOMIC_RELEASE);
+  if(queue->slot_count <= index)
+    __atomic_store_n(&queue->slot_count, index + 1, __ATOMIC_RELEASE);
+
+  return slot;
+}
+
+static void destroy_slot(worker_slot_t* slot)
+{
+  if(slot->top != slot->bottom)
+    vlog("Warning: destroying a work queue with %zu unprocessed tasks.", slot->bottom - slot->top);
+  pthread_mutex_destroy(&slot->lock);
+  free(slot->tasks);
+  free(slot->results);
+  free(slot->spare);
+  free(slot);
+}
+
+static void push_task(worker_slot_t* slot, void* task)
+{
+  pthread_mutex_lock(&slot->lock);
+  if(slot->bottom - slot->top == slot->task_capacity)
+  { // Full, unwrap into a buffer twice as large.
+    void** tasks = malloc(2 * slot->task_capacity * sizeof(void*));
+    for(size_t i = slot->top; i != slot->bottom; i++)
+      tasks[i - slot->top] = slot->tasks[i & (slot->task_capacity - 1)];
+    free(slot->tasks);
+    slot->tasks = tasks;
+    slot->bottom -= slot->top;
+    slot->top = 0;
+    slot->task_capacity *= 2;
+  }
+  slot->tasks[slot->bottom & (slot->task_capacity - 1)] = task;
+  slot->bottom++;
+  pthread_mutex_unlock(&slot->lock);
+}
+
+// Take the most recently pushed task; used by the slot's own worker.
+static void* pop_task(worker_slot_t* slot)
+{
+  void* task = NULL;
+
+  pthread_mutex_lock(&slot->lock);
+  if(slot->top != slot->bottom)
+  {
+    slot->bottom--;
+    task = slot->tasks[slot->bottom & (slot->task_capacity - 1)];
+  }
+  pthread_mutex_unlock(&slot->lock);
+
+  return task;
+}
+
+// Take the oldest task of another worker.
+static void* steal_task(worker_slot_t* slot)
+{
+  void* task = NULL;
+
+  if(pthread_mutex_trylock(&slot->lock)) return NULL; // Busy, try someone else
+  if(slot->top != slot->bottom)
+  {
+    task = slot->tasks[slot->top & (slot->task_capacity - 1)];
+    slot->top++;
+  }
+  pthread_mutex_unlock(&slot->lock);
+
+  return task;
+}
+
+static void* find_task(work_queue_t queue, size_t worker_id)
+{
+  worker_slot_t* own = __atomic_load_n(&queue->slots[worker_id], __ATOMIC_ACQUIRE);
+  void* task = pop_task(own);
+  if(task) return task;
+
+  size_t slot_count = __atomic_load_n(&queue->slot_count, __ATOMIC_ACQUIRE);
+  for(size_t i = 1; i < slot_count && ! task; i++)
+  {
+    worker_slot_t* victim = __atomic_load_n(&queue->slots[(worker_id + i) % slot_count], __ATOMIC_ACQUIRE);
+    if(victim) task = steal_task(victim);
+  }
+
+  return task;
+}
+
+// Check for unclaimed tasks. Must hold queue->lock.
+static int tasks_pending(work_queue_t queue)
+{
+  int pending = 0;
+
+  for(size_t i = 0; i < queue->slot_count && ! pending; i++)
+  {
+    worker_slot_t* slot = queue->slots[i];
+    if(! slot) continue;
+    pthread_mutex_lock(&slot->lock);
+    pending = slot->top != slot->bottom;
+    pthread_mutex_unlock(&slot->lock);
+  }
+
+  return pending;
+}
+
+static void push_result(worker_slot_t* slot, finished_t finished)
+{
+  pthread_mutex_lock(&slot->lock);
+  if(slot->result_count == slot->result_capacity)
+  {
+    slot->result_capacity *= 2;
+    slot->results = realloc(slot->results, slot->result_capacity * sizeof(finished_t));
+  }
+  slot->results[slot->result_count++] = finished;
+  pthread_mutex_unlock(&slot->lock);
+}
+
+// Hand all parked results to report_work. Must hold queue->lock.
+static void drain_results(work_queue_t queue)
+{
+  for(size_t i = 0; i < queue->slot_count; i++)
+  {
+    worker_slot_t* slot = queue->slots[i];
+    if(! slot) continue;
+
+    // Swap buffers, so the worker can keep parking results while these are reported.
+    pthread_mutex_lock(&slot->lock);
+    finished_t* results = slot->results;
+    size_t count = slot->result_count, capacity = slot->result_capacity;
+    slot->results = slot->spare;
+    slot->result_capacity = slot->spare_capacity;
+    slot->result_count = 0;
+    pthread_mutex_unlock(&slot->lock);
+
+    for(size_t j = 0; j < count; j++)
+    {
+      queue->report_time = results[j].time;
+      queue->report_work(queue, i, results[j].results);
+    }
+
+    // Only the thread holding queue->lock touches spare.
+    slot->spare = results;
+    slot->spare_capacity = capacity;
+
+    if(count && queue->parked)
+      pthread_cond_broadcast(&queue->work_cond);
+  }
+}
+
+static void* stealing_worker_thread(worker_t* worker)
+{
+  work_queue_t queue = worker->work_queue;
+  size_t worker_id = worker->worker_id;
+  worker_stats_t* stats = worker->stats;
+  worker_slot_t* slot = __atomic_load_n(&queue->slots[worker_id], __ATOMIC_ACQUIRE);
+
+  while(__atomic_load_n(&queue->worker_count, __ATOMIC_ACQUIRE) > worker_id)
+  {
+    void* work = find_task(queue, worker_id);
+
+    if(! work)
+    { // No tasks left anywhere, fall back to request_work.
+      uint64_t callback_start = lock_queue(queue, stats, now_ns());
+      drain_results(queue);
+      int pending = 0;
+      if(! queue->request_done && queue->worker_count > worker_id)
+      { // Claim a batch: process the first unit, the rest can be stolen from our deque.
+        for(size_t i = 0; i < queue->batch_size && ! queue->request_done && ! pending; i++)
+        {
+          void* claimed = queue->request_work ? queue->request_work(queue, worker_id) : NULL;
+          if(! claimed)
+            queue->request_done = 1;
+          else if(claimed == QUEUE_WORK_PENDING)
+            pending = 1;
+          else if(! work)
+            work = claimed;
+          else
+            push_task(slot, claimed);
+        }
+      }
+      uint64_t callback_end = now_ns();
+      add_stat(&stats->callback_ns, callback_end - callback_start);
+      if(! work && queue->request_done && ! tasks_pending(queue) && queue->worker_count > worker_id)
+      { // Everything has been handed out and claimed.
+        queue->workers_done++;
+        if(queue->workers_done == queue->worker_count)
+        {
+          queue->out_of_work = 1;
+          pthread_cond_signal(&queue->cond);
+        }
+        pthread_mutex_unlock(&queue->lock);
+        break;
+      }
+      if(! work && pending && ! tasks_pending(queue))
+      { // Nothing to steal either, wait for results that unlock new work.
+        park(queue, stats, callback_end);
+      }
+      pthread_mutex_unlock(&queue->lock);
+      if(! work) continue;
+    }
+
+    uint64_t start = now_ns();
+    finished_t finished;
+    finished.results = queue->process_work(work);
+    uint64_t stop = now_ns();
+    finished.time = (stop - start) / 1e9;
+    add_stat(&stats->busy_ns, stop - start);
+    add_stat(&stats->units, 1);
+
+    // Park the results, and only report them if nobody else holds the lock,
+    // unless other workers are waiting for them.
+    push_result(slot, finished);
+    int locked = pthread_mutex_trylock(&queue->lock) == 0;
+    if(! locked && __atomic_load_n(&queue->parked, __ATOMIC_RELAXED))
+    {
+      stop = lock_queue(queue, stats, stop);
+      locked = 1;
+    }
+    if(locked)
+    {
+      drain_results(queue);
+      add_stat(&stats->callback_ns, now_ns() - stop);
+      pthread_mutex_unlock(&queue->lock);
+    }
+  }
+
+  // Make sure none of our results are left behind.
+  lock_queue(queue, stats, now_ns());
+  drain_results(queue);
+  dlog("Worker %p:%zu is being destroyed.", queue, worker_id);
+  pthread_mutex_unlock(&queue->lock);
+
+  free(worker);
+  return NULL;
+}
+
 static void* worker_thread(void *arg)
 {
   worker_t* worker = (worker_t*)arg;
   work_queue_t queue = worker->work_queue;
+  worker_stats_t* stats = worker->stats;
 
-  pthread_mutex_lock(&queue->lock);
+  if(queue->scheduler == QUEUE_SCHEDULER_STEALING)
+    return stealing_worker_thread(worker);
+
+  // Units claimed but not processed yet, oldest first, and results not reported yet.
+  void** held = NULL;
+  finished_t* done = NULL;
+  size_t held_count = 0, done_count = 0, capacity = 0;
+  int exhausted = 0;
+
+  uint64_t time = lock_queue(queue, stats, now_ns());
   while(1)
   {
+    uint64_t callback_start = time;
+
+    // Report results
+    for(size_t i = 0; i < done_count; i++)
+    {
+      queue->report_time = done[i].time;
+      queue->report_work(queue, worker->worker_id, done[i].results);
+    }
+    if(done_count && queue->parked)
+      pthread_cond_broadcast(&queue->work_cond);
+    done_count = 0;
+
     // Request work:
-    // - Just break if worker_count has been lowered to <= worker id
-    if(queue->worker_count <= worker->worker_id) break;
-    // - Increment workers_done and break if no work left
-    void* work = queue->request_work(queue, worker->worker_id);
-    if(work == NULL)
-    {
-      queue->workers_done++;
-      if(queue->workers_done == queue->worker_count)
-        pthread_cond_signal(&queue->cond); // All workers are done, trigger signal.
+    // - Stop claiming if worker_count has been lowered to <= worker id
+    // - Claim up to a batch of units, plus the ones to prefetch
+    int stopping = queue->worker_count <= worker->worker_id;
+    size_t wanted = queue->batch_size + queue->prefetch;
+    if(wanted > capacity)
+    {
+      capacity = wanted;
+      held = realloc(held, capacity * sizeof(void*));
+      done = realloc(done, capacity * sizeof(finished_t));
+    }
+    int pending = 0;
+    while(! stopping && ! exhausted && ! pending && held_count < wanted)
+    {
+      void* work = queue->request_work(queue, worker->worker_id);
+      if(work == NULL)
+        exhausted = 1;
+      else if(work == QUEUE_WORK_PENDING)
+        pending = 1;
+      else
+        held[held_count++] = work;
+    }
+    time = now_ns();
+    add_stat(&stats->callback_ns, time - callback_start);
+
+    // - Wait if there is nothing to do until other workers report their results
+    if(pending && held_count == 0)
+    {
+      time = park(queue, stats, time);
+      continue;
+    }
+
+    // - Break once everything we claimed has been processed,
+    //   incrementing workers_done if no work is left
+    if(held_count == 0)
+    {
+      if(exhausted && ! stopping)
+      {
+        queue->workers_done++;
+        if(queue->workers_done == queue->worker_count)
+        { // All workers are done, trigger signal.
+          queue->out_of_work = 1;
+          pthread_cond_signal(&queue->cond);
+        }
+      }
       break;
     }
-    
-#if VERBOSE
-    struct timespec start_time, stop_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-#endif
 
-    // Perform work, lock-free
+    // Perform work, lock-free. Prefetched units stay claimed until the next round,
+    // so the next request is made while there is still work in hand.
+    size_t keep = (exhausted || stopping) ? 0 : MIN(queue->prefetch, held_count - 1);
     pthread_mutex_unlock(&queue->lock);
-    void* results = queue->process_work(work);
-    pthread_mutex_lock(&queue->lock);
-    
-#if VERBOSE
-    clock_gettime(CLOCK_MONOTONIC, &stop_time);
-    dlog("Worker %p:%zu has finished a work unit in %1.5lf", queue, worker->worker_id, difftimespec(&stop_time, &start_time));
-#endif
+    time = now_ns();
+    while(held_count > keep)
+    {
+      uint64_t start = time;
 
-    // Report results
-    queue->report_work(queue, worker->worker_id, results);
+      done[done_count].results = queue->process_work(held[0]);
+      memmove(held, held + 1, --held_count * sizeof(void*));
+
+      time = now_ns();
+      done[done_count].time = (time - start) / 1e9;
+      add_stat(&stats->busy_ns, time - start);
+      add_stat(&stats->units, 1);
+      dlog("Worker %p:%zu has finished a work unit in %1.5lf", queue, worker->worker_id, done[done_count].time);
+      done_count++;
+    }
+    time = lock_queue(queue, stats, time);
   }
   dlog("Worker %p:%zu is being destroyed.", queue, worker->worker_id);
   pthread_mutex_unlock(&queue->lock);
 
+  free(held);
+  free(done);
   free(worker);
   return NULL;
 }
 
 work_queue_t create_work_queue(size_t worker_count, void* priv_data,
                                do_work_fp work_func, request_work_fp request_func, report_results_fp report_func)
+{
+  return create_work_queue_with_scheduler(worker_count, priv_data, work_func, request_func, report_func,
+                                          QUEUE_SCHEDULER_GLOBAL);
+}
+
+work_queue_t create_work_queue_with_scheduler(size_t worker_count, void* priv_data,
+                                              do_work_fp work_func, request_work_fp request_func,
+                                              report_results_fp report_func, queue_scheduler_t scheduler)
 {
   work_queue_t queue = calloc(1, sizeof(struct work_queue));
 
   queue->priv_data = priv_data;
+  queue->scheduler = scheduler;
+  queue->batch_size = 1;
+  queue->target_unit_time = DEFAULT_UNIT_TIME;
+  clock_gettime(CLOCK_MONOTONIC, &queue->start_time);
+  pthread_mutex_init(&queue->reporter_lock, NULL);
+  pthread_cond_init(&queue->reporter_cond, NULL);
   
   int failure = 0;
   while((failure = pthread_mutex_init(&queue->lock, NULL)) && errno == EAGAIN);
@@ -101,6 +589,16 @@ work_queue_t create_work_queue(size_t worker_count, void* priv_data,
     return NULL;
   }
 
+  while((failure = pthread_cond_init(&queue->work_cond, NULL)) && errno == EAGAIN);
+  if(failure)
+  {
+    dlog("Failed to create condition variable: %s", strerror(errno));
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+    return NULL;
+  }
+
   queue->process_work = work_func;
   queue->request_work = request_func;
   queue->report_work  = report_func;
@@ -108,6 +606,7 @@ work_queue_t create_work_queue(size_t worker_count, void* priv_data,
   if(queue_set_worker_count(queue, worker_count))
   {
     dlog("Failed to start %zu workers.", worker_count);
+    pthread_cond_destroy(&queue->work_cond);
     pthread_cond_destroy(&queue->cond);
     pthread_mutex_destroy(&queue->lock);
     free(queue);
@@ -119,8 +618,32 @@ work_queue_t create_work_queue(size_t worker_count, void* priv_data,
 
 void destroy_work_queue(work_queue_t queue)
 {
+  queue_set_stats_interval(queue, 0);
   queue_set_worker_count(queue, 0);
   pthread_mutex_lock(&queue->lock);
+  for(size_t i = 0; i < queue->slot_count; i++)
+    if(queue->slots[i]) destroy_slot(queue->slots[i]);
+  for(size_t i = 0; i < queue->pool_count; i++)
+  {
+    for(size_t c = 0; c < POOL_CLASSES; c++)
+    {
+      pool_block_t* block = queue->pools[i].free[c];
+      while(block)
+      {
+        pool_block_t* next = block->next;
+        release_block(block);
+        block = next;
+      }
+    }
+  }
+  free(queue->pools);
+  free(queue->affinity_cpus);
+  for(size_t i = 0; i < queue->stats_count; i++)
+    free(queue->stats[i]);
+  free(queue->stats);
+  pthread_cond_destroy(&queue->reporter_cond);
+  pthread_mutex_destroy(&queue->reporter_lock);
+  pthread_cond_destroy(&queue->work_cond);
   pthread_cond_destroy(&queue->cond);
   pthread_mutex_destroy(&queue->lock);
   free(queue);
@@ -147,7 +670,7 @@ void queue_wait_until_finished(work_queue_t queue)
   size_t worker_count;
   pthread_mutex_lock(&queue->lock);
   worker_count = queue->worker_count;
-  if(! queue->out_of_work)
+  while(! queue->out_of_work)
   {
     pthread_cond_wait(&queue->cond, &queue->lock);
   }
@@ -168,10 +691,18 @@ void queue_wait_until_finished(work_queue_t queue)
 int queue_set_worker_count(work_queue_t queue, size_t worker_count)
 {
   size_t prev_worker_count = queue->worker_count;
-  
+
+  if(queue->scheduler == QUEUE_SCHEDULER_STEALING && worker_count > QUEUE_MAX_WORKERS)
+  {
+    dlog("Cannot start %zu workers, the stealing scheduler supports at most %d.",
+         worker_count, QUEUE_MAX_WORKERS);
+    return 1;
+  }
+
   // Change worker count, which will make excess threads shut down.
   pthread_mutex_lock(&queue->lock);
-  queue->worker_count = worker_count;
+  __atomic_store_n(&queue->worker_count, worker_count, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&queue->work_cond); // Parked workers may have to stop.
   pthread_mutex_unlock(&queue->lock);
   
   // Wait for excess threads to exit - work is never cancelled.
@@ -199,9 +730,40 @@ int queue_set_worker_count(work_queue_t queue, size_t worker_count)
   {
     worker_t* worker = malloc(sizeof(worker_t));
     queue->worker_threads[i] = malloc(sizeof(pthread_t));
+    if(queue->scheduler == QUEUE_SCHEDULER_STEALING) get_slot(queue, i);
+    if(i >= queue->stats_count)
+    {
+      queue->stats = realloc(queue->stats, (i + 1) * sizeof(worker_stats_t*));
+      for(size_t j = queue->stats_count; j <= i; j++)
+      {
+        void* stats = NULL;
+        if(posix_memalign(&stats, sizeof(worker_stats_t), sizeof(worker_stats_t))) stats = malloc(sizeof(worker_stats_t));
+        memset(stats, 0, sizeof(worker_stats_t));
+        queue->stats[j] = stats;
+      }
+      queue->stats_count = i + 1;
+    }
+    worker->stats = queue->stats[i];
     worker->worker_id = i;
     worker->work_queue = queue;
-    pthread_create(queue->worker_threads[i], NULL, worker_thread, worker);
+
+    // Pin the thread before it starts, so its stack is placed on the right node too.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int cpu = worker_cpu(queue, i);
+    if(cpu >= 0)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    if(pthread_create(queue->worker_threads[i], &attr, worker_thread, worker) && cpu >= 0)
+    {
+      dlog("Failed to start worker %zu on CPU %d, starting it unpinned.", i, cpu);
+      pthread_create(queue->worker_threads[i], NULL, worker_thread, worker);
+    }
+    pthread_attr_destroy(&attr);
   }
   pthread_mutex_unlock(&queue->lock);
 
@@ -212,3 +774,310 @@ size_t queue_get_worker_count(work_queue_t queue)
 {
   return queue->worker_count;
 }
+
+int queue_submit_work(work_queue_t queue, void* work)
+{
+  if(queue->scheduler != QUEUE_SCHEDULER_STEALING) return 1;
+
+  pthread_mutex_lock(&queue->lock);
+  size_t targets = queue->worker_count ? queue->worker_count : 1;
+  worker_slot_t* slot = get_slot(queue, queue->next_submit % targets);
+  queue->next_submit++;
+  pthread_mutex_unlock(&queue->lock);
+
+  push_task(slot, work);
+  return 0;
+}
+
+int queue_set_batch_size(work_queue_t queue, size_t batch_size, size_t prefetch)
+{
+  if(batch_size == 0) return 1;
+
+  pthread_mutex_lock(&queue->lock);
+  queue->batch_size = batch_size;
+  queue->prefetch   = prefetch;
+  pthread_mutex_unlock(&queue->lock);
+
+  return 0;
+}
+
+double queue_get_unit_time(work_queue_t queue)
+{
+  return queue->report_time;
+}
+
+void queue_set_target_unit_time(work_queue_t queue, double seconds)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->target_unit_time = seconds;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+double queue_get_target_unit_time(work_queue_t queue)
+{
+  return queue->target_unit_time;
+}
+
+void unit_sizer_init(unit_sizer_t* sizer, uint64_t initial_size, uint64_t min_size, uint64_t max_size)
+{
+  sizer->rate         = 0;
+  sizer->initial_size = initial_size;
+  sizer->min_size     = min_size;
+  sizer->max_size     = max_size;
+}
+
+void unit_sizer_observe(unit_sizer_t* sizer, uint64_t size, double seconds)
+{
+  if(size == 0 || seconds <= 0) return;
+
+  double rate = size / seconds;
+  if(sizer->rate == 0)
+    sizer->rate = rate;
+  else
+    sizer->rate += RATE_SMOOTHING * (rate - sizer->rate);
+}
+
+uint64_t unit_sizer_next(unit_sizer_t* sizer, work_queue_t queue, uint64_t remaining)
+{
+  double size = sizer->rate ? sizer->rate * queue_get_target_unit_time(queue) : sizer->initial_size;
+
+  // Guided self-scheduling: near the end, hand out at most half a fair share
+  // of what is left, so all workers run out at about the same time.
+  size_t workers = MAX(queue_get_worker_count(queue), 1);
+  size = MIN(size, remaining / (2.0 * workers));
+
+  size = MIN(size, sizer->max_size);
+  size = MAX(size, sizer->min_size);
+  return MIN((uint64_t)size, remaining);
+}
+
+void* queue_alloc(work_queue_t queue, size_t worker_id, size_t bytes)
+{
+  unsigned int size_class = 0;
+  while(size_class < POOL_CLASSES - 1 && ((size_t)POOL_MIN_BLOCK << size_class) < bytes + sizeof(pool_block_t))
+    size_class++;
+  if(((size_t)POOL_MIN_BLOCK << size_class) < bytes + sizeof(pool_block_t))
+    return NULL;
+
+  if(worker_id >= queue->pool_count)
+  {
+    size_t count = MAX(worker_id + 1, 2 * queue->pool_count);
+    queue->pools = realloc(queue->pools, count * sizeof(worker_pool_t));
+    memset(queue->pools + queue->pool_count, 0, (count - queue->pool_count) * sizeof(worker_pool_t));
+    queue->pool_count = count;
+  }
+
+  worker_pool_t* pool = queue->pools + worker_id;
+  pool_block_t* block = pool->free[size_class];
+  size_t block_size = (size_t)POOL_MIN_BLOCK << size_class;
+  int node = block_size >= POOL_NODE_MIN ? topology_node_of_cpu(worker_cpu(queue, worker_id)) : -1;
+  if(block)
+  {
+    pool->free[size_class] = block->next;
+    pool->free_count[size_class]--;
+  } else if(node >= 0) {
+    block = topology_alloc_on_node(block_size, node);
+    if(! block) return NULL;
+    block->size_class = size_class;
+    block->on_node = 1;
+  } else {
+    block = malloc(block_size);
+    if(! block) return NULL;
+    block->size_class = size_class;
+    block->on_node = 0;
+  }
+  block->owner = worker_id;
+
+  return block + 1;
+}
+
+void queue_free(work_queue_t queue, void* ptr)
+{
+  if(! ptr) return;
+
+  pool_block_t* block = (pool_block_t*)ptr - 1;
+  if(! queue)
+  {
+    release_block(block);
+    return;
+  }
+
+  worker_pool_t* pool = queue->pools + block->owner;
+  if(pool->free_count[block->size_class] == POOL_MAX_FREE)
+  {
+    release_block(block);
+    return;
+  }
+
+  block->next = pool->free[block->size_class];
+  pool->free[block->size_class] = block;
+  pool->free_count[block->size_class]++;
+}
+
+size_t queue_get_stats(work_queue_t queue, queue_worker_stats_t* stats, size_t max_workers)
+{
+  pthread_mutex_lock(&queue->lock);
+  size_t count = MIN(max_workers, queue->stats_count);
+  for(size_t i = 0; i < count; i++)
+  {
+    worker_stats_t* worker = queue->stats[i];
+    stats[i].units          = __atomic_load_n(&worker->units, __ATOMIC_RELAXED);
+    stats[i].busy_time      = __atomic_load_n(&worker->busy_ns, __ATOMIC_RELAXED) / 1e9;
+    stats[i].lock_wait_time = __atomic_load_n(&worker->lock_wait_ns, __ATOMIC_RELAXED) / 1e9;
+    stats[i].callback_time  = __atomic_load_n(&worker->callback_ns, __ATOMIC_RELAXED) / 1e9;
+    stats[i].idle_time      = __atomic_load_n(&worker->idle_ns, __ATOMIC_RELAXED) / 1e9;
+  }
+  count = queue->stats_count;
+  pthread_mutex_unlock(&queue->lock);
+
+  return count;
+}
+
+void queue_print_stats(work_queue_t queue)
+{
+  size_t count = queue_get_stats(queue, NULL, 0);
+  queue_worker_stats_t* stats = malloc(count * sizeof(queue_worker_stats_t));
+  count = MIN(count, queue_get_stats(queue, stats, count));
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = difftimespec(&now, &queue->start_time);
+
+  vlog("Work queue %p after %.3lf s:", queue, elapsed);
+  for(size_t i = 0; i < count; i++)
+  {
+    vlog(" - worker %zu: %" PRIu64 " units, busy %5.1lf%%, lock wait %5.1lf%%, callbacks %5.1lf%%, idle %5.1lf%%",
+         i, stats[i].units,
+         100 * stats[i].busy_time / elapsed,
+         100 * stats[i].lock_wait_time / elapsed,
+         100 * stats[i].callback_time / elapsed,
+         100 * stats[i].idle_time / elapsed);
+  }
+  free(stats);
+}
+
+static void* reporter_thread(void* arg)
+{
+  work_queue_t queue = arg;
+
+  pthread_mutex_lock(&queue->reporter_lock);
+  while(queue->reporter_interval > 0)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    double seconds = deadline.tv_nsec / 1e9 + queue->reporter_interval;
+    deadline.tv_sec  += (time_t)seconds;
+    deadline.tv_nsec  = (seconds - (time_t)seconds) * 1e9;
+
+    if(pthread_cond_timedwait(&queue->reporter_cond, &queue->reporter_lock, &deadline) == ETIMEDOUT
+       && queue->reporter_interval > 0)
+    {
+      pthread_mutex_unlock(&queue->reporter_lock);
+      queue_print_stats(queue);
+      pthread_mutex_lock(&queue->reporter_lock);
+    }
+  }
+  pthread_mutex_unlock(&queue->reporter_lock);
+
+  return NULL;
+}
+
+void queue_set_stats_interval(work_queue_t queue, double seconds)
+{
+  pthread_mutex_lock(&queue->reporter_lock);
+  int running = queue->reporter_interval > 0;
+  queue->reporter_interval = seconds > 0 ? seconds : 0;
+  pthread_cond_signal(&queue->reporter_cond);
+  pthread_mutex_unlock(&queue->reporter_lock);
+
+  if(running && seconds <= 0)
+    pthread_join(queue->reporter, NULL);
+  else if(! running && seconds > 0)
+    pthread_create(&queue->reporter, NULL, reporter_thread, queue);
+}
+
+size_t queue_default_worker_count(void)
+{
+  size_t count = topology_cpu_count();
+  return count ? count : 1;
+}
+
+int queue_set_affinity(work_queue_t queue, queue_affinity_t policy, const int* cpus, size_t cpu_count)
+{
+  int* order = NULL;
+  size_t count = 0;
+
+  switch(policy)
+  {
+  case QUEUE_AFFINITY_NONE:
+    break;
+  case QUEUE_AFFINITY_COMPACT:
+  case QUEUE_AFFINITY_SCATTER:
+  {
+    topology_cpu_t* topology = malloc(topology_cpu_count() * sizeof(topology_cpu_t));
+    count = topology_cpu_order(policy == QUEUE_AFFINITY_COMPACT ? TOPOLOGY_ORDER_COMPACT : TOPOLOGY_ORDER_SCATTER,
+                               topology);
+    order = malloc(count * sizeof(int));
+    for(size_t i = 0; i < count; i++)
+      order[i] = topology[i].cpu;
+    free(topology);
+    break;
+  }
+  case QUEUE_AFFINITY_LIST:
+    for(size_t i = 0; i < cpu_count; i++)
+    {
+      if(topology_node_of_cpu(cpus[i]) < 0)
+      {
+        dlog("CPU %d is not available to this process.", cpus[i]);
+        return 1;
+      }
+    }
+    count = cpu_count;
+    order = malloc(count * sizeof(int));
+    memcpy(order, cpus, count * sizeof(int));
+    break;
+  }
+  if(policy != QUEUE_AFFINITY_NONE && count == 0)
+  {
+    free(order);
+    return 1;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  free(queue->affinity_cpus);
+  queue->affinity       = policy;
+  queue->affinity_cpus  = order;
+  queue->affinity_count = count;
+
+  // Move the workers that are already running, unpinned workers may use any CPU.
+  cpu_set_t any, set;
+  CPU_ZERO(&any);
+  topology_cpu_t* topology = malloc(topology_cpu_count() * sizeof(topology_cpu_t));
+  size_t all = topology_cpu_order(TOPOLOGY_ORDER_COMPACT, topology);
+  for(size_t c = 0; c < all; c++)
+    CPU_SET(topology[c].cpu, &any);
+  free(topology);
+
+  for(size_t i = 0; i < queue->worker_count; i++)
+  {
+    int cpu = worker_cpu(queue, i);
+    set = any;
+    if(cpu >= 0)
+    {
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(*queue->worker_threads[i], sizeof(set), &set);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return 0;
+}
+
+int queue_get_worker_cpu(work_queue_t queue, size_t worker_id)
+{
+  pthread_mutex_lock(&queue->lock);
+  int cpu = worker_cpu(queue, worker_id);
+  pthread_mutex_unlock(&queue->lock);
+  return cpu;
+}
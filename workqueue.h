@@ -1,6 +1,9 @@
 #ifndef _MANDELPRIME_WORKQUEUE_H_
 #define _MANDELPRIME_WORKQUEUE_H_
 
+#include "stddef.h"
+#include "stdint.h"
+
 /**
  * This header offers an interface for a multithreaded work queue.
  *
@@ -20,6 +23,34 @@
  **/
 typedef struct work_queue* work_queue_t;
 
+/**
+ * Maximum number of workers for QUEUE_SCHEDULER_STEALING.
+ **/
+#define QUEUE_MAX_WORKERS 1024
+
+/**
+ * How work is distributed over the workers of a queue.
+ **/
+typedef enum {
+  /**
+   * Every request_work and report_results call happens under the global queue lock,
+   * one unit per call.
+   **/
+  QUEUE_SCHEDULER_GLOBAL,
+  /**
+   * Every worker has its own deque of tasks, filled by queue_submit_work. Workers
+   * take the newest task from their own deque, steal the oldest task of another
+   * worker when it is empty, and only take the global lock to call request_work
+   * once all deques are empty.
+   *
+   * Results are parked per worker, and reported by whichever worker next manages to
+   * take the global lock without waiting for it. Both callbacks still run under the
+   * global lock, but results may be reported later than in QUEUE_SCHEDULER_GLOBAL,
+   * and with the ID of another worker than the one that produced them.
+   **/
+  QUEUE_SCHEDULER_STEALING,
+} queue_scheduler_t;
+
 /**
  * Function pointer to a function to request more work from a worker thread.
  *
@@ -34,12 +65,25 @@ typedef struct work_queue* work_queue_t;
  * As such, NULL may only be returned if work will never become available for this queue
  * and this work queue should terminate as soon as all threads are .
  *
+ * If no work is available until the results of units that are still being processed
+ * come in, return QUEUE_WORK_PENDING instead. The worker then waits until the next
+ * report_results call before it requests work again. Only do this while units are
+ * outstanding, or the worker will wait forever.
+ *
  * @param queue     The queue for which a thread is requesting new work.
  * @param worker_id The ID of a thread [< get_worker_count(queue)].
- * @return An arbitrary pointer to a work description, or NULL if all work is finished and the worker should stop.
+ * @return An arbitrary pointer to a work description, QUEUE_WORK_PENDING if work will
+ *         become available later, or NULL if all work is finished and the worker should stop.
  **/
 typedef void* (*request_work_fp)(work_queue_t queue, size_t worker_id);
 
+/**
+ * Value a request_work_fp returns when there is no work yet, but there will be once
+ * outstanding results have been reported.
+ **/
+extern char queue_work_pending;
+#define QUEUE_WORK_PENDING ((void*)&queue_work_pending)
+
 /**
  * Function pointer to a function to report results from a worker thread.
  *
@@ -80,6 +124,187 @@ work_queue_t create_work_queue(size_t worker_count,
                                request_work_fp request_func,
                                report_results_fp report_func);
 
+/**
+ * Creates and starts a new work queue with a specific scheduler.
+ *
+ * @see create_work_queue. With QUEUE_SCHEDULER_STEALING, request_func may be NULL if
+ * all work is added with queue_submit_work. To pre-split all work before any worker
+ * runs, create the queue with zero workers, submit the work and then call
+ * queue_set_worker_count.
+ *
+ * @param scheduler How work is distributed over the workers (@see queue_scheduler_t).
+ **/
+work_queue_t create_work_queue_with_scheduler(size_t worker_count,
+                                              void * priv_data,
+                                              do_work_fp work_func,
+                                              request_work_fp request_func,
+                                              report_results_fp report_func,
+                                              queue_scheduler_t scheduler);
+
+/**
+ * Add a task to a queue that uses QUEUE_SCHEDULER_STEALING.
+ *
+ * Tasks are spread round-robin over the worker deques. A queue only finishes once
+ * request_work has returned NULL and all submitted tasks have been processed.
+ *
+ * @param queue The queue to add the task to.
+ * @param work  A work description, as would be returned by a request_work_fp.
+ * @return 0 on success, non-zero if the queue does not use QUEUE_SCHEDULER_STEALING.
+ **/
+int queue_submit_work(work_queue_t queue, void* work);
+
+/**
+ * Change how many units a worker claims at once.
+ *
+ * Every time a worker takes the global lock, it reports all results it has
+ * finished since the last time, and calls request_work until it holds batch_size
+ * units plus prefetch more. It then processes all but the prefetched units without
+ * the lock, so the lock is taken once per batch rather than twice per unit, and the
+ * next units are claimed while the worker still has work in hand.
+ *
+ * With QUEUE_SCHEDULER_STEALING, a worker that falls back to request_work claims
+ * batch_size units and pushes all but the first on its own deque, where other
+ * workers can steal them. Prefetching is not used, the deques already fill that role.
+ *
+ * The default is a batch size of 1 without prefetching: one unit per request.
+ *
+ * @param queue      The queue to change.
+ * @param batch_size Units to claim per request round, at least 1.
+ * @param prefetch   Additional units to keep claimed ahead of processing.
+ * @return 0 on success, non-zero if batch_size is 0.
+ **/
+int queue_set_batch_size(work_queue_t queue, size_t batch_size, size_t prefetch);
+
+/**
+ * Get the time it took to process the unit whose results are being reported.
+ *
+ * Only valid when called from a report_results_fp.
+ *
+ * @param queue The queue that is reporting results.
+ * @return The time spent in do_work_fp for the results being reported, in seconds.
+ **/
+double queue_get_unit_time(work_queue_t queue);
+
+/**
+ * Set how long producers should aim for a single unit of work to take.
+ *
+ * The queue does not size units itself; producers that use a unit_sizer_t read
+ * this value when sizing new units. The default is 10 milliseconds.
+ *
+ * @param queue   The queue to change.
+ * @param seconds Target processing time per unit.
+ **/
+void queue_set_target_unit_time(work_queue_t queue, double seconds);
+
+/**
+ * @return The target processing time per unit for a queue, in seconds.
+ **/
+double queue_get_target_unit_time(work_queue_t queue);
+
+/**
+ * Helper for producers that can split their work into units of any size.
+ *
+ * The producer feeds it the size and processing time (queue_get_unit_time) of every
+ * finished unit, and asks it how large the next unit should be. Sizes are in whatever
+ * the producer uses as a measure of work, e.g. numbers to check.
+ **/
+typedef struct {
+  double   rate;          ///< Smoothed throughput of a single worker, in size per second.
+  uint64_t initial_size;  ///< Size to use until the first unit has finished.
+  uint64_t min_size;
+  uint64_t max_size;
+} unit_sizer_t;
+
+void unit_sizer_init(unit_sizer_t* sizer, uint64_t initial_size, uint64_t min_size, uint64_t max_size);
+
+/**
+ * Record that a unit of a given size took a given time to process.
+ **/
+void unit_sizer_observe(unit_sizer_t* sizer, uint64_t size, double seconds);
+
+/**
+ * Get the size of the next unit.
+ *
+ * Aims for queue_get_target_unit_time(queue) per unit at the observed throughput,
+ * and shrinks units near the end of the work so all workers finish together.
+ *
+ * @param sizer     The sizer.
+ * @param queue     The queue the unit is for.
+ * @param remaining Amount of work that has not been handed out yet.
+ * @return The size of the next unit, between min_size and max_size, but at most remaining.
+ **/
+uint64_t unit_sizer_next(unit_sizer_t* sizer, work_queue_t queue, uint64_t remaining);
+
+/**
+ * Allocate memory from the pool of a worker.
+ *
+ * Every worker has its own free lists, per power-of-two size class. Memory returned
+ * with queue_free goes back to the list of the worker it was allocated for, so a worker
+ * that keeps getting units gets the buffers it used before, which are likely still in
+ * its caches. Only a few free blocks are kept per size class, the rest is freed.
+ *
+ * Blocks of 64 KiB and up for a pinned worker (@see queue_set_affinity) are placed on
+ * the NUMA node of the worker's CPU.
+ *
+ * The pools are not locked: only call this with the queue lock held, i.e. from a
+ * request_work_fp or report_results_fp.
+ *
+ * @param queue     The queue whose pool to use.
+ * @param worker_id The worker the memory is for.
+ * @param bytes     Number of bytes to allocate.
+ * @return A pointer to the memory, or NULL if it could not be allocated.
+ **/
+void* queue_alloc(work_queue_t queue, size_t worker_id, size_t bytes);
+
+/**
+ * Return memory from queue_alloc to the pool of the worker it was allocated for.
+ *
+ * Only call this with the queue lock held, or with a NULL queue once the queue it
+ * came from has been destroyed, which releases the memory to the system.
+ *
+ * @param queue The queue the memory was allocated from, or NULL.
+ * @param ptr   Pointer returned by queue_alloc, or NULL.
+ **/
+void  queue_free(work_queue_t queue, void* ptr);
+
+/**
+ * Runtime statistics of a worker, @see queue_get_stats. Times are in seconds.
+ **/
+typedef struct {
+  uint64_t units;          ///< Units processed.
+  double   busy_time;      ///< Time spent in do_work_fp.
+  double   lock_wait_time; ///< Time spent waiting for the queue lock.
+  double   callback_time;  ///< Time spent in request_work_fp and report_results_fp.
+  double   idle_time;      ///< Time spent waiting for QUEUE_WORK_PENDING to be resolved.
+} queue_worker_stats_t;
+
+/**
+ * Get the runtime statistics of the workers of a queue.
+ *
+ * Every worker that has ever been started is included, also when the worker count has
+ * been lowered since. The statistics are counted at all times, each worker updating
+ * its own cache line, so this is cheap enough to leave on.
+ *
+ * @param queue       The queue to get the statistics of.
+ * @param stats       Array that receives the statistics of worker i at index i.
+ * @param max_workers Size of stats.
+ * @return The number of workers there are statistics for, which may be more than max_workers.
+ **/
+size_t queue_get_stats(work_queue_t queue, queue_worker_stats_t* stats, size_t max_workers);
+
+/**
+ * Log the statistics of all workers, as a percentage of the time since the queue was created.
+ **/
+void queue_print_stats(work_queue_t queue);
+
+/**
+ * Log the statistics of all workers periodically, from a background thread.
+ *
+ * @param queue   The queue to report on.
+ * @param seconds Time between reports, or 0 to stop reporting.
+ **/
+void queue_set_stats_interval(work_queue_t queue, double seconds);
+
 /**
  * Returns the private data of a work queue.
  *
@@ -151,4 +376,44 @@ int queue_set_worker_count(work_queue_t queue, size_t worker_count);
  **/
 size_t queue_get_worker_count(work_queue_t queue);
 
+/**
+ * Get the number of workers that keeps every CPU this process may run on busy.
+ **/
+size_t queue_default_worker_count(void);
+
+/**
+ * How the workers of a queue are pinned to CPUs, @see queue_set_affinity.
+ **/
+typedef enum {
+  QUEUE_AFFINITY_NONE,    ///< Workers are not pinned, the operating system moves them freely.
+  QUEUE_AFFINITY_COMPACT, ///< Fill up one core, then one node at a time (@see TOPOLOGY_ORDER_COMPACT).
+  QUEUE_AFFINITY_SCATTER, ///< Spread workers over nodes and cores first (@see TOPOLOGY_ORDER_SCATTER).
+  QUEUE_AFFINITY_LIST,    ///< Worker i runs on the i-th CPU of an explicit list.
+} queue_affinity_t;
+
+/**
+ * Pin the workers of a queue to CPUs.
+ *
+ * Worker i runs on the i-th CPU in the order given by the policy, wrapping around when
+ * there are more workers than CPUs. Running workers are moved right away, new workers
+ * are started on their CPU. Memory from queue_alloc for a pinned worker is placed on the
+ * NUMA node of its CPU.
+ *
+ * @param queue     The queue to change.
+ * @param policy    How to pick a CPU for every worker (@see queue_affinity_t).
+ * @param cpus      For QUEUE_AFFINITY_LIST, the CPUs to use. Ignored otherwise.
+ * @param cpu_count Number of CPUs in cpus.
+ * @return 0 on success, non-zero if a CPU in the list is not available to this process.
+ **/
+int queue_set_affinity(work_queue_t queue, queue_affinity_t policy, const int* cpus, size_t cpu_count);
+
+/**
+ * Get the CPU a worker is pinned to.
+ *
+ * @param queue     The queue the worker belongs to.
+ * @param worker_id The worker to look up.
+ * @return The CPU number, or -1 if the worker is not pinned.
+ **/
+int queue_get_worker_cpu(work_queue_t queue, size_t worker_id);
+
 #endif // __WORKQUEUE_H_